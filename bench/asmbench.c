@@ -0,0 +1,190 @@
+// Assembler throughput benchmark.
+//
+// Build: gcc -O2 -pthread -I. -Itools -DNO_COMPILER_MAIN -DNO_ASMGEN_MAIN -o asmbench
+//            bench/asmbench.c bench/common.c tools/asmgen.c cpu.c compiler.c -lm
+//
+// ./asmbench [-M MAX_BYTES] [-T TIMEOUT] [-s SEED] [-l LABEL_DENSITY] [-f FORWARD_RATIO] [-m MIX]
+//
+// Generates sources of 1 KiB, 4 KiB, ... up to MAX_BYTES (default 1 GiB)
+// with asmgen and measures jit() on each of them in a child process: lines
+// and megabytes per second and peak RSS. A size that takes longer than
+// TIMEOUT seconds (default 120) is reported as such and ends the series, so
+// superlinear behaviour of the label table or the tokenizer shows up as a
+// falling lines/s column followed by a timeout.
+
+#include "asmgen.h"
+#include "common.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct measurement
+{
+    double seconds;
+    long peak_rss_kb;
+    int retval;
+};
+
+static void child(const char *path, unsigned timeout, int channel)
+{
+    alarm(timeout);
+
+    FILE *source = fopen(path, "r");
+    if (source == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+
+    // keep the assembler's diagnostics out of the results
+    if (freopen("/dev/null", "w", stderr) == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+
+    struct measurement result;
+    uint32_t *binary = NULL;
+    size_t length = 0;
+    uint64_t start = bench_now_ns();
+    result.retval = jit(source, &binary, &length);
+    result.seconds = (double) (bench_now_ns() - start) / 1e9;
+    result.peak_rss_kb = bench_peak_rss_kb();
+
+    fclose(source);
+    free(binary);
+    _exit(write(channel, &result, sizeof(result)) == (ssize_t) sizeof(result) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Assembles the file in a child process.
+ * @return "ok", "timeout", "error" or "crash"
+ */
+static const char *measure(const char *path, unsigned timeout, struct measurement *result)
+{
+    int channel[2];
+    if (pipe(channel) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0) {
+        close(channel[0]);
+        child(path, timeout, channel[1]);
+    }
+
+    close(channel[1]);
+    bool received = read(channel[0], result, sizeof(*result)) == (ssize_t) sizeof(*result);
+    close(channel[0]);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+        continue;
+    }
+
+    if (WIFSIGNALED(wstatus)) {
+        return WTERMSIG(wstatus) == SIGALRM ? "timeout" : "crash";
+    }
+    if (!received || result->retval != 0) {
+        return "error";
+    }
+    return "ok";
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tasmbench [-M MAX_BYTES] [-T TIMEOUT] [-s SEED] [-l LABEL_DENSITY] [-f FORWARD_RATIO] [-m MIX]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct asmgen_options options;
+    asmgen_default_options(&options);
+    size_t max_bytes = 1024 * 1024 * 1024;
+    unsigned timeout = 120;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "M:T:s:l:f:m:")) != -1) {
+        switch (opt) {
+        case 'M':
+            max_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            timeout = (unsigned) atoi(optarg);
+            break;
+        case 's':
+            options.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            options.label_density = atof(optarg);
+            break;
+        case 'f':
+            options.forward_ratio = atof(optarg);
+            break;
+        case 'm':
+            if (asmgen_parse_mix(&options, optarg) != 0) {
+                fprintf(stderr, "Invalid instruction mix %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc || timeout == 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    printf("bytes,lines,labels,references,seconds,lines_per_s,mb_per_s,peak_rss_kb,status\n");
+    for (size_t bytes = 1024; bytes <= max_bytes; bytes *= 4) {
+        char path[] = "/tmp/cpu-asmbench-XXXXXX";
+        int fd = mkstemp(path);
+        FILE *source = (fd >= 0) ? fdopen(fd, "w") : NULL;
+        if (source == NULL) {
+            perror("mkstemp");
+            return EXIT_FAILURE;
+        }
+
+        struct asmgen_stats stats;
+        options.bytes = bytes;
+        bool written = asmgen_write(source, &options, &stats) == 0;
+        written &= fclose(source) == 0;
+        if (!written) {
+            perror(path);
+            unlink(path);
+            return EXIT_FAILURE;
+        }
+
+        struct measurement result;
+        memset(&result, 0, sizeof(result));
+        const char *status = measure(path, timeout, &result);
+        unlink(path);
+
+        bool ok = strcmp(status, "ok") == 0;
+        printf("%zu,%zu,%zu,%zu,%.6f,%.0f,%.3f,%ld,%s\n", stats.bytes, stats.lines, stats.labels,
+                stats.references, result.seconds,
+                ok ? (double) stats.lines / result.seconds : 0.0,
+                ok ? (double) stats.bytes / 1e6 / result.seconds : 0.0,
+                result.peak_rss_kb, status);
+        fflush(stdout);
+
+        if (!ok) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,319 @@
+// Macro benchmark over a corpus of guest programs.
+//
+// Build: gcc -O2 -pthread -I. -DNO_COMPILER_MAIN -o bench bench/bench.c bench/common.c cpu.c compiler.c -lm
+//
+// ./bench [-n RUNS] [-s STACK_CAPACITY] [-b BASELINE] [-t THRESHOLD] PROGRAM.asm...
+//
+// Every program is assembled with jit() and run RUNS times (after one warm-up
+// run) in its own child process, with stdin taken from PROGRAM.in when it
+// exists and guest output discarded. Results are printed as CSV; with -b they
+// are compared with a stored result file and a drop in guest MIPS larger than
+// THRESHOLD percent (default 5) is reported as a regression.
+
+#include "common.h"
+#include "cpu.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_RUNS 1000
+#define NAME_LENGTH 64
+
+struct result
+{
+    char program[NAME_LENGTH];
+    int runs;
+    long long steps;
+    double median_ns;
+    double mad_ns;
+    double mips;
+    double ns_per_instruction;
+    double load_ns;
+    long peak_rss_kb;
+    enum cpu_status status;
+};
+
+struct options
+{
+    int runs;
+    size_t stack_capacity;
+    const char *baseline;
+    double threshold;
+};
+
+static const char *program_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return (slash != NULL) ? slash + 1 : path;
+}
+
+static char *input_path(const char *path)
+{
+    size_t length = strlen(path);
+    if (length > 4 && strcmp(path + length - 4, ".asm") == 0) {
+        length -= 4;
+    }
+
+    char *input = malloc(length + 4);
+    assert(input != NULL);
+    memcpy(input, path, length);
+    strcpy(input + length, ".in");
+
+    if (access(input, R_OK) != 0) {
+        strcpy(input, "/dev/null");
+    }
+    return input;
+}
+
+/**
+ * Loads and runs the image once.
+ * @return false if the program could not be loaded
+ */
+static bool run_once(const int32_t *image, size_t cells, const char *input,
+        size_t stack_capacity, double *load_ns, double *run_ns, long long *steps,
+        enum cpu_status *status)
+{
+    if (freopen(input, "r", stdin) == NULL) {
+        perror(input);
+        return false;
+    }
+
+    uint64_t start = bench_now_ns();
+    FILE *stream = bench_image_stream(image, cells);
+    int32_t *stack_bottom;
+    int32_t *memory = (stream != NULL) ? cpu_create_memory(stream, stack_capacity, &stack_bottom) : NULL;
+    struct cpu *cpu = (memory != NULL) ? cpu_create(memory, stack_bottom, stack_capacity) : NULL;
+    if (stream != NULL) {
+        fclose(stream);
+    }
+    uint64_t loaded = bench_now_ns();
+
+    if (cpu == NULL) {
+        free(memory);
+        return false;
+    }
+
+    *steps = cpu_run(cpu, (size_t) LLONG_MAX);
+    fflush(stdout);
+    uint64_t finished = bench_now_ns();
+
+    *load_ns = (double) (loaded - start);
+    *run_ns = (double) (finished - loaded);
+    *status = cpu_get_status(cpu);
+
+    cpu_destroy(cpu);
+    free(cpu);
+    return true;
+}
+
+static bool measure(const char *path, const struct options *options, struct result *result)
+{
+    size_t cells;
+    int32_t *image = bench_assemble(path, &cells);
+    if (image == NULL) {
+        return false;
+    }
+
+    char *input = input_path(path);
+    double run_samples[MAX_RUNS];
+    double load_samples[MAX_RUNS];
+    bool ok = true;
+
+    for (int i = -1; ok && i < options->runs; ++i) {
+        double load_ns;
+        double run_ns;
+        ok = run_once(image, cells, input, options->stack_capacity, &load_ns, &run_ns,
+                &result->steps, &result->status);
+        if (ok && i >= 0) {
+            load_samples[i] = load_ns;
+            run_samples[i] = run_ns;
+        }
+    }
+
+    if (ok) {
+        long long retired = llabs(result->steps);
+        result->runs = options->runs;
+        result->median_ns = bench_median(run_samples, options->runs);
+        result->mad_ns = bench_mad(run_samples, options->runs);
+        result->mips = (double) retired * 1e3 / result->median_ns;
+        result->ns_per_instruction = result->median_ns / (double) (retired > 0 ? retired : 1);
+        result->load_ns = bench_median(load_samples, options->runs);
+        result->peak_rss_kb = bench_peak_rss_kb();
+    } else {
+        fprintf(stderr, "%s: unable to load the program\n", path);
+    }
+
+    free(input);
+    free(image);
+    return ok;
+}
+
+/**
+ * Measures the program in a child process, so that peak RSS and stdio state
+ * are attributed to this program only.
+ */
+static bool measure_isolated(const char *path, const struct options *options, struct result *result)
+{
+    int channel[2];
+    if (pipe(channel) != 0) {
+        perror("pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+
+    if (pid == 0) {
+        close(channel[0]);
+        if (freopen("/dev/null", "w", stdout) == NULL) {
+            _exit(EXIT_FAILURE);
+        }
+
+        memset(result, 0, sizeof(*result));
+        snprintf(result->program, sizeof(result->program), "%s", program_name(path));
+        bool ok = measure(path, options, result)
+                && write(channel[1], result, sizeof(*result)) == (ssize_t) sizeof(*result);
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(channel[1]);
+    bool received = read(channel[0], result, sizeof(*result)) == (ssize_t) sizeof(*result);
+    close(channel[0]);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+        continue;
+    }
+
+    return received && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == EXIT_SUCCESS;
+}
+
+static void print_header(void)
+{
+    printf("program,runs,steps,median_ns,mad_ns,mips,ns_per_instruction,load_ns,peak_rss_kb,status\n");
+}
+
+static void print_result(const struct result *result)
+{
+    printf("%s,%d,%lld,%.0f,%.0f,%.3f,%.3f,%.0f,%ld,%d\n", result->program, result->runs,
+            result->steps, result->median_ns, result->mad_ns, result->mips,
+            result->ns_per_instruction, result->load_ns, result->peak_rss_kb, result->status);
+    fflush(stdout);
+}
+
+/**
+ * Looks the program up in a result file written by an earlier run.
+ * @return guest MIPS of the program in the baseline, NAN if it is not there
+ */
+static double baseline_mips(const char *baseline, const char *program)
+{
+    FILE *file = fopen(baseline, "r");
+    if (file == NULL) {
+        perror(baseline);
+        return NAN;
+    }
+
+    double mips = NAN;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[NAME_LENGTH];
+        double value;
+        if (sscanf(line, "%63[^,],%*[^,],%*[^,],%*[^,],%*[^,],%lf", name, &value) == 2
+                && strcmp(name, program) == 0) {
+            mips = value;
+        }
+    }
+
+    fclose(file);
+    return mips;
+}
+
+static bool regressed(const struct options *options, const struct result *result)
+{
+    if (options->baseline == NULL) {
+        return false;
+    }
+
+    double previous = baseline_mips(options->baseline, result->program);
+    if (isnan(previous)) {
+        fprintf(stderr, "%s: not in baseline\n", result->program);
+        return false;
+    }
+
+    double change = (result->mips - previous) * 100.0 / previous;
+    if (change < -options->threshold) {
+        fprintf(stderr, "REGRESSION %s: %.3f MIPS, baseline %.3f MIPS (%+.1f%%)\n",
+                result->program, result->mips, previous, change);
+        return true;
+    }
+
+    return false;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tbench [-n RUNS] [-s STACK_CAPACITY] [-b BASELINE] [-t THRESHOLD] PROGRAM.asm...\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options = { .runs = 5, .stack_capacity = 1024, .baseline = NULL, .threshold = 5.0 };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            options.runs = atoi(optarg);
+            break;
+        case 's':
+            options.stack_capacity = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            options.baseline = optarg;
+            break;
+        case 't':
+            options.threshold = atof(optarg);
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc || options.runs < 1 || options.runs > MAX_RUNS) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    int regressions = 0;
+
+    print_header();
+    for (int i = optind; i < argc; ++i) {
+        struct result result;
+        if (!measure_isolated(argv[i], &options, &result)) {
+            fprintf(stderr, "%s: benchmark failed\n", argv[i]);
+            failures++;
+            continue;
+        }
+
+        print_result(&result);
+        if (regressed(&options, &result)) {
+            regressions++;
+        }
+    }
+
+    return (failures == 0 && regressions == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#include <assert.h>
+#include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+long bench_peak_rss_kb(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+
+    return usage.ru_maxrss;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+
+    return (da > db) - (da < db);
+}
+
+double bench_percentile(double *samples, size_t count, double p)
+{
+    assert(samples != NULL);
+
+    if (count == 0) {
+        return NAN;
+    }
+
+    qsort(samples, count, sizeof(*samples), double_cmp);
+    double rank = p * (double) (count - 1);
+    size_t low = (size_t) rank;
+    size_t high = (low + 1 < count) ? low + 1 : low;
+    return samples[low] + (samples[high] - samples[low]) * (rank - (double) low);
+}
+
+double bench_median(double *samples, size_t count)
+{
+    return bench_percentile(samples, count, 0.5);
+}
+
+double bench_mad(double *samples, size_t count)
+{
+    if (count == 0) {
+        return NAN;
+    }
+
+    double median = bench_median(samples, count);
+    double *deviations = malloc(count * sizeof(*deviations));
+    assert(deviations != NULL);
+
+    for (size_t i = 0; i < count; ++i) {
+        deviations[i] = fabs(samples[i] - median);
+    }
+
+    double mad = bench_median(deviations, count);
+    free(deviations);
+    return mad;
+}
+
+int bench_pin_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int32_t *bench_assemble(const char *path, size_t *cells)
+{
+    assert(path != NULL);
+    assert(cells != NULL);
+
+    FILE *source = fopen(path, "r");
+    if (source == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    uint32_t *binary = NULL;
+    size_t length = 0;
+    int retval = jit(source, &binary, &length);
+    fclose(source);
+
+    if (retval != 0) {
+        fprintf(stderr, "%s: assembly failed with code %d\n", path, retval);
+        free(binary);
+        return NULL;
+    }
+
+    *cells = length;
+    return (int32_t *) binary;
+}
+
+FILE *bench_image_stream(const int32_t *image, size_t cells)
+{
+    // fmemopen may refuse empty buffers, an empty image is a valid program too
+    if (cells == 0) {
+        return tmpfile();
+    }
+
+    return fmemopen((void *) image, cells * sizeof(*image), "rb");
+}
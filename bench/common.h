@@ -0,0 +1,46 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include "isa.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// compiler.c, linked in with -DNO_COMPILER_MAIN
+int jit(FILE *sourcecode, uint32_t **binary, size_t *binary_length);
+
+uint64_t bench_now_ns(void);
+
+long bench_peak_rss_kb(void);
+
+/**
+ * Sorts the samples in place and returns the p-th percentile (0 <= p <= 1).
+ */
+double bench_percentile(double *samples, size_t count, double p);
+
+double bench_median(double *samples, size_t count);
+
+/**
+ * Median absolute deviation of the samples around their median.
+ */
+double bench_mad(double *samples, size_t count);
+
+/**
+ * Pins the calling thread to a single CPU.
+ * @return 0 on success, -1 otherwise
+ */
+int bench_pin_cpu(int cpu);
+
+/**
+ * Assembles the source file with jit().
+ * @return image to be freed by the caller, NULL on any error
+ */
+int32_t *bench_assemble(const char *path, size_t *cells);
+
+/**
+ * Opens the image as a read-only stream for cpu_create_memory.
+ */
+FILE *bench_image_stream(const int32_t *image, size_t cells);
+
+#endif // BENCH_COMMON_H
@@ -0,0 +1,20 @@
+; Arithmetic kernel: a = (3a + c) / 7 for c = N..1
+; Exercises mul, add and div in a tight counted loop.
+
+        movr c 2000000
+        movr a 0
+        movr d 0
+top:
+        movr b 3
+        mul b
+        add c
+        movr b 7
+        div b
+        inc d
+        dec c
+        loop top
+
+        out a
+        movr b 10
+        put b
+        halt
@@ -0,0 +1,27 @@
+; Three nested counted loops, the outer counters are saved on the stack.
+
+        movr a 0
+        movr c 160
+outer:
+        push c
+        movr c 160
+middle:
+        push c
+        movr c 160
+inner:
+        inc a
+        dec c
+        loop inner
+
+        pop c
+        dec c
+        loop middle
+
+        pop c
+        dec c
+        loop outer
+
+        out a
+        movr b 10
+        put b
+        halt
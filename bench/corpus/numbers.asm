@@ -0,0 +1,18 @@
+; Number crunching through in/out: reads integers until EOF and prints
+; 3x / 2 for each of them, one per line.
+
+        movr c 1
+        in a
+        loop body
+        halt
+body:
+        movr b 3
+        mul b
+        movr b 2
+        div b
+        out a
+        movr b 10
+        put b
+        in a
+        loop body
+        halt
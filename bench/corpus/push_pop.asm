@@ -0,0 +1,28 @@
+; Stack churn: pushes 512 values and pops them back while summing,
+; 4000 times over.
+
+        movr a 0
+        movr c 4000
+round:
+        push c
+        movr c 512
+fill:
+        push c
+        dec c
+        loop fill
+
+        movr c 512
+drain:
+        pop b
+        add b
+        dec c
+        loop drain
+
+        pop c
+        dec c
+        loop round
+
+        out a
+        movr b 10
+        put b
+        halt
@@ -0,0 +1,41 @@
+; Stack-array algorithm: repeatedly smooths a 256 element array kept on the
+; stack, x[i] = (x[i] + x[i + 1]) / 2, addressed through load/store and d.
+
+        movr c 256
+        movr a 1
+fill:
+        push a
+        movr b 37
+        mul b
+        movr b 5
+        div b
+        inc a
+        dec c
+        loop fill
+
+        movr c 2000
+pass:
+        push c
+        movr d 0
+        movr c 255
+element:
+        load a 1
+        load b 2
+        add b
+        movr b 2
+        div b
+        store a 1
+        inc d
+        dec c
+        loop element
+
+        pop c
+        dec c
+        loop pass
+
+        movr d 0
+        load a 0
+        out a
+        movr b 10
+        put b
+        halt
@@ -0,0 +1,25 @@
+; Text processing through get/put: echoes the input and folds every
+; character into a running hash, h = 3h / 4 + ch, printed at the end.
+
+        movr d 0
+        movr c 1
+        get a
+        loop body
+        halt
+body:
+        put a
+        swap a d
+        movr b 3
+        mul b
+        movr b 4
+        div b
+        add d
+        swap a d
+        get a
+        loop body
+
+        movr b 10
+        put b
+        out d
+        put b
+        halt
@@ -0,0 +1,315 @@
+// Per-instance memory footprint benchmark.
+//
+// Build: gcc -O2 -pthread -I. -Itools -DNO_COMPILER_MAIN -DNO_PROGGEN_MAIN -o footprint
+//            bench/footprint.c bench/common.c tools/proggen.c cpu.c compiler.c -lm
+//
+// ./footprint [-N MAX_INSTANCES] [-s STACK_CAPACITY] [-k STEPS] [-p PROGRAM.asm | -g SEED]
+//
+// Creates 10^3, 10^4, ... up to MAX_INSTANCES (default 10^5) instances of
+// one image in a fresh child process and measures the resident set, minor
+// page faults and heap usage, first with the instances idle (created, never
+// run), then active (every instance ran STEPS steps) and finally parked
+// with cpu_park() against one shared image. The bytes per instance are
+// attributed to struct cpu (once parked, the record and its side allocations
+// as cpu_parked_size() counts them), the image copy, the stack, the padding
+// cpu_create_memory adds to the memory block, and whatever the allocator and
+// the kernel add on top of the usable block sizes. A parked instance that
+// ran should come to 80 bytes of record and 72 of counters, plus its stack.
+//
+// The image is PROGRAM.asm when given, a proggen program otherwise.
+
+#include "common.h"
+#include "cpu.h"
+#include "proggen.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum state
+{
+    STATE_IDLE,
+    STATE_ACTIVE,
+    STATE_PARKED,
+    STATES
+};
+
+static const char *const state_names[STATES] = { "idle", "active", "parked" };
+
+struct sample
+{
+    size_t instances;
+    enum state state;
+    double rss_bytes;
+    double minor_faults;
+    double struct_bytes;
+    double image_bytes;
+    double stack_bytes;
+    double padding_bytes;
+    double overhead_bytes;
+    bool out_of_memory;
+};
+
+struct usage
+{
+    long resident_bytes;
+    long minor_faults;
+};
+
+static struct usage current_usage(void)
+{
+    struct usage usage = { 0, 0 };
+
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long size_pages = 0;
+    long resident_pages = 0;
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &size_pages, &resident_pages) != 2) {
+            resident_pages = 0;
+        }
+        fclose(statm);
+    }
+    usage.resident_bytes = resident_pages * sysconf(_SC_PAGESIZE);
+
+    struct rusage rusage;
+    if (getrusage(RUSAGE_SELF, &rusage) == 0) {
+        usage.minor_faults = rusage.ru_minflt;
+    }
+    return usage;
+}
+
+static void attribute(struct sample *sample, struct cpu **instances, int32_t **memories,
+        size_t image_cells, size_t stack_capacity, struct usage before)
+{
+    struct usage after = current_usage();
+    double count = (double) sample->instances;
+
+    double usable_struct = 0;
+    double usable_memory = 0;
+    for (size_t i = 0; i < sample->instances; ++i) {
+        usable_struct += (double) malloc_usable_size(instances[i]);
+        usable_memory += (double) malloc_usable_size(memories[i]);
+    }
+
+    sample->rss_bytes = (double) (after.resident_bytes - before.resident_bytes) / count;
+    sample->minor_faults = (double) (after.minor_faults - before.minor_faults) / count;
+    sample->struct_bytes = usable_struct / count;
+    sample->image_bytes = (double) (image_cells * sizeof(int32_t));
+    sample->stack_bytes = (double) (stack_capacity * sizeof(int32_t));
+    sample->padding_bytes = usable_memory / count - sample->image_bytes - sample->stack_bytes;
+    sample->overhead_bytes = sample->rss_bytes - sample->struct_bytes - usable_memory / count;
+}
+
+static void measure_child(const int32_t *image, size_t image_cells, size_t stack_capacity,
+        size_t instances, size_t steps, struct sample samples[STATES])
+{
+    struct cpu **cpus = calloc(instances, sizeof(*cpus));
+    int32_t **memories = calloc(instances, sizeof(*memories));
+    struct cpu_parked **parked = calloc(instances, sizeof(*parked));
+    assert(cpus != NULL && memories != NULL && parked != NULL);
+
+    // touch the bookkeeping arrays before the baseline, they are not per instance
+    memset(cpus, 0, instances * sizeof(*cpus));
+    memset(memories, 0, instances * sizeof(*memories));
+    memset(parked, 0, instances * sizeof(*parked));
+
+    struct usage before = current_usage();
+    for (size_t i = 0; i < instances; ++i) {
+        FILE *stream = bench_image_stream(image, image_cells);
+        int32_t *stack_bottom;
+        memories[i] = (stream != NULL) ? cpu_create_memory(stream, stack_capacity, &stack_bottom) : NULL;
+        if (stream != NULL) {
+            fclose(stream);
+        }
+        cpus[i] = (memories[i] != NULL) ? cpu_create(memories[i], stack_bottom, stack_capacity) : NULL;
+        if (cpus[i] == NULL) {
+            samples[STATE_IDLE].out_of_memory = true;
+            return;
+        }
+    }
+
+    samples[STATE_IDLE].instances = instances;
+    samples[STATE_IDLE].state = STATE_IDLE;
+    attribute(&samples[STATE_IDLE], cpus, memories, image_cells, stack_capacity, before);
+
+    for (size_t i = 0; i < instances; ++i) {
+        cpu_run(cpus[i], steps);
+    }
+
+    samples[STATE_ACTIVE].instances = instances;
+    samples[STATE_ACTIVE].state = STATE_ACTIVE;
+    attribute(&samples[STATE_ACTIVE], cpus, memories, image_cells, stack_capacity, before);
+
+    // the record with its side allocations, without the live stack it carries
+    double record_bytes = 0;
+    double stack_bytes = 0;
+    for (size_t i = 0; i < instances; ++i) {
+        double live_stack = (double) cpu_get_stack_size(cpus[i]) * sizeof(int32_t);
+        parked[i] = cpu_park(cpus[i], image, image_cells, NULL);
+        if (parked[i] == NULL) {
+            samples[STATE_PARKED].out_of_memory = true;
+            return;
+        }
+        free(cpus[i]);
+        stack_bytes += live_stack;
+        record_bytes += (double) cpu_parked_size(parked[i]) - live_stack;
+    }
+
+    // freed memory blocks would otherwise stay resident on the allocator's free lists
+    malloc_trim(0);
+
+    struct sample *sample = &samples[STATE_PARKED];
+    double count = (double) instances;
+    sample->instances = instances;
+    sample->state = STATE_PARKED;
+    struct usage after = current_usage();
+    sample->rss_bytes = (double) (after.resident_bytes - before.resident_bytes) / count;
+    sample->minor_faults = (double) (after.minor_faults - before.minor_faults) / count;
+    sample->struct_bytes = record_bytes / count;
+    sample->stack_bytes = stack_bytes / count;
+    sample->overhead_bytes = sample->rss_bytes - sample->struct_bytes - sample->stack_bytes;
+}
+
+static bool measure(const int32_t *image, size_t image_cells, size_t stack_capacity,
+        size_t instances, size_t steps, struct sample samples[STATES])
+{
+    int channel[2];
+    if (pipe(channel) != 0) {
+        perror("pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+
+    if (pid == 0) {
+        close(channel[0]);
+        if (freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "r", stdin) == NULL) {
+            _exit(EXIT_FAILURE);
+        }
+        memset(samples, 0, STATES * sizeof(*samples));
+        measure_child(image, image_cells, stack_capacity, instances, steps, samples);
+        bool sent = write(channel[1], samples, STATES * sizeof(*samples)) == (ssize_t) (STATES * sizeof(*samples));
+        _exit(sent ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(channel[1]);
+    bool received = read(channel[0], samples, STATES * sizeof(*samples)) == (ssize_t) (STATES * sizeof(*samples));
+    close(channel[0]);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+        continue;
+    }
+
+    if (!received) {
+        // most likely killed by the OOM killer
+        memset(samples, 0, STATES * sizeof(*samples));
+        samples[STATE_IDLE].out_of_memory = true;
+    }
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tfootprint [-N MAX_INSTANCES] [-s STACK_CAPACITY] [-k STEPS] [-p PROGRAM.asm | -g SEED]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_instances = 100000;
+    size_t stack_capacity = 256;
+    size_t steps = 1000;
+    const char *program_path = NULL;
+
+    struct proggen_options options;
+    proggen_default_options(&options);
+    options.io_percent = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "N:s:k:p:g:")) != -1) {
+        switch (opt) {
+        case 'N':
+            max_instances = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            stack_capacity = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            steps = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            program_path = optarg;
+            break;
+        case 'g':
+            options.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    int32_t *image;
+    size_t image_cells;
+    if (program_path != NULL) {
+        image = bench_assemble(program_path, &image_cells);
+    } else {
+        struct proggen_program program;
+        image = NULL;
+        if (proggen_generate(&options, &program) == 0) {
+            image = program.image;
+            image_cells = program.cells;
+            program.image = NULL;
+            proggen_free(&program);
+        }
+    }
+    if (image == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    printf("instances,state,rss_bytes,minor_faults,struct_bytes,image_bytes,stack_bytes,padding_bytes,overhead_bytes\n");
+    for (size_t instances = 1000; instances <= max_instances; instances *= 10) {
+        struct sample samples[STATES];
+        if (!measure(image, image_cells, stack_capacity, instances, steps, samples)) {
+            break;
+        }
+
+        bool out_of_memory = false;
+        for (int i = 0; i < STATES; ++i) {
+            out_of_memory |= samples[i].out_of_memory;
+            if (out_of_memory) {
+                printf("%zu,%s,out_of_memory,,,,,,\n", instances, state_names[i]);
+                break;
+            }
+            printf("%zu,%s,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n", instances,
+                    state_names[i], samples[i].rss_bytes,
+                    samples[i].minor_faults, samples[i].struct_bytes, samples[i].image_bytes,
+                    samples[i].stack_bytes, samples[i].padding_bytes, samples[i].overhead_bytes);
+        }
+        fflush(stdout);
+
+        if (out_of_memory) {
+            break;
+        }
+    }
+
+    free(image);
+    return EXIT_SUCCESS;
+}
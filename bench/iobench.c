@@ -0,0 +1,772 @@
+// I/O-bound workload benchmark over pipes and files.
+//
+// Build: gcc -O2 -pthread -I. -DNO_COMPILER_MAIN -o iobench bench/iobench.c bench/common.c cpu.c compiler.c -lm
+//
+// ./iobench [-n RUNS] [-s SIZES] [-w WORKLOADS] [-t TRANSPORTS] [-d DIRECTORY]
+//
+// Every workload is a guest program that does little besides one I/O path:
+//
+//  - get, in, inb:       read text, numbers or raw words to the end of input
+//  - put, out, outb:      write text, numbers or raw words
+//  - get_put, in_out, inb_outb: echo text, numbers or raw words
+//
+// SIZES (comma separated, K/M/G suffixes, default 1M,64M, up to 10G and
+// rounded up to whole MiB) is the amount of input or output. With the `pipe`
+// transport the data comes from a source process and goes to a sink process,
+// both moving 1 MiB per system call; with `file` it is read from and written
+// to files in DIRECTORY (default /tmp), which are unlinked right away.
+//
+// Every configuration runs RUNS times (default 3), each in a fresh emulator
+// process. The CSV holds the medians of the guest bytes moved per second
+// (input plus output), the read and write system calls and the CPU time of
+// the emulator per MiB moved, the share of the run the guest spent blocked
+// in I/O, and the CPU share of the busier helper process, which stays far
+// below 100% as long as the source and the sink are not the bottleneck.
+
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "cpu.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MIB (1024 * 1024)
+#define MAX_RUNS 100
+#define MAX_SIZES 16
+#define MAX_SIZE_MIB (10 * 1024)
+#define STACK_CAPACITY 16
+
+enum data
+{
+    DATA_NONE,
+    DATA_TEXT,
+    DATA_NUMBERS,
+    DATA_WORDS,
+};
+
+struct workload
+{
+    const char *name;
+    enum data input;
+    // source of the guest, with OUTER and INNER for the output loop counts
+    const char *source;
+    // bytes one pass of the inner output loop writes
+    size_t bytes_per_inner;
+};
+
+// A guest reading to the end of input sees C = 0 from the `get` or `in` that
+// hit it, which ends its `loop`.
+static const struct workload workloads[] = {
+    {
+        "get",
+        DATA_TEXT,
+        "movr c 1\n"
+        "get a\n"
+        "loop body\n"
+        "halt\n"
+        "body:\n"
+        "inc b\n"
+        "get a\n"
+        "loop body\n"
+        "out b\n"
+        "halt\n",
+        0,
+    },
+    {
+        "in",
+        DATA_NUMBERS,
+        "movr c 1\n"
+        "in a\n"
+        "loop body\n"
+        "halt\n"
+        "body:\n"
+        "add b\n"
+        "swap a b\n"
+        "in a\n"
+        "loop body\n"
+        "out b\n"
+        "halt\n",
+        0,
+    },
+    {
+        "put",
+        DATA_NONE,
+        "movr d OUTER\n"
+        "movr a 120\n"
+        "outer:\n"
+        "movr c INNER\n"
+        "inner:\n"
+        "put a\n"
+        "dec c\n"
+        "loop inner\n"
+        "dec d\n"
+        "swap c d\n"
+        "loop next\n"
+        "halt\n"
+        "next:\n"
+        "swap c d\n"
+        "movr c 1\n"
+        "loop outer\n",
+        1,
+    },
+    {
+        "out",
+        DATA_NONE,
+        "movr d OUTER\n"
+        "movr a 1234567\n"
+        "movr b 10\n"
+        "outer:\n"
+        "movr c INNER\n"
+        "inner:\n"
+        "out a\n"
+        "put b\n"
+        "dec c\n"
+        "loop inner\n"
+        "dec d\n"
+        "swap c d\n"
+        "loop next\n"
+        "halt\n"
+        "next:\n"
+        "swap c d\n"
+        "movr c 1\n"
+        "loop outer\n",
+        8,
+    },
+    {
+        "get_put",
+        DATA_TEXT,
+        "movr c 1\n"
+        "get a\n"
+        "loop body\n"
+        "halt\n"
+        "body:\n"
+        "put a\n"
+        "get a\n"
+        "loop body\n"
+        "halt\n",
+        0,
+    },
+    {
+        "in_out",
+        DATA_NUMBERS,
+        "movr c 1\n"
+        "movr b 10\n"
+        "in a\n"
+        "loop body\n"
+        "halt\n"
+        "body:\n"
+        "out a\n"
+        "put b\n"
+        "in a\n"
+        "loop body\n"
+        "halt\n",
+        0,
+    },
+    {
+        "inb",
+        DATA_WORDS,
+        "movr c 1\n"
+        "inb a\n"
+        "loop body\n"
+        "halt\n"
+        "body:\n"
+        "add b\n"
+        "swap a b\n"
+        "inb a\n"
+        "loop body\n"
+        "outb b\n"
+        "halt\n",
+        0,
+    },
+    {
+        "outb",
+        DATA_NONE,
+        "movr d OUTER\n"
+        "movr a 1234567\n"
+        "outer:\n"
+        "movr c INNER\n"
+        "inner:\n"
+        "outb a\n"
+        "dec c\n"
+        "loop inner\n"
+        "dec d\n"
+        "swap c d\n"
+        "loop next\n"
+        "halt\n"
+        "next:\n"
+        "swap c d\n"
+        "movr c 1\n"
+        "loop outer\n",
+        4,
+    },
+    {
+        "inb_outb",
+        DATA_WORDS,
+        "movr c 1\n"
+        "inb a\n"
+        "loop body\n"
+        "halt\n"
+        "body:\n"
+        "outb a\n"
+        "inb a\n"
+        "loop body\n"
+        "halt\n",
+        0,
+    },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+struct sample
+{
+    bool ok;
+    enum cpu_status status;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t syscalls;
+    uint64_t bytes;
+    uint64_t io_blocked_ns;
+    uint64_t helper_cpu_ns;
+};
+
+struct options
+{
+    int runs;
+    size_t sizes_mib[MAX_SIZES];
+    size_t size_count;
+    const char *workloads;
+    const char *transports;
+    const char *directory;
+};
+
+// 1 MiB of input, repeated as often as needed; it ends in whitespace so that
+// no token straddles two copies
+static char text_pattern[MIB];
+static char number_pattern[MIB];
+static char word_pattern[MIB];
+
+static void fill_patterns(void)
+{
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < MIB; ++i) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        text_pattern[i] = (i % 64 == 63) ? '\n' : (char) ('a' + (state >> 33) % 26);
+    }
+
+    size_t length = 0;
+    while (length + 16 < MIB) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        long value = (long) ((state >> 33) % 2000001) - 1000000;
+        length += (size_t) snprintf(number_pattern + length, MIB - length, "%ld%c", value,
+                (state >> 20) % 8 == 0 ? '\n' : ' ');
+    }
+    memset(number_pattern + length, ' ', MIB - length);
+    number_pattern[MIB - 1] = '\n';
+
+    for (size_t i = 0; i < MIB; ++i) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        word_pattern[i] = (char) (state >> 56);
+    }
+}
+
+static const char *pattern(enum data data)
+{
+    switch (data) {
+    case DATA_TEXT:
+        return text_pattern;
+    case DATA_WORDS:
+        return word_pattern;
+    default:
+        return number_pattern;
+    }
+}
+
+static bool write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= (size_t) written;
+    }
+    return true;
+}
+
+static bool write_input(int fd, enum data data, size_t size_mib)
+{
+    for (size_t i = 0; i < size_mib; ++i) {
+        if (!write_all(fd, pattern(data), MIB)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t timeval_ns(struct timeval time)
+{
+    return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_usec * 1000u;
+}
+
+static uint64_t cpu_time_ns(const struct rusage *usage)
+{
+    return timeval_ns(usage->ru_utime) + timeval_ns(usage->ru_stime);
+}
+
+/**
+ * @return read plus write system calls of this process so far
+ */
+static uint64_t syscall_count(void)
+{
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    uint64_t total = 0;
+    char line[128];
+    unsigned long long value;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1) {
+            total += value;
+        }
+    }
+    fclose(file);
+    return total;
+}
+
+static int32_t *assemble(const struct workload *workload, size_t size_mib, size_t *cells)
+{
+    // the output loops write INNER passes of bytes_per_inner bytes OUTER times
+    char source[1024];
+    size_t inner = (workload->bytes_per_inner > 0) ? MIB / workload->bytes_per_inner : 0;
+    const char *text = workload->source;
+    size_t length = 0;
+    while (*text != '\0' && length + 32 < sizeof(source)) {
+        if (strncmp(text, "OUTER", 5) == 0 || strncmp(text, "INNER", 5) == 0) {
+            length += (size_t) snprintf(source + length, sizeof(source) - length, "%zu",
+                    text[0] == 'O' ? size_mib : inner);
+            text += 5;
+        } else {
+            source[length++] = *text++;
+        }
+    }
+    source[length] = '\0';
+
+    FILE *stream = fmemopen(source, length, "r");
+    assert(stream != NULL);
+    uint32_t *binary = NULL;
+    int retval = jit(stream, &binary, cells);
+    fclose(stream);
+    if (retval != 0) {
+        fprintf(stderr, "%s: assembly failed with code %d\n", workload->name, retval);
+        free(binary);
+        return NULL;
+    }
+    return (int32_t *) binary;
+}
+
+/**
+ * Runs the guest on the current stdin and stdout and sends the sample
+ * through RESULT_FD.
+ */
+static void emulate(const int32_t *image, size_t cells, int result_fd)
+{
+    struct sample sample;
+    memset(&sample, 0, sizeof(sample));
+
+    FILE *stream = bench_image_stream(image, cells);
+    int32_t *stack_bottom;
+    int32_t *memory = (stream != NULL) ? cpu_create_memory(stream, STACK_CAPACITY, &stack_bottom) : NULL;
+    struct cpu *cpu = (memory != NULL) ? cpu_create(memory, stack_bottom, STACK_CAPACITY) : NULL;
+    if (stream != NULL) {
+        fclose(stream);
+    }
+
+    if (cpu != NULL) {
+        struct rusage before;
+        struct rusage after;
+        uint64_t syscalls = syscall_count();
+        getrusage(RUSAGE_SELF, &before);
+        uint64_t start = bench_now_ns();
+
+        cpu_run(cpu, (size_t) LLONG_MAX);
+        fflush(stdout);
+
+        sample.wall_ns = bench_now_ns() - start;
+        getrusage(RUSAGE_SELF, &after);
+        sample.cpu_ns = cpu_time_ns(&after) - cpu_time_ns(&before);
+        sample.syscalls = syscall_count() - syscalls;
+
+        struct cpu_stats stats;
+        cpu_get_stats(cpu, &stats);
+        sample.bytes = stats.bytes_in + stats.bytes_out;
+        sample.io_blocked_ns = stats.io_blocked_ns;
+        sample.status = cpu_get_status(cpu);
+        sample.ok = true;
+        cpu_destroy(cpu);
+        free(cpu);
+    }
+
+    _exit(write_all(result_fd, (const char *) &sample, sizeof(sample)) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Starts a process writing SIZE_MIB of input to the write end of CHANNEL.
+ */
+static pid_t start_source(const int channel[2], enum data data, size_t size_mib)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(channel[0]);
+        signal(SIGPIPE, SIG_IGN);
+        int fd = channel[1];
+        _exit(write_input(fd, data, size_mib) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    return pid;
+}
+
+/**
+ * Starts a process reading the read end of CHANNEL to its end. INPUT_FD is
+ * closed in it as well.
+ */
+static pid_t start_sink(const int channel[2], int input_fd)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(channel[1]);
+        close(input_fd);
+        static char buffer[MIB];
+        ssize_t got;
+        while ((got = read(channel[0], buffer, sizeof(buffer))) != 0) {
+            if (got < 0 && errno != EINTR) {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    return pid;
+}
+
+static uint64_t reap(pid_t pid)
+{
+    if (pid <= 0) {
+        return 0;
+    }
+
+    int wstatus;
+    struct rusage usage;
+    while (wait4(pid, &wstatus, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    return cpu_time_ns(&usage);
+}
+
+/**
+ * Runs the workload once over the transport. INPUT_FILE holds the input of
+ * the `file` transport, OUTPUT_FILE receives the output.
+ */
+static struct sample run_once(const struct workload *workload, const int32_t *image, size_t cells,
+        bool pipes, size_t size_mib, int input_file, int output_file)
+{
+    struct sample sample;
+    memset(&sample, 0, sizeof(sample));
+
+    int input_fd;
+    pid_t source = -1;
+    if (workload->input == DATA_NONE) {
+        input_fd = open("/dev/null", O_RDONLY);
+    } else if (pipes) {
+        int channel[2];
+        if (pipe(channel) != 0) {
+            perror("pipe");
+            return sample;
+        }
+        source = start_source(channel, workload->input, size_mib);
+        close(channel[1]);
+        input_fd = channel[0];
+    } else {
+        lseek(input_file, 0, SEEK_SET);
+        input_fd = dup(input_file);
+    }
+
+    int output_fd;
+    pid_t sink = -1;
+    if (pipes) {
+        int channel[2];
+        if (pipe(channel) != 0) {
+            perror("pipe");
+            close(input_fd);
+            return sample;
+        }
+        sink = start_sink(channel, input_fd);
+        close(channel[0]);
+        output_fd = channel[1];
+    } else {
+        if (ftruncate(output_file, 0) != 0) {
+            perror("ftruncate");
+        }
+        lseek(output_file, 0, SEEK_SET);
+        output_fd = dup(output_file);
+    }
+
+    int result[2];
+    if (pipe(result) != 0) {
+        perror("pipe");
+        close(input_fd);
+        close(output_fd);
+        return sample;
+    }
+
+    fflush(stdout);
+    pid_t emulator = fork();
+    if (emulator == 0) {
+        close(result[0]);
+        if (dup2(input_fd, STDIN_FILENO) < 0 || dup2(output_fd, STDOUT_FILENO) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        close(input_fd);
+        close(output_fd);
+        emulate(image, cells, result[1]);
+    }
+
+    // only the emulator may hold the pipe ends, or the sink never sees the end
+    close(result[1]);
+    close(input_fd);
+    close(output_fd);
+
+    bool received = read(result[0], &sample, sizeof(sample)) == (ssize_t) sizeof(sample);
+    close(result[0]);
+    reap(emulator);
+    uint64_t source_ns = reap(source);
+    uint64_t sink_ns = reap(sink);
+
+    if (!received) {
+        memset(&sample, 0, sizeof(sample));
+    }
+    sample.helper_cpu_ns = (source_ns > sink_ns) ? source_ns : sink_ns;
+    return sample;
+}
+
+/**
+ * Creates an unlinked file in DIRECTORY, filled with SIZE_MIB of input.
+ */
+static int temporary_file(const char *directory, enum data data, size_t size_mib)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/iobench-XXXXXX", directory);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    unlink(path);
+
+    if (data != DATA_NONE && !write_input(fd, data, size_mib)) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool listed(const char *list, const char *name)
+{
+    if (list == NULL) {
+        return true;
+    }
+
+    size_t length = strlen(name);
+    for (const char *item = list; item != NULL; item = strchr(item, ',')) {
+        item += (*item == ',');
+        if (strncmp(item, name, length) == 0 && (item[length] == ',' || item[length] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool measure(const struct workload *workload, bool pipes, size_t size_mib, const struct options *options)
+{
+    size_t cells;
+    int32_t *image = assemble(workload, size_mib, &cells);
+    if (image == NULL) {
+        return false;
+    }
+
+    int input_file = -1;
+    int output_file = -1;
+    if (!pipes) {
+        input_file = temporary_file(options->directory, workload->input, size_mib);
+        output_file = temporary_file(options->directory, DATA_NONE, 0);
+        if (input_file < 0 || output_file < 0) {
+            free(image);
+            return false;
+        }
+    }
+
+    double mib_per_s[MAX_RUNS];
+    double syscalls_per_mib[MAX_RUNS];
+    double cpu_ms_per_mib[MAX_RUNS];
+    double blocked_pct[MAX_RUNS];
+    double helper_cpu_pct[MAX_RUNS];
+    enum cpu_status status = CPU_OK;
+    bool ok = true;
+
+    for (int i = 0; ok && i < options->runs; ++i) {
+        struct sample sample = run_once(workload, image, cells, pipes, size_mib, input_file, output_file);
+        ok = sample.ok && sample.wall_ns > 0;
+        if (!ok) {
+            break;
+        }
+
+        double mib = (double) sample.bytes / MIB;
+        double seconds = (double) sample.wall_ns / 1e9;
+        mib_per_s[i] = mib / seconds;
+        syscalls_per_mib[i] = (double) sample.syscalls / mib;
+        cpu_ms_per_mib[i] = (double) sample.cpu_ns / 1e6 / mib;
+        blocked_pct[i] = 100.0 * (double) sample.io_blocked_ns / (double) sample.wall_ns;
+        helper_cpu_pct[i] = 100.0 * (double) sample.helper_cpu_ns / (double) sample.wall_ns;
+        status = sample.status;
+    }
+
+    if (ok) {
+        printf("%s,%s,%zu,%d,%.1f,%.1f,%.2f,%.1f,%.1f,%d\n", workload->name, pipes ? "pipe" : "file",
+                size_mib * MIB, options->runs, bench_median(mib_per_s, options->runs),
+                bench_median(syscalls_per_mib, options->runs), bench_median(cpu_ms_per_mib, options->runs),
+                bench_median(blocked_pct, options->runs), bench_median(helper_cpu_pct, options->runs), status);
+        fflush(stdout);
+    } else {
+        fprintf(stderr, "%s over %s: run failed\n", workload->name, pipes ? "pipe" : "file");
+    }
+
+    if (input_file >= 0) {
+        close(input_file);
+    }
+    if (output_file >= 0) {
+        close(output_file);
+    }
+    free(image);
+    return ok;
+}
+
+/**
+ * Parses "1M,64M,2G" into whole MiB.
+ */
+static bool parse_sizes(const char *list, struct options *options)
+{
+    options->size_count = 0;
+    const char *item = list;
+    while (*item != '\0') {
+        char *end;
+        double value = strtod(item, &end);
+        double scale = 1.0 / MIB;
+        switch (*end) {
+        case 'K':
+        case 'k':
+            scale = 1.0 / 1024;
+            end++;
+            break;
+        case 'M':
+        case 'm':
+            scale = 1.0;
+            end++;
+            break;
+        case 'G':
+        case 'g':
+            scale = 1024.0;
+            end++;
+            break;
+        }
+
+        double mib = value * scale;
+        if (end == item || (*end != ',' && *end != '\0') || mib <= 0 || mib > MAX_SIZE_MIB
+                || options->size_count == MAX_SIZES) {
+            return false;
+        }
+        options->sizes_mib[options->size_count++] = (size_t) mib + ((double) (size_t) mib < mib);
+        item = end + (*end == ',');
+    }
+    return options->size_count > 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tiobench [-n RUNS] [-s SIZES] [-w WORKLOADS] [-t TRANSPORTS] [-d DIRECTORY]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct options options = { .runs = 3, .workloads = NULL, .transports = NULL, .directory = "/tmp" };
+    const char *sizes = "1M,64M";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:w:t:d:")) != -1) {
+        switch (opt) {
+        case 'n':
+            options.runs = atoi(optarg);
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 'w':
+            options.workloads = optarg;
+            break;
+        case 't':
+            options.transports = optarg;
+            break;
+        case 'd':
+            options.directory = optarg;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc || options.runs < 1 || options.runs > MAX_RUNS || !parse_sizes(sizes, &options)) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    fill_patterns();
+
+    int failures = 0;
+    printf("workload,transport,bytes,runs,mib_per_s,syscalls_per_mib,cpu_ms_per_mib,blocked_pct,"
+           "helper_cpu_pct,status\n");
+    for (size_t w = 0; w < WORKLOAD_COUNT; ++w) {
+        if (!listed(options.workloads, workloads[w].name)) {
+            continue;
+        }
+        for (int pipes = 1; pipes >= 0; --pipes) {
+            if (!listed(options.transports, pipes ? "pipe" : "file")) {
+                continue;
+            }
+            for (size_t s = 0; s < options.size_count; ++s) {
+                if (!measure(&workloads[w], pipes, options.sizes_mib[s], &options)) {
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,301 @@
+// Instance lifecycle latency benchmark.
+//
+// Build: gcc -O2 -pthread -I. -DNO_COMPILER_MAIN -o lifecycle bench/lifecycle.c bench/common.c cpu.c compiler.c -lm
+//
+// ./lifecycle [-n SAMPLES] [-x CPU_BINARY] [-H]
+//
+// Measures, for tiny, medium and large images and stack capacities, the
+// latency of every phase a short job goes through in process:
+// cpu_create_memory, cpu_create, the first cpu_step and cpu_destroy. The image
+// is read from a temporary file, as `./cpu` reads it. With -x the emulator
+// binary is also spawned on the same file and timed from exec to exit. Percentiles are printed as CSV, -H adds log2 latency histograms.
+
+#include "common.h"
+#include "cpu.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define HISTOGRAM_BUCKETS 48
+
+extern char **environ;
+
+struct profile
+{
+    const char *name;
+    size_t image_cells;
+    size_t stack_capacity;
+    int samples;
+    int exec_samples;
+};
+
+static const struct profile profiles[] = {
+    { "tiny", 16, 16, 100000, 1000 },
+    { "medium", 64 * 1024, 4096, 5000, 1000 },
+    { "large", 1024 * 1024, 1024 * 1024, 500, 200 },
+};
+
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+enum phase
+{
+    PHASE_CREATE_MEMORY,
+    PHASE_CREATE,
+    PHASE_FIRST_STEP,
+    PHASE_DESTROY,
+    PHASE_TOTAL,
+    PHASE_COUNT
+};
+
+static const char *const phase_names[] = {
+    "cpu_create_memory", "cpu_create", "first_step", "cpu_destroy", "in_process_total"
+};
+
+/**
+ * A `nop; halt` program padded with `nop`s to the requested size.
+ */
+static int32_t *build_image(size_t cells)
+{
+    int32_t *image = calloc(cells, sizeof(*image));
+    assert(image != NULL);
+
+    if (cells > 1) {
+        image[1] = 1;
+    }
+    return image;
+}
+
+static int write_image(const int32_t *image, size_t cells, char *path)
+{
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+
+    size_t length = cells * sizeof(*image);
+    bool ok = write(fd, image, length) == (ssize_t) length;
+    close(fd);
+    if (!ok) {
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+static bool measure_once(const char *image_path, const struct profile *profile, double *samples[])
+{
+    FILE *stream = fopen(image_path, "rb");
+    if (stream == NULL) {
+        perror(image_path);
+        return false;
+    }
+
+    int32_t *stack_bottom;
+    uint64_t t0 = bench_now_ns();
+    int32_t *memory = cpu_create_memory(stream, profile->stack_capacity, &stack_bottom);
+    uint64_t t1 = bench_now_ns();
+    fclose(stream);
+    if (memory == NULL) {
+        return false;
+    }
+
+    uint64_t t2 = bench_now_ns();
+    struct cpu *cpu = cpu_create(memory, stack_bottom, profile->stack_capacity);
+    uint64_t t3 = bench_now_ns();
+    if (cpu == NULL) {
+        free(memory);
+        return false;
+    }
+
+    uint64_t t4 = bench_now_ns();
+    int stepped = cpu_step(cpu);
+    uint64_t t5 = bench_now_ns();
+
+    uint64_t t6 = bench_now_ns();
+    cpu_destroy(cpu);
+    free(cpu);
+    uint64_t t7 = bench_now_ns();
+
+    *samples[PHASE_CREATE_MEMORY]++ = (double) (t1 - t0);
+    *samples[PHASE_CREATE]++ = (double) (t3 - t2);
+    *samples[PHASE_FIRST_STEP]++ = (double) (t5 - t4);
+    *samples[PHASE_DESTROY]++ = (double) (t7 - t6);
+    *samples[PHASE_TOTAL]++ = (double) ((t1 - t0) + (t3 - t2) + (t5 - t4) + (t7 - t6));
+    return stepped == 1;
+}
+
+/**
+ * Spawns `CPU_BINARY run STACK_CAPACITY IMAGE` and waits for it.
+ * @return exec-to-exit latency in ns, NAN on failure
+ */
+static double measure_exec(const char *binary, const char *image_path, size_t stack_capacity)
+{
+    char capacity[32];
+    snprintf(capacity, sizeof(capacity), "%zu", stack_capacity);
+    char *const argv[] = { (char *) binary, "run", capacity, (char *) image_path, NULL };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    uint64_t start = bench_now_ns();
+    int rc = posix_spawn(&pid, binary, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        errno = rc;
+        perror(binary);
+        return NAN;
+    }
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+        continue;
+    }
+    uint64_t finished = bench_now_ns();
+
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+        return NAN;
+    }
+    return (double) (finished - start);
+}
+
+static void print_histogram(const char *profile, const char *phase, const double *samples, int count)
+{
+    long buckets[HISTOGRAM_BUCKETS] = { 0 };
+    for (int i = 0; i < count; ++i) {
+        int bucket = (samples[i] >= 1.0) ? (int) log2(samples[i]) : 0;
+        buckets[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        if (buckets[i] > 0) {
+            fprintf(stderr, "%s,%s,%.0f,%ld\n", profile, phase, ldexp(1.0, i), buckets[i]);
+        }
+    }
+}
+
+static void report(const char *profile, const char *phase, double *samples, int count, bool histogram)
+{
+    double p50 = bench_percentile(samples, count, 0.50);
+    double p99 = bench_percentile(samples, count, 0.99);
+    double p999 = bench_percentile(samples, count, 0.999);
+
+    printf("%s,%s,%d,%.0f,%.0f,%.0f,%.0f,%.0f\n", profile, phase, count,
+            samples[0], p50, p99, p999, samples[count - 1]);
+    fflush(stdout);
+
+    if (histogram) {
+        print_histogram(profile, phase, samples, count);
+    }
+}
+
+static bool run_profile(const struct profile *profile, int samples_override, const char *binary,
+        bool histogram)
+{
+    int count = (samples_override > 0) ? samples_override : profile->samples;
+    int32_t *image = build_image(profile->image_cells);
+
+    double *samples[PHASE_COUNT];
+    double *cursor[PHASE_COUNT];
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        samples[phase] = cursor[phase] = malloc(count * sizeof(double));
+        assert(samples[phase] != NULL);
+    }
+
+    char path[] = "/tmp/cpu-lifecycle-XXXXXX";
+    bool written = write_image(image, profile->image_cells, path) == 0;
+    bool ok = written;
+    for (int i = 0; ok && i < count; ++i) {
+        ok = measure_once(path, profile, cursor);
+    }
+
+    for (int phase = 0; ok && phase < PHASE_COUNT; ++phase) {
+        report(profile->name, phase_names[phase], samples[phase], count, histogram);
+    }
+
+    if (ok && binary != NULL) {
+        int exec_count = (samples_override > 0) ? samples_override : profile->exec_samples;
+        double *exec_samples = realloc(samples[0], exec_count * sizeof(double));
+        assert(exec_samples != NULL);
+        samples[0] = exec_samples;
+
+        for (int i = 0; ok && i < exec_count; ++i) {
+            exec_samples[i] = measure_exec(binary, path, profile->stack_capacity);
+            ok = !isnan(exec_samples[i]);
+        }
+        if (ok) {
+            report(profile->name, "exec_to_exit", exec_samples, exec_count, histogram);
+        }
+    }
+
+    if (written) {
+        unlink(path);
+    }
+
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        free(samples[phase]);
+    }
+    free(image);
+
+    if (!ok) {
+        fprintf(stderr, "%s: measurement failed\n", profile->name);
+    }
+    return ok;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tlifecycle [-n SAMPLES] [-x CPU_BINARY] [-H]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = 0;
+    const char *binary = NULL;
+    bool histogram = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:x:H")) != -1) {
+        switch (opt) {
+        case 'n':
+            samples = atoi(optarg);
+            break;
+        case 'x':
+            binary = optarg;
+            break;
+        case 'H':
+            histogram = true;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc || samples < 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    printf("profile,phase,samples,min_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    for (size_t i = 0; i < PROFILE_COUNT; ++i) {
+        if (!run_profile(&profiles[i], samples, binary, histogram)) {
+            failures++;
+        }
+    }
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
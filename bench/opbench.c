@@ -0,0 +1,451 @@
+// Per-opcode microbenchmarks for the instruction handlers in cpu.c.
+//
+// Build: gcc -O2 -pthread -I. -DNO_COMPILER_MAIN -o opbench bench/opbench.c bench/common.c cpu.c compiler.c profile.c -lm
+//
+// ./opbench [-c CPU] [-n SAMPLES] [-i ITERATIONS] [-C COSTS] [NAME...]
+//
+// Every benchmark is a generated program whose counted loop repeats the
+// measured instruction UNROLL times. The same loop around a baseline body
+// (empty, or whatever the instruction needs around it) is measured as well
+// and subtracted, so the reported cost is that of the handler alone. Results
+// are printed as CSV with the median and spread of the per-instruction cost.
+// With -C the medians are also written as the cost table `./cpu profile`
+// reads from CPU_COSTS.
+//
+// `cocreate` uses up stack on every execution, so it has no benchmark and is
+// left out of the table, where it keeps the default cost.
+
+#include "common.h"
+#include "cpu.h"
+#include "profile.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define UNROLL 50
+#define MAX_SAMPLES 1000
+#define MAX_FRAGMENT 12
+#define DATA_CELLS 4
+#define STACK_CAPACITY 64
+
+// Placeholder for the index of the following instruction in `loop` operands.
+#define NEXT INT32_MIN
+
+// Placeholder for the index of cell CELL of the same fragment.
+#define AT(cell) (INT32_MIN + 1 + (cell))
+
+enum input_kind
+{
+    INPUT_NONE,
+    INPUT_NUMBERS,
+    INPUT_ZERO
+};
+
+struct fragment
+{
+    size_t cells;
+    int32_t words[MAX_FRAGMENT];
+};
+
+struct microbench
+{
+    const char *name;
+    struct fragment setup;
+    struct fragment body;
+    struct fragment baseline;
+    enum input_kind input;
+    // runs with a writable data region of DATA_CELLS cells
+    bool data;
+};
+
+#define FRAGMENT(...) { sizeof((int32_t[]) { __VA_ARGS__ }) / sizeof(int32_t), { __VA_ARGS__ } }
+#define EMPTY { 0, { 0 } }
+
+static const struct microbench benchmarks[] = {
+    { "nop", EMPTY, FRAGMENT(OP_NOP), EMPTY, INPUT_NONE, false },
+    { "add", EMPTY, FRAGMENT(OP_ADD, REGISTER_B), EMPTY, INPUT_NONE, false },
+    { "sub", EMPTY, FRAGMENT(OP_SUB, REGISTER_B), EMPTY, INPUT_NONE, false },
+    { "mul", FRAGMENT(OP_MOVR, REGISTER_B, 1), FRAGMENT(OP_MUL, REGISTER_B), EMPTY, INPUT_NONE, false },
+    { "div", FRAGMENT(OP_MOVR, REGISTER_B, 1), FRAGMENT(OP_DIV, REGISTER_B), EMPTY, INPUT_NONE, false },
+    { "inc", EMPTY, FRAGMENT(OP_INC, REGISTER_A), EMPTY, INPUT_NONE, false },
+    { "dec", EMPTY, FRAGMENT(OP_DEC, REGISTER_A), EMPTY, INPUT_NONE, false },
+    { "loop_taken", EMPTY, FRAGMENT(OP_LOOP, NEXT), EMPTY, INPUT_NONE, false },
+    { "loop_not_taken", EMPTY,
+            FRAGMENT(OP_SWAP, REGISTER_C, REGISTER_D, OP_LOOP, 0, OP_SWAP, REGISTER_C, REGISTER_D),
+            FRAGMENT(OP_SWAP, REGISTER_C, REGISTER_D, OP_SWAP, REGISTER_C, REGISTER_D), INPUT_NONE, false },
+    { "movr", EMPTY, FRAGMENT(OP_MOVR, REGISTER_A, 42), EMPTY, INPUT_NONE, false },
+    { "load", FRAGMENT(OP_PUSH, REGISTER_A, OP_PUSH, REGISTER_A),
+            FRAGMENT(OP_LOAD, REGISTER_A, 1), EMPTY, INPUT_NONE, false },
+    { "store", FRAGMENT(OP_PUSH, REGISTER_A, OP_PUSH, REGISTER_A),
+            FRAGMENT(OP_STORE, REGISTER_A, 1), EMPTY, INPUT_NONE, false },
+    { "in", EMPTY, FRAGMENT(OP_IN, REGISTER_A), EMPTY, INPUT_NUMBERS, false },
+    { "get", EMPTY, FRAGMENT(OP_GET, REGISTER_A), EMPTY, INPUT_ZERO, false },
+    { "out", EMPTY, FRAGMENT(OP_OUT, REGISTER_A), EMPTY, INPUT_NONE, false },
+    { "put", FRAGMENT(OP_MOVR, REGISTER_B, 'x'), FRAGMENT(OP_PUT, REGISTER_B), EMPTY, INPUT_NONE, false },
+    { "swap", EMPTY, FRAGMENT(OP_SWAP, REGISTER_A, REGISTER_B), EMPTY, INPUT_NONE, false },
+    { "push_pop", EMPTY, FRAGMENT(OP_PUSH, REGISTER_A, OP_POP, REGISTER_B), EMPTY, INPUT_NONE, false },
+    { "dload", EMPTY, FRAGMENT(OP_DLOAD, REGISTER_A, 1), EMPTY, INPUT_NONE, true },
+    { "dstore", EMPTY, FRAGMENT(OP_DSTORE, REGISTER_A, 1), EMPTY, INPUT_NONE, true },
+    { "dsize", EMPTY, FRAGMENT(OP_DSIZE, REGISTER_A), EMPTY, INPUT_NONE, true },
+    { "inb", EMPTY, FRAGMENT(OP_INB, REGISTER_A), EMPTY, INPUT_ZERO, false },
+    { "outb", EMPTY, FRAGMENT(OP_OUTB, REGISTER_A), EMPTY, INPUT_NONE, false },
+    { "trap", EMPTY, FRAGMENT(OP_TRAP, CPU_ILLEGAL_INSTRUCTION, 0), EMPTY, INPUT_NONE, false },
+    // the coroutine answers every resume with a yield and a taken loop back to it
+    { "resume_yield",
+            FRAGMENT(OP_MOVR, REGISTER_B, 4, OP_COCREATE, REGISTER_B, AT(8), OP_LOOP, NEXT, OP_YIELD, OP_LOOP, AT(8)),
+            FRAGMENT(OP_RESUME, REGISTER_B), FRAGMENT(OP_LOOP, NEXT), INPUT_NONE, false },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+struct program
+{
+    int32_t *words;
+    size_t cells;
+};
+
+static void emit(struct program *program, int32_t word)
+{
+    program->words[program->cells++] = word;
+}
+
+static void emit_fragment(struct program *program, const struct fragment *fragment)
+{
+    size_t start = program->cells;
+    for (size_t i = 0; i < fragment->cells; ++i) {
+        int32_t word = fragment->words[i];
+        if (word == NEXT) {
+            word = (int32_t) (start + fragment->cells);
+        } else if (word > NEXT && word <= AT(MAX_FRAGMENT)) {
+            word = (int32_t) start + (word - AT(0));
+        }
+        emit(program, word);
+    }
+}
+
+/**
+ * Builds `movr c ITERATIONS; setup; top: body * UNROLL; dec c; loop top; halt`.
+ */
+static struct program build(const struct fragment *setup, const struct fragment *body, int32_t iterations)
+{
+    struct program program;
+    program.cells = 0;
+    program.words = malloc((3 + setup->cells + body->cells * UNROLL + 5) * sizeof(int32_t));
+    assert(program.words != NULL);
+
+    emit(&program, OP_MOVR);
+    emit(&program, REGISTER_C);
+    emit(&program, iterations);
+    emit_fragment(&program, setup);
+
+    int32_t top = (int32_t) program.cells;
+    for (int i = 0; i < UNROLL; ++i) {
+        emit_fragment(&program, body);
+    }
+
+    emit(&program, OP_DEC);
+    emit(&program, REGISTER_C);
+    emit(&program, OP_LOOP);
+    emit(&program, top);
+    emit(&program, OP_HALT);
+    return program;
+}
+
+static bool prepare_input(enum input_kind input, const char *numbers_path)
+{
+    const char *path = "/dev/null";
+    if (input == INPUT_NUMBERS) {
+        path = numbers_path;
+    } else if (input == INPUT_ZERO) {
+        path = "/dev/zero";
+    }
+
+    if (freopen(path, "r", stdin) == NULL) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static bool map_data(struct cpu *cpu, const char *data_path)
+{
+    FILE *data = fopen(data_path, "rb");
+    if (data == NULL) {
+        perror(data_path);
+        return false;
+    }
+
+    // the mapping outlives the file
+    bool mapped = cpu_map_data(cpu, data, true) == 0;
+    fclose(data);
+    return mapped;
+}
+
+/**
+ * Runs the program once.
+ * @return wall time in ns, NAN if the program did not halt cleanly
+ */
+static double sample(const struct program *program, const struct microbench *bench, const char *numbers_path,
+        const char *data_path)
+{
+    if (!prepare_input(bench->input, numbers_path)) {
+        return NAN;
+    }
+
+    FILE *stream = bench_image_stream(program->words, program->cells);
+    int32_t *stack_bottom;
+    int32_t *memory = cpu_create_memory(stream, STACK_CAPACITY, &stack_bottom);
+    fclose(stream);
+    struct cpu *cpu = (memory != NULL) ? cpu_create(memory, stack_bottom, STACK_CAPACITY) : NULL;
+    if (cpu == NULL) {
+        free(memory);
+        return NAN;
+    }
+
+    if (bench->data && !map_data(cpu, data_path)) {
+        cpu_destroy(cpu);
+        free(cpu);
+        return NAN;
+    }
+
+    uint64_t start = bench_now_ns();
+    cpu_run(cpu, (size_t) LLONG_MAX);
+    fflush(stdout);
+    uint64_t elapsed = bench_now_ns() - start;
+
+    enum cpu_status status = cpu_get_status(cpu);
+    cpu_destroy(cpu);
+    free(cpu);
+    return (status == CPU_HALTED) ? (double) elapsed : NAN;
+}
+
+static bool collect(const struct program *program, const struct microbench *bench, const char *numbers_path,
+        const char *data_path, int warmup, int samples, double *results)
+{
+    for (int i = -warmup; i < samples; ++i) {
+        double elapsed = sample(program, bench, numbers_path, data_path);
+        if (isnan(elapsed)) {
+            return false;
+        }
+        if (i >= 0) {
+            results[i] = elapsed;
+        }
+    }
+
+    return true;
+}
+
+static bool run_benchmark(const struct microbench *bench, int32_t iterations, int samples,
+        const char *numbers_path, const char *data_path, FILE *results, double *median_ns)
+{
+    struct program measured = build(&bench->setup, &bench->body, iterations);
+    struct program baseline = build(&bench->setup, &bench->baseline, iterations);
+
+    double measured_ns[MAX_SAMPLES];
+    double baseline_ns[MAX_SAMPLES];
+    bool ok = collect(&measured, bench, numbers_path, data_path, 2, samples, measured_ns)
+            && collect(&baseline, bench, numbers_path, data_path, 2, samples, baseline_ns);
+
+    free(measured.words);
+    free(baseline.words);
+    if (!ok) {
+        fprintf(stderr, "%s: benchmark program failed\n", bench->name);
+        return false;
+    }
+
+    double executed = (double) iterations * UNROLL;
+    double overhead = bench_median(baseline_ns, samples);
+    for (int i = 0; i < samples; ++i) {
+        measured_ns[i] = (measured_ns[i] - overhead) / executed;
+    }
+
+    double median = bench_median(measured_ns, samples);
+    double p25 = bench_percentile(measured_ns, samples, 0.25);
+    double p75 = bench_percentile(measured_ns, samples, 0.75);
+    double mad = bench_mad(measured_ns, samples);
+
+    fprintf(stderr, "%-16s %8.3f ns  (mad %.3f)\n", bench->name, median, mad);
+    fprintf(results, "%s,%d,%.0f,%.4f,%.4f,%.4f,%.4f\n", bench->name, samples, executed, median, mad, p25, p75);
+    fflush(results);
+    *median_ns = median;
+    return true;
+}
+
+/**
+ * Turns the per-benchmark medians into per-opcode costs. `loop` is charged
+ * as taken, push/pop and resume/yield pairs are split evenly and halt, which
+ * runs once per program, costs as much as nop. Opcodes without a benchmark
+ * are left out of the table.
+ */
+static bool write_costs(const char *path, const double medians[])
+{
+    struct cost_table table;
+    for (size_t opcode = 0; opcode < OPCODE_COUNT; ++opcode) {
+        table.costs[opcode] = NAN;
+    }
+
+    for (size_t i = 0; i < BENCHMARK_COUNT; ++i) {
+        double cost = medians[i] > 0 ? medians[i] : 0.0;
+        const char *name = benchmarks[i].name;
+        for (int32_t opcode = 0; opcode < OPCODE_COUNT; ++opcode) {
+            const char *mnemonic = profile_mnemonic(opcode);
+            if (mnemonic != NULL && strcmp(name, mnemonic) == 0) {
+                table.costs[opcode] = cost;
+            }
+        }
+
+        if (strcmp(name, "loop_taken") == 0) {
+            table.costs[OP_LOOP] = cost;
+        } else if (strcmp(name, "push_pop") == 0) {
+            table.costs[OP_PUSH] = table.costs[OP_POP] = cost / 2;
+        } else if (strcmp(name, "resume_yield") == 0) {
+            table.costs[OP_RESUME] = table.costs[OP_YIELD] = cost / 2;
+        }
+    }
+    table.costs[OP_HALT] = table.costs[OP_NOP];
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    bool ok = profile_write_costs(file, &table, "ns per instruction, calibrated by opbench") == 0;
+    ok &= fclose(file) == 0;
+    if (!ok) {
+        perror(path);
+    }
+    return ok;
+}
+
+/**
+ * Writes enough numbers for every `in` executed by a single sample.
+ */
+static bool write_numbers(const char *path, int32_t iterations)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    for (long long i = 0; i < (long long) iterations * UNROLL; ++i) {
+        fputs("7\n", file);
+    }
+
+    return fclose(file) == 0;
+}
+
+static bool selected(const char *name, int argc, char *argv[])
+{
+    if (argc == 0) {
+        return true;
+    }
+
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\topbench [-c CPU] [-n SAMPLES] [-i ITERATIONS] [-C COSTS] [NAME...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int cpu = 0;
+    int samples = 21;
+    int32_t iterations = 20000;
+    const char *costs_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:i:C:")) != -1) {
+        switch (opt) {
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'n':
+            samples = atoi(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        case 'C':
+            costs_path = optarg;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (samples < 1 || samples > MAX_SAMPLES || iterations < 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if (costs_path != NULL && optind != argc) {
+        fprintf(stderr, "A cost table needs every benchmark, drop the NAME arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bench_pin_cpu(cpu) != 0) {
+        perror("sched_setaffinity");
+    }
+
+    char numbers_path[] = "/tmp/cpu-opbench-XXXXXX";
+    int fd = mkstemp(numbers_path);
+    if (fd < 0 || !write_numbers(numbers_path, iterations)) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    char data_path[] = "/tmp/cpu-opbench-data-XXXXXX";
+    static const int32_t data[DATA_CELLS] = { 0 };
+    fd = mkstemp(data_path);
+    if (fd < 0 || write(fd, data, sizeof(data)) != (ssize_t) sizeof(data)) {
+        perror("mkstemp");
+        unlink(numbers_path);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    // Guest output goes to a null sink, results to the original stdout.
+    FILE *results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        unlink(numbers_path);
+        unlink(data_path);
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    double medians[BENCHMARK_COUNT] = { 0 };
+    fprintf(results, "name,samples,executed,median_ns,mad_ns,p25_ns,p75_ns\n");
+    for (size_t i = 0; i < BENCHMARK_COUNT; ++i) {
+        if (selected(benchmarks[i].name, argc - optind, &argv[optind])
+                && !run_benchmark(&benchmarks[i], iterations, samples, numbers_path, data_path, results,
+                        &medians[i])) {
+            failures++;
+        }
+    }
+
+    fflush(results);
+    unlink(numbers_path);
+    unlink(data_path);
+    if (costs_path != NULL && (failures > 0 || !write_costs(costs_path, medians))) {
+        return EXIT_FAILURE;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,391 @@
+// Multi-core scaling benchmark.
+//
+// Build: gcc -O2 -pthread -I. -Itools -DNO_COMPILER_MAIN -DNO_PROGGEN_MAIN -o scaling
+//            bench/scaling.c bench/common.c tools/proggen.c cpu.c compiler.c -lm
+//
+// ./scaling [-w alu|stack|io] [-g SEED] [-n INSTANCES] [-t MAX_THREADS] [-i ITERATIONS]
+//
+// Runs INSTANCES independent machines on 1..MAX_THREADS threads and prints
+// the guest throughput for every thread count, the scaling efficiency
+// relative to one thread, and the spread between the slowest and the fastest
+// thread. Every thread count is measured in four configurations:
+//
+//  - image:     `private` gives each instance its own memory, `shared` lets
+//               all instances execute from one memory block (only for
+//               workloads that never write to the stack)
+//  - placement: `local` creates the instances on the thread that runs them,
+//               `interleaved` creates all of them on the main thread in
+//               round-robin order, so that neighbouring `struct cpu`
+//               allocations belong to different threads
+//
+// A drop in efficiency between `local` and `interleaved` points at false
+// sharing, a drop in the io workload at contention on stdio inside out/put.
+// With -g the workload is a program generated by proggen from SEED instead,
+// without I/O.
+
+#include "common.h"
+#include "cpu.h"
+#include "proggen.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STACK_CAPACITY 64
+#define MAX_THREADS 256
+
+struct workload
+{
+    const char *name;
+    bool writes_stack;
+    const int32_t *body;
+    size_t body_cells;
+};
+
+// loop bodies, run ITERATIONS times with c as the counter
+static const int32_t alu_body[] = {
+    OP_MOVR, REGISTER_B, 3, OP_MUL, REGISTER_B, OP_ADD, REGISTER_C, OP_MOVR, REGISTER_B, 7, OP_DIV, REGISTER_B
+};
+static const int32_t stack_body[] = {
+    OP_PUSH, REGISTER_A, OP_PUSH, REGISTER_B, OP_MOVR, REGISTER_D, 0, OP_LOAD, REGISTER_A, 1,
+    OP_STORE, REGISTER_B, 0, OP_POP, REGISTER_B, OP_POP, REGISTER_A
+};
+static const int32_t io_body[] = { OP_INC, REGISTER_A, OP_OUT, REGISTER_A };
+
+static const struct workload workloads[] = {
+    { "alu", false, alu_body, sizeof(alu_body) / sizeof(int32_t) },
+    { "stack", true, stack_body, sizeof(stack_body) / sizeof(int32_t) },
+    { "io", false, io_body, sizeof(io_body) / sizeof(int32_t) },
+};
+
+static const struct workload generated = { "generated", true, NULL, 0 };
+
+struct config
+{
+    const struct workload *workload;
+    bool shared_image;
+    bool interleaved;
+    size_t instances;
+    int threads;
+};
+
+struct worker
+{
+    pthread_t thread;
+    int index;
+    const struct config *config;
+    const int32_t *image;
+    size_t image_cells;
+    int32_t *shared_memory;
+    int32_t *shared_stack_bottom;
+    pthread_barrier_t *barrier;
+    struct cpu **instances;
+    size_t count;
+    long long steps;
+    double seconds;
+    bool failed;
+};
+
+/**
+ * Builds `movr c ITERATIONS; top: body; dec c; loop top; halt`.
+ */
+static int32_t *build_image(const struct workload *workload, int32_t iterations, size_t *cells)
+{
+    *cells = 3 + workload->body_cells + 5;
+    int32_t *image = malloc(*cells * sizeof(*image));
+    assert(image != NULL);
+
+    size_t i = 0;
+    image[i++] = OP_MOVR;
+    image[i++] = REGISTER_C;
+    image[i++] = iterations;
+    memcpy(&image[i], workload->body, workload->body_cells * sizeof(*image));
+    i += workload->body_cells;
+    image[i++] = OP_DEC;
+    image[i++] = REGISTER_C;
+    image[i++] = OP_LOOP;
+    image[i++] = 3;
+    image[i++] = OP_HALT;
+    return image;
+}
+
+static int32_t *load_image(const int32_t *image, size_t cells, int32_t **stack_bottom)
+{
+    FILE *stream = bench_image_stream(image, cells);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    int32_t *memory = cpu_create_memory(stream, STACK_CAPACITY, stack_bottom);
+    fclose(stream);
+    return memory;
+}
+
+static struct cpu *create_instance(struct worker *worker)
+{
+    if (worker->config->shared_image) {
+        return cpu_create(worker->shared_memory, worker->shared_stack_bottom, STACK_CAPACITY);
+    }
+
+    int32_t *stack_bottom;
+    int32_t *memory = load_image(worker->image, worker->image_cells, &stack_bottom);
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    struct cpu *cpu = cpu_create(memory, stack_bottom, STACK_CAPACITY);
+    if (cpu == NULL) {
+        free(memory);
+    }
+    return cpu;
+}
+
+static void destroy_instance(const struct config *config, struct cpu *cpu)
+{
+    // the shared memory block is released once, by the main thread
+    if (!config->shared_image) {
+        cpu_destroy(cpu);
+    }
+    free(cpu);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+
+    if (!worker->config->interleaved) {
+        for (size_t i = 0; i < worker->count; ++i) {
+            worker->instances[i] = create_instance(worker);
+            worker->failed |= worker->instances[i] == NULL;
+        }
+    }
+
+    pthread_barrier_wait(worker->barrier);
+
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < worker->count && !worker->failed; ++i) {
+        long long performed = cpu_run(worker->instances[i], (size_t) LLONG_MAX);
+        worker->failed |= cpu_get_status(worker->instances[i]) != CPU_HALTED;
+        worker->steps += performed;
+    }
+    fflush(stdout);
+    worker->seconds = (double) (bench_now_ns() - start) / 1e9;
+
+    pthread_barrier_wait(worker->barrier);
+    return NULL;
+}
+
+/**
+ * Runs one configuration.
+ * @return aggregate guest MIPS, negative on failure
+ */
+static double measure(const struct config *config, const int32_t *image, size_t image_cells,
+        double *slowest_mips, double *fastest_mips)
+{
+    struct worker workers[MAX_THREADS];
+    struct cpu **instances = calloc(config->instances, sizeof(*instances));
+    assert(instances != NULL);
+
+    int32_t *shared_stack_bottom = NULL;
+    int32_t *shared_memory = NULL;
+    if (config->shared_image) {
+        shared_memory = load_image(image, image_cells, &shared_stack_bottom);
+        if (shared_memory == NULL) {
+            free(instances);
+            return -1;
+        }
+    }
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, (unsigned) config->threads + 1);
+
+    size_t assigned = 0;
+    for (int t = 0; t < config->threads; ++t) {
+        struct worker *worker = &workers[t];
+        memset(worker, 0, sizeof(*worker));
+        worker->index = t;
+        worker->config = config;
+        worker->image = image;
+        worker->image_cells = image_cells;
+        worker->shared_memory = shared_memory;
+        worker->shared_stack_bottom = shared_stack_bottom;
+        worker->barrier = &barrier;
+        worker->count = config->instances / config->threads
+                + ((size_t) t < config->instances % config->threads ? 1 : 0);
+        worker->instances = &instances[assigned];
+        assigned += worker->count;
+    }
+
+    if (config->interleaved) {
+        // round-robin, so that consecutive allocations go to different threads
+        for (size_t i = 0; i < config->instances; ++i) {
+            struct worker *worker = &workers[i % config->threads];
+            size_t slot = i / config->threads;
+            worker->instances[slot] = create_instance(worker);
+            worker->failed |= worker->instances[slot] == NULL;
+        }
+    }
+
+    for (int t = 0; t < config->threads; ++t) {
+        pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    uint64_t start = bench_now_ns();
+    pthread_barrier_wait(&barrier);
+    double seconds = (double) (bench_now_ns() - start) / 1e9;
+
+    long long steps = 0;
+    bool failed = false;
+    *slowest_mips = -1;
+    *fastest_mips = -1;
+    for (int t = 0; t < config->threads; ++t) {
+        pthread_join(workers[t].thread, NULL);
+        struct worker *worker = &workers[t];
+        failed |= worker->failed;
+        steps += worker->steps;
+
+        double mips = (double) worker->steps / worker->seconds / 1e6;
+        if (*slowest_mips < 0 || mips < *slowest_mips) {
+            *slowest_mips = mips;
+        }
+        if (mips > *fastest_mips) {
+            *fastest_mips = mips;
+        }
+    }
+
+    for (size_t i = 0; i < config->instances; ++i) {
+        if (instances[i] != NULL) {
+            destroy_instance(config, instances[i]);
+        }
+    }
+    free(instances);
+    free(shared_memory);
+    pthread_barrier_destroy(&barrier);
+
+    return failed ? -1 : (double) steps / seconds / 1e6;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tscaling [-w alu|stack|io] [-g SEED] [-n INSTANCES] [-t MAX_THREADS] [-i ITERATIONS]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const struct workload *workload = &workloads[0];
+    size_t instances = 256;
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int32_t iterations = 20000;
+
+    int opt;
+    struct proggen_options options;
+    proggen_default_options(&options);
+    options.io_percent = 0;
+
+    while ((opt = getopt(argc, argv, "w:g:n:t:i:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workload = NULL;
+            for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+                if (strcmp(optarg, workloads[i].name) == 0) {
+                    workload = &workloads[i];
+                }
+            }
+            break;
+        case 'g':
+            workload = &generated;
+            options.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            instances = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            max_threads = atol(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (workload == NULL || optind != argc || instances == 0 || iterations < 1
+            || max_threads < 1 || max_threads > MAX_THREADS) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // Guest output goes to a null sink, results to the original stdout.
+    FILE *results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
+
+    size_t image_cells;
+    int32_t *image;
+    if (workload == &generated) {
+        struct proggen_program program;
+        if (proggen_generate(&options, &program) != 0 || program.stack_capacity > STACK_CAPACITY) {
+            fprintf(stderr, "Unable to generate a program for seed %llu\n", (unsigned long long) options.seed);
+            return EXIT_FAILURE;
+        }
+        image = program.image;
+        image_cells = program.cells;
+        program.image = NULL;
+        proggen_free(&program);
+    } else {
+        image = build_image(workload, iterations, &image_cells);
+    }
+    int failures = 0;
+
+    fprintf(results, "workload,image,placement,threads,instances,mips,efficiency,slowest_thread_mips,fastest_thread_mips\n");
+    for (int shared = 0; shared <= 1; ++shared) {
+        if (shared && workload->writes_stack) {
+            continue;
+        }
+
+        for (int interleaved = 0; interleaved <= 1; ++interleaved) {
+            double single = 0;
+            for (int threads = 1; threads <= max_threads; ++threads) {
+                struct config config = {
+                    .workload = workload,
+                    .shared_image = shared,
+                    .interleaved = interleaved,
+                    .instances = instances,
+                    .threads = threads,
+                };
+
+                double slowest;
+                double fastest;
+                double mips = measure(&config, image, image_cells, &slowest, &fastest);
+                if (mips < 0) {
+                    fprintf(stderr, "%d threads: measurement failed\n", threads);
+                    failures++;
+                    continue;
+                }
+
+                if (threads == 1) {
+                    single = mips;
+                }
+                fprintf(results, "%s,%s,%s,%d,%zu,%.3f,%.3f,%.3f,%.3f\n", workload->name,
+                        shared ? "shared" : "private", interleaved ? "interleaved" : "local",
+                        threads, instances, mips, single > 0 ? mips / (single * threads) : 0.0,
+                        slowest, fastest);
+                fflush(results);
+            }
+        }
+    }
+
+    free(image);
+    fclose(results);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
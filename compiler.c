@@ -9,6 +9,10 @@
 #include <string.h>
 #include <strings.h>
 
+#include "compressed.h"
+#include "decoded.h"
+#include "object.h"
+
 #define LABEL_UNDEFINED ((size_t)(-1))
 
 typedef enum
@@ -50,6 +54,9 @@ struct machinecode
 
 static struct machinecode machinecode;
 
+// position right after the last halt, for telling where code falls through
+static size_t halt_end = LABEL_UNDEFINED;
+
 instruction_info instruction_set[] = {
     { .name = "nop", .args = { ARGTYPE_NONE }, .code = 0x0 },
     { .name = "halt", .args = { ARGTYPE_NONE }, .code = 0x1 },
@@ -87,6 +94,23 @@ instruction_info instruction_set[] = {
     { .name = "jgt", .args = { ARGTYPE_LABEL, ARGTYPE_NONE }, .code = 0x17 },
     { .name = "call", .args = { ARGTYPE_LABEL, ARGTYPE_NONE }, .code = 0x18 },
     { .name = "ret", .args = { ARGTYPE_NONE }, .code = 0x19 },
+    { .name = "dload",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_NUMBER, ARGTYPE_NONE },
+            .code = 0x1a },
+    { .name = "dstore",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_NUMBER, ARGTYPE_NONE },
+            .code = 0x1b },
+    { .name = "dsize", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x1c },
+    { .name = "inb", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x1d },
+    { .name = "outb", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x1e },
+    { .name = "trap",
+            .args = { ARGTYPE_NUMBER, ARGTYPE_LABEL, ARGTYPE_NONE },
+            .code = 0x1f },
+    { .name = "cocreate",
+            .args = { ARGTYPE_REGISTER, ARGTYPE_LABEL, ARGTYPE_NONE },
+            .code = 0x20 },
+    { .name = "yield", .args = { ARGTYPE_NONE }, .code = 0x21 },
+    { .name = "resume", .args = { ARGTYPE_REGISTER, ARGTYPE_NONE }, .code = 0x22 },
 };
 
 static size_t machinecode_push(uint32_t word)
@@ -155,6 +179,7 @@ typedef struct
     size_t *refs;
     size_t refcount;
     size_t definition;
+    bool after_halt;
 } label_record;
 
 typedef struct
@@ -227,6 +252,7 @@ static error_code define_label(const char *label_name)
     }
 
     handle->definition = machinecode.occupied;
+    handle->after_halt = (halt_end == machinecode.occupied);
     return SUCCESS;
 }
 
@@ -287,6 +313,9 @@ static error_code parse_argument_label(char *token)
 static error_code process_instruction(instruction_info *info)
 {
     machinecode_push(info->code);
+    if (info->code == 0x1)
+        halt_end = machinecode.occupied;
+
     for (argtype *arg = info->args; *arg != ARGTYPE_NONE; ++arg) {
         char *token = strtok(NULL, " \r\n\t");
         if (token == NULL) {
@@ -421,6 +450,71 @@ static void dump_code(void)
     printf("};\n");
 }
 
+#ifndef NO_COMPILER_MAIN
+/**
+ * Writes the pre-decoded form of the code, see decoded.h.
+ */
+static void dump_decoded(void)
+{
+    struct decoded_header header = {
+        .magic = DECODED_MAGIC,
+        .version = DECODED_VERSION,
+        .cells = machinecode.occupied,
+        .hash = decoded_hash(machinecode.stream, machinecode.occupied),
+    };
+    fwrite(&header, sizeof(header), 1, stdout);
+
+    for (size_t i = 0; i < machinecode.occupied; ++i) {
+        struct decoded_record record = decoded_record_at(machinecode.stream, machinecode.occupied, i);
+        fwrite(&record, sizeof(record), 1, stdout);
+    }
+}
+
+static void dump_compressed(void)
+{
+    uint8_t *payload = malloc(COMPRESSED_BOUND(machinecode.occupied) + 1);
+    assert(payload != NULL);
+
+    struct compressed_header header = {
+        .magic = COMPRESSED_MAGIC,
+        .version = COMPRESSED_VERSION,
+        .cells = machinecode.occupied,
+        .payload_bytes = compressed_encode(machinecode.stream, machinecode.occupied, payload),
+    };
+    fwrite(&header, sizeof(header), 1, stdout);
+    fwrite(payload, 1, header.payload_bytes, stdout);
+    free(payload);
+}
+#endif
+
+inline static int label_definition_cmp(const void *a, const void *b)
+{
+    const label_record *ia = *(const label_record *const *) a;
+    const label_record *ib = *(const label_record *const *) b;
+
+    if (ia->definition != ib->definition)
+        return (ia->definition < ib->definition) ? -1 : 1;
+    return strcmp(ia->label, ib->label);
+}
+
+/**
+ * Writes one "INDEX LABEL" line per label, in the order of the code.
+ */
+static void dump_map(FILE *map)
+{
+    const label_record **sorted = malloc(labels.num_labels * sizeof(*sorted) + 1);
+    assert(sorted != NULL);
+
+    for (size_t i = 0; i < labels.num_labels; ++i)
+        sorted[i] = &labels.labels[i];
+    qsort(sorted, labels.num_labels, sizeof(*sorted), label_definition_cmp);
+
+    for (size_t i = 0; i < labels.num_labels; ++i)
+        fprintf(map, "%zu %s\n", sorted[i]->definition, sorted[i]->label);
+
+    free(sorted);
+}
+
 static void free_labels(void)
 {
     for (size_t i = 0; i < labels.num_labels; ++i) {
@@ -432,17 +526,121 @@ static void free_labels(void)
     free(labels.labels);
 }
 
+inline static bool is_local_label(const char *label)
+{
+    return label[0] == '.';
+}
+
+inline static int section_cmp(const void *a, const void *b)
+{
+    const struct object_section *ia = a;
+    const struct object_section *ib = b;
+
+    return (ia->start > ib->start) - (ia->start < ib->start);
+}
+
 /**
- * JUST-IN-TIME compiler for the assembly, for direct use in tests.
- * @param binary - where to put the binary stream of instructions (caller is
- * responsible for freing the memory)
- * @param binary_length - where to put information about instructions length
+ * Writes the code as a relocatable object, see object.h.
  * @return 0 on SUCCESS, positive error code otherwise (+ nonempty stderr)
  */
-int jit(FILE *sourcecode, uint32_t **binary, size_t *binary_length)
+static error_code dump_object(FILE *object)
+{
+    size_t relocation_count = 0;
+    size_t names_bytes = 0;
+    for (size_t i = 0; i < labels.num_labels; ++i) {
+        if (labels.labels[i].definition == LABEL_UNDEFINED && is_local_label(labels.labels[i].label)) {
+            fprintf(stderr, "Undefined reference to %s\n", labels.labels[i].label);
+            return ERR_LABEL_UNDEF;
+        }
+        relocation_count += labels.labels[i].refcount;
+        names_bytes += strlen(labels.labels[i].label) + 1;
+    }
+    names_bytes = (names_bytes + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+
+    // a section starts at 0 and at every global label; until the flags are
+    // final they tell whether the section starts right after a halt
+    struct object_section *sections = malloc((labels.num_labels + 1) * sizeof(*sections));
+    assert(sections != NULL);
+    size_t section_count = 0;
+    sections[section_count++] = (struct object_section) { .start = 0, .flags = 0 };
+    for (size_t i = 0; i < labels.num_labels; ++i) {
+        if (!is_local_label(labels.labels[i].label) && labels.labels[i].definition != LABEL_UNDEFINED) {
+            sections[section_count++] = (struct object_section) {
+                .start = labels.labels[i].definition,
+                .flags = labels.labels[i].after_halt,
+            };
+        }
+    }
+    qsort(sections, section_count, sizeof(*sections), section_cmp);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < section_count; ++i) {
+        if (unique == 0 || sections[unique - 1].start != sections[i].start)
+            sections[unique++] = sections[i];
+    }
+    section_count = unique;
+
+    for (size_t i = 0; i < section_count; ++i) {
+        size_t end = (i + 1 < section_count) ? sections[i + 1].start : machinecode.occupied;
+        bool ends_with_halt = (i + 1 < section_count) ? sections[i + 1].flags
+                                                      : halt_end == machinecode.occupied;
+        sections[i].flags = (end > sections[i].start && ends_with_halt) ? 0 : SECTION_FALLS_THROUGH;
+    }
+
+    struct object_header header = {
+        .magic = OBJECT_MAGIC,
+        .version = OBJECT_VERSION,
+        .code_cells = machinecode.occupied,
+        .section_count = section_count,
+        .symbol_count = labels.num_labels,
+        .relocation_count = relocation_count,
+        .names_bytes = names_bytes,
+    };
+    fwrite(&header, sizeof(header), 1, object);
+    fwrite(machinecode.stream, sizeof(*machinecode.stream), machinecode.occupied, object);
+    fwrite(sections, sizeof(*sections), section_count, object);
+    free(sections);
+
+    uint32_t name = 0;
+    for (size_t i = 0; i < labels.num_labels; ++i) {
+        size_t definition = labels.labels[i].definition;
+        struct object_symbol symbol = {
+            .name = name,
+            .value = (definition == LABEL_UNDEFINED) ? OBJECT_UNDEFINED : definition,
+            .flags = is_local_label(labels.labels[i].label) ? SYMBOL_LOCAL : 0,
+        };
+        fwrite(&symbol, sizeof(symbol), 1, object);
+        name += strlen(labels.labels[i].label) + 1;
+    }
+
+    for (size_t i = 0; i < labels.num_labels; ++i) {
+        for (size_t j = 0; j < labels.labels[i].refcount; ++j) {
+            struct object_relocation relocation = { .offset = labels.labels[i].refs[j], .symbol = i };
+            fwrite(&relocation, sizeof(relocation), 1, object);
+        }
+    }
+
+    for (size_t i = 0; i < labels.num_labels; ++i)
+        fwrite(labels.labels[i].label, 1, strlen(labels.labels[i].label) + 1, object);
+    for (; name < names_bytes; ++name)
+        fputc('\0', object);
+
+    return SUCCESS;
+}
+
+/**
+ * Assembles the source into machinecode and the label table, without
+ * resolving any label.
+ * @return 0 on SUCCESS, positive error code otherwise (+ nonempty stderr)
+ */
+static error_code assemble(FILE *sourcecode)
 {
     error_code retval = SUCCESS;
 
+    // the previous stream now belongs to the previous caller
+    memset(&machinecode, 0, sizeof(machinecode));
+    halt_end = LABEL_UNDEFINED;
+
     sort_instructions();
     init_label_table();
 
@@ -459,9 +657,24 @@ int jit(FILE *sourcecode, uint32_t **binary, size_t *binary_length)
     if (line != NULL)
         free(line);
 
+    return retval;
+}
+
+/**
+ * JUST-IN-TIME compiler for the assembly, also writing the label map.
+ * @param map - where to write the index of every label, may be NULL
+ * @return 0 on SUCCESS, positive error code otherwise (+ nonempty stderr)
+ */
+int jit_map(FILE *sourcecode, uint32_t **binary, size_t *binary_length, FILE *map)
+{
+    error_code retval = assemble(sourcecode);
+
     if (retval == SUCCESS)
         retval = patch();
 
+    if (retval == SUCCESS && map != NULL)
+        dump_map(map);
+
     if (labels.labels != NULL)
         free_labels();
 
@@ -471,6 +684,39 @@ int jit(FILE *sourcecode, uint32_t **binary, size_t *binary_length)
     return retval;
 }
 
+/**
+ * Compiles the assembly into a relocatable object for the linker. Labels
+ * that are not defined become external symbols.
+ * @return 0 on SUCCESS, positive error code otherwise (+ nonempty stderr)
+ */
+int jit_object(FILE *sourcecode, FILE *object)
+{
+    error_code retval = assemble(sourcecode);
+
+    if (retval == SUCCESS)
+        retval = dump_object(object);
+
+    if (labels.labels != NULL)
+        free_labels();
+
+    free(machinecode.stream);
+    memset(&machinecode, 0, sizeof(machinecode));
+
+    return retval;
+}
+
+/**
+ * JUST-IN-TIME compiler for the assembly, for direct use in tests.
+ * @param binary - where to put the binary stream of instructions (caller is
+ * responsible for freing the memory)
+ * @param binary_length - where to put information about instructions length
+ * @return 0 on SUCCESS, positive error code otherwise (+ nonempty stderr)
+ */
+int jit(FILE *sourcecode, uint32_t **binary, size_t *binary_length)
+{
+    return jit_map(sourcecode, binary, binary_length, NULL);
+}
+
 /**
  * JUST-IN-TIME compiler wrapper, exporting the binary to auxiliary file.
  *
@@ -533,10 +779,33 @@ int main(int argc, char **argv)
         fprintf(stderr, "%s -o > binary.bin\n", argv[0]);
         fprintf(stderr, "\tdumps binary code to stdout, better redirect to file, "
                         "as it can harm your eyes\n");
+        fprintf(stderr, "%s -m > binary.bin.map\n", argv[0]);
+        fprintf(stderr, "\tprints the instruction index of every label, for ./cpu profile\n");
+        fprintf(stderr, "%s -d > binary.bin.dec\n", argv[0]);
+        fprintf(stderr, "\twrites the pre-decoded form of the binary code, for ./cpu\n");
+        fprintf(stderr, "%s -z > binary.bin\n", argv[0]);
+        fprintf(stderr, "\twrites the binary code compressed, for ./cpu\n");
+        fprintf(stderr, "%s -r > object.o\n", argv[0]);
+        fprintf(stderr, "\twrites a relocatable object for ./linker\n");
         return EXIT_FAILURE;
     }
 
-    void (*dumper)(void) = (strcmp("-c", argv[1]) == 0) ? dump_code : dump_stdout;
+    if (strcmp("-r", argv[1]) == 0)
+        return jit_object(stdin, stdout);
+
+    if (strcmp("-m", argv[1]) == 0) {
+        error_code retval = jit_map(stdin, &machinecode.stream, &machinecode.occupied, stdout);
+        free(machinecode.stream);
+        return retval;
+    }
+
+    void (*dumper)(void) = dump_stdout;
+    if (strcmp("-c", argv[1]) == 0)
+        dumper = dump_code;
+    else if (strcmp("-d", argv[1]) == 0)
+        dumper = dump_decoded;
+    else if (strcmp("-z", argv[1]) == 0)
+        dumper = dump_compressed;
 
     error_code retval = jit(stdin, &machinecode.stream, &machinecode.occupied);
 
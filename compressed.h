@@ -0,0 +1,88 @@
+#ifndef COMPRESSED_H
+#define COMPRESSED_H
+
+// Compressed program images, written by `compiler -z` and `linker -z` and
+// loaded by cpu_create_memory_compressed():
+//
+//   struct compressed_header
+//   payload[payload_bytes]      one varint per word of the image
+//
+// Every word is zigzag-encoded, so small negative numbers stay small, and
+// written 7 bits at a time, low bits first, with the top bit of a byte set
+// when more follow. Opcodes, registers and most numbers and labels of a
+// program take one or two bytes instead of four.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define COMPRESSED_MAGIC 0x5a555043u // "CPUZ"
+#define COMPRESSED_VERSION 1
+
+// Most payload bytes CELLS words can take.
+#define COMPRESSED_BOUND(cells) ((cells) * 5)
+
+struct compressed_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cells;
+    uint32_t payload_bytes;
+};
+
+// Encodes CELLS words of IMAGE into OUT, which holds COMPRESSED_BOUND(CELLS)
+// bytes. Returns the bytes written.
+static inline size_t compressed_encode(const uint32_t *image, size_t cells, uint8_t *out)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < cells; ++i) {
+        uint32_t value = (image[i] << 1) ^ (uint32_t) -(int32_t) (image[i] >> 31);
+        while (value >= 0x80) {
+            out[length++] = (uint8_t) (value | 0x80);
+            value >>= 7;
+        }
+        out[length++] = (uint8_t) value;
+    }
+    return length;
+}
+
+// Decodes CELLS words from the LENGTH bytes of IN into IMAGE. Returns the
+// bytes consumed, or SIZE_MAX if IN ends early or holds a value wider than
+// 32 bits.
+static inline size_t compressed_decode(const uint8_t *in, size_t length, uint32_t *image, size_t cells)
+{
+    size_t position = 0;
+    size_t i = 0;
+    while (i < cells) {
+        // eight one-byte values at a time, the common case
+        uint64_t chunk;
+        if (cells - i >= 8 && length - position >= 8) {
+            memcpy(&chunk, in + position, sizeof(chunk));
+            if ((chunk & 0x8080808080808080ULL) == 0) {
+                for (int k = 0; k < 8; ++k) {
+                    uint32_t value = in[position + k];
+                    image[i + k] = (value >> 1) ^ (uint32_t) -(int32_t) (value & 1);
+                }
+                position += 8;
+                i += 8;
+                continue;
+            }
+        }
+
+        uint32_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            if (position == length || shift > 28 || (shift == 28 && in[position] > 0x0f)) {
+                return SIZE_MAX;
+            }
+            uint8_t byte = in[position++];
+            value |= (uint32_t) (byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                break;
+            }
+        }
+        image[i++] = (value >> 1) ^ (uint32_t) -(int32_t) (value & 1);
+    }
+    return position;
+}
+
+#endif // COMPRESSED_H
@@ -1,25 +1,181 @@
 #include "cpu.h"
+#include "compressed.h"
+#include "decoded.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define BLOCK_SIZE 4096
 #define CELL_SIZE (int32_t) sizeof(int32_t)
 
+// Faults a guest can handle itself with `trap`, indexed by status.
+#define TRAP_FIRST CPU_ILLEGAL_INSTRUCTION
+#define TRAP_LAST CPU_IO_ERROR
+
 struct cpu
 {
     int32_t registers[4];
     enum cpu_status status;
     int32_t stack_size;
     int32_t instruction_index;
+    int32_t traps[TRAP_LAST + 1];
+    uint32_t traps_armed; // bit per status
     int32_t *memory;
     int32_t *stack_bottom;
     int32_t *stack_top;
+    int32_t *stack_limit; // lowest cell the running stack may grow into
+    struct coroutines *coroutines;
+    int32_t loaded_cells; // INT32_MAX once the whole image is present
+    struct cpu_loader *loader;
+    struct cpu_stats stats;
+    uint64_t io_wall_start;
+    uint64_t io_cpu_start;
+    uint64_t *profile;
+    size_t profile_cells;
+    struct loop_detector *detector;
+    struct decoded_record *decoded;
+    size_t decoded_cells;
+    int32_t *data;
+    size_t data_cells;
+    bool data_writable;
+    FILE *in;
+    FILE *out;
+};
+
+// State of a parked instance that an idle guest rarely has, kept out of the
+// record itself.
+struct parked_extra
+{
+    struct cpu_stats stats;
+    uint32_t traps_armed;
+    int32_t handlers[]; // one per armed trap, in status order
+};
+
+// Settings of a parked instance. Blocks that own neither a decoded form nor a
+// data region are interned, so instances parked with the same streams and
+// profile counts share one; the others belong to a single record.
+struct parked_config
+{
+    int32_t references;
+    struct parked_config *next; // interned blocks only
+    FILE *in;
+    FILE *out;
+    uint64_t *profile; // owned by the caller of cpu_set_profile()
+    size_t profile_cells;
+    bool loop_detection;
+    struct decoded_record *decoded;
+    size_t decoded_cells;
+    int32_t *data;
+    size_t data_cells;
+    bool data_writable;
+};
+
+struct cpu_parked
+{
+    int32_t registers[4];
+    enum cpu_status status;
+    int32_t stack_size;
+    int32_t instruction_index;
+    int32_t code_cells;
+    int32_t stack_capacity;
+    int32_t image_cells;
+    struct parked_extra *extra; // NULL while every counter is zero and no trap is armed
+    struct parked_config *config; // NULL while every setting is the default
+    const int32_t *image;
+    FILE *spill;
+    long spill_offset;
+    int32_t payload[]; // own image copy followed by the live stack, unless spilled
+};
+
+_Static_assert(sizeof(struct cpu_parked) <= 80, "a parked record must stay within 80 bytes");
+
+static pthread_mutex_t parked_configs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct parked_config *parked_configs;
+
+// Guest coroutines, set up by the first `cocreate`. Context 0 is the main
+// program, which keeps the bottom of the stack region; every coroutine gets a
+// segment carved off the top of the region, which the main stack can no longer
+// grow into. The running context lives in struct cpu, the others here.
+struct coroutine
+{
+    int32_t *stack_bottom;
+    int32_t *stack_limit;
+    int32_t stack_size;
+    int32_t instruction_index;
+    int32_t caller; // context `yield` returns to, -1 while suspended
+};
+
+struct coroutines
+{
+    int32_t count;
+    int32_t capacity;
+    int32_t current;
+    int32_t *segments_end; // first cell after the last segment
+    struct coroutine contexts[];
+};
+
+// Brent's cycle detection over the machine state, sampled at taken `loop`
+// back-edges: the state is remembered at back-edge 1, 2, 4, 8, ... and any
+// cycle is found once the interval exceeds its length. The stack part of the
+// hash is kept up to date on every stack write, and a matching hash is
+// confirmed against the remembered state before the guest is stopped.
+struct loop_detector
+{
+    uint64_t stack_hash;
+    uint64_t interval;
+    uint64_t since_snapshot;
+    bool has_snapshot;
+    uint64_t snapshot_hash;
+    int32_t registers[4];
+    int32_t instruction_index;
+    int32_t stack_size;
+    int32_t *stack;
+};
+
+// Thread filling the code region of a cpu_create_streaming() instance page by
+// page. LOADED only grows; a fetch beyond it waits for PROGRESS. The thread
+// reads only once the descriptor is readable, so a byte in the STOP pipe ends
+// it even while a pipe it streams from has nothing to read.
+struct cpu_loader
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    int program;
+    int stop[2];
+    char *memory;
+    size_t image_bytes;
+    size_t loaded;
+    bool finished;
 };
 
+static bool stats_are_zero(const struct cpu_stats *stats)
+{
+    return stats->retired == 0 && stats->loops_taken == 0 && stats->pushes == 0 && stats->pops == 0
+            && stats->stack_high_water == 0 && stats->bytes_in == 0 && stats->bytes_out == 0
+            && stats->io_blocked_ns == 0;
+}
+
+static int32_t traps_count(uint32_t armed)
+{
+    int32_t count = 0;
+    for (; armed != 0; armed &= armed - 1) {
+        count++;
+    }
+    return count;
+}
+
 static void cpu_clear(struct cpu *cpu)
 {
     assert(cpu != NULL);
@@ -28,6 +184,131 @@ static void cpu_clear(struct cpu *cpu)
     cpu->status = CPU_OK;
     cpu->stack_size = 0;
     cpu->instruction_index = 0;
+    memset(cpu->traps, 0, sizeof(cpu->traps));
+    cpu->traps_armed = 0;
+    memset(&cpu->stats, 0, sizeof(cpu->stats));
+    cpu->io_wall_start = 0;
+    cpu->io_cpu_start = 0;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Contribution of one stack cell; empty cells are zero and contribute nothing.
+static uint64_t cell_hash(int32_t position, int32_t value)
+{
+    return (value == 0) ? 0 : mix64(((uint64_t) (uint32_t) position << 32) | (uint32_t) value);
+}
+
+static void detector_forget(struct loop_detector *detector)
+{
+    detector->interval = 1;
+    detector->since_snapshot = 0;
+    detector->has_snapshot = false;
+}
+
+static void detector_cell_written(struct cpu *cpu, int32_t *address, int32_t old_value)
+{
+    int32_t position = cpu->stack_bottom - address;
+    cpu->detector->stack_hash ^= cell_hash(position, old_value) ^ cell_hash(position, *address);
+}
+
+// Starts over on a stack that changed wholesale.
+static void detector_rehash(struct cpu *cpu)
+{
+    struct loop_detector *detector = cpu->detector;
+
+    detector_forget(detector);
+    detector->stack_hash = 0;
+    for (int32_t position = 0; position < cpu->stack_size; ++position) {
+        detector->stack_hash ^= cell_hash(position, cpu->stack_bottom[-position]);
+    }
+}
+
+static uint64_t state_hash(const struct cpu *cpu)
+{
+    uint64_t hash = cpu->detector->stack_hash;
+    hash = mix64(hash ^ (((uint64_t) (uint32_t) cpu->registers[0] << 32) | (uint32_t) cpu->registers[1]));
+    hash = mix64(hash ^ (((uint64_t) (uint32_t) cpu->registers[2] << 32) | (uint32_t) cpu->registers[3]));
+    return mix64(hash ^ (((uint64_t) (uint32_t) cpu->instruction_index << 32) | (uint32_t) cpu->stack_size));
+}
+
+static bool same_as_snapshot(const struct cpu *cpu)
+{
+    const struct loop_detector *detector = cpu->detector;
+
+    return detector->instruction_index == cpu->instruction_index
+            && detector->stack_size == cpu->stack_size
+            && memcmp(detector->registers, cpu->registers, 4 * CELL_SIZE) == 0
+            && memcmp(detector->stack, cpu->stack_bottom - cpu->stack_size + 1, cpu->stack_size * CELL_SIZE) == 0;
+}
+
+static void detector_back_edge(struct cpu *cpu)
+{
+    struct loop_detector *detector = cpu->detector;
+    uint64_t hash = state_hash(cpu);
+
+    if (detector->has_snapshot && hash == detector->snapshot_hash && same_as_snapshot(cpu)) {
+        cpu->status = CPU_INFINITE_LOOP;
+        return;
+    }
+
+    if (detector->has_snapshot && ++detector->since_snapshot < detector->interval) {
+        return;
+    }
+
+    // the snapshot copies the live stack only, the rest of it is zero
+    detector->has_snapshot = true;
+    detector->snapshot_hash = hash;
+    detector->since_snapshot = 0;
+    detector->interval *= 2;
+    memcpy(detector->registers, cpu->registers, 4 * CELL_SIZE);
+    detector->instruction_index = cpu->instruction_index;
+    detector->stack_size = cpu->stack_size;
+    memcpy(detector->stack, cpu->stack_bottom - cpu->stack_size + 1, cpu->stack_size * CELL_SIZE);
+}
+
+// Timing every I/O instruction costs more than the instruction itself, so a
+// block that performs I/O is timed as a whole from its first I/O instruction
+// and the time the thread spent off the CPU counts as blocked on I/O.
+static void io_block_begin(struct cpu *cpu)
+{
+    // output is observable and input may differ, so a repeated state proves nothing
+    if (cpu->detector != NULL) {
+        detector_forget(cpu->detector);
+    }
+
+    if (cpu->io_wall_start == 0) {
+        cpu->io_wall_start = clock_ns(CLOCK_MONOTONIC);
+        cpu->io_cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    }
+}
+
+static void io_block_end(struct cpu *cpu)
+{
+    if (cpu->io_wall_start == 0) {
+        return;
+    }
+
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC) - cpu->io_wall_start;
+    uint64_t on_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu->io_cpu_start;
+    if (wall > on_cpu) {
+        cpu->stats.io_blocked_ns += wall - on_cpu;
+    }
+    cpu->io_wall_start = 0;
 }
 
 static bool reg_is_valid(struct cpu *cpu, int32_t reg)
@@ -169,6 +450,11 @@ static void loop(struct cpu *cpu)
 
     size_t new_index = cpu->memory[++cpu->instruction_index];
     cpu->instruction_index = new_index;
+    cpu->stats.loops_taken++;
+
+    if (cpu->detector != NULL) {
+        detector_back_edge(cpu);
+    }
 }
 
 static void movr(struct cpu *cpu)
@@ -230,7 +516,11 @@ static void store(struct cpu *cpu)
         return;
     }
 
+    int32_t old_value = *target_address;
     cpu->memory[target_address - cpu->memory] = cpu->registers[reg];
+    if (cpu->detector != NULL) {
+        detector_cell_written(cpu, target_address, old_value);
+    }
     cpu->instruction_index++;
 }
 
@@ -243,8 +533,19 @@ static void in(struct cpu *cpu)
         return;
     }
 
+    // whitespace and a sign are consumed even when no number follows, which
+    // %n cannot report, so the whitespace is skipped here
     int32_t num;
-    int result = scanf("%" SCNd32, &num);
+    int consumed = 0;
+    int skipped = 0;
+    int next;
+    io_block_begin(cpu);
+    while ((next = getc(cpu->in)) != EOF && isspace(next)) {
+        skipped++;
+    }
+    ungetc(next, cpu->in);
+    int result = fscanf(cpu->in, "%" SCNd32 "%n", &num, &consumed);
+    cpu->stats.bytes_in += skipped + ((result == 1) ? consumed : (next == '+' || next == '-'));
 
     if (result == 0) {
         cpu->status = CPU_IO_ERROR;
@@ -269,13 +570,15 @@ static void get(struct cpu *cpu)
         return;
     }
 
-    int32_t c = getchar();
+    io_block_begin(cpu);
+    int32_t c = getc(cpu->in);
     if (c == EOF) {
         handle_eof(cpu, reg);
         return;
     }
 
     cpu->registers[reg] = c;
+    cpu->stats.bytes_in++;
     cpu->instruction_index++;
 }
 
@@ -288,7 +591,11 @@ static void out(struct cpu *cpu)
         return;
     }
 
-    printf("%" PRId32, cpu->registers[reg]);
+    io_block_begin(cpu);
+    int written = fprintf(cpu->out, "%" PRId32, cpu->registers[reg]);
+    if (written > 0) {
+        cpu->stats.bytes_out += written;
+    }
     cpu->instruction_index++;
 }
 
@@ -307,7 +614,80 @@ static void put(struct cpu *cpu)
         return;
     }
 
-    putchar(c);
+    io_block_begin(cpu);
+    if (putc(c, cpu->out) != EOF) {
+        cpu->stats.bytes_out++;
+    }
+    cpu->instruction_index++;
+}
+
+static void inb(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    int32_t reg = cpu->memory[++cpu->instruction_index];
+    if (!reg_is_valid(cpu, reg)) {
+        return;
+    }
+
+    unsigned char bytes[CELL_SIZE];
+    io_block_begin(cpu);
+    size_t got = fread(bytes, 1, CELL_SIZE, cpu->in);
+    cpu->stats.bytes_in += got;
+
+    if (got == 0) {
+        handle_eof(cpu, reg);
+        return;
+    }
+
+    if (got < (size_t) CELL_SIZE) {
+        cpu->status = CPU_IO_ERROR;
+        return;
+    }
+
+    cpu->registers[reg] = (int32_t) ((uint32_t) bytes[0] | (uint32_t) bytes[1] << 8
+            | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24);
+    cpu->instruction_index++;
+}
+
+static void outb(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    int32_t reg = cpu->memory[++cpu->instruction_index];
+    if (!reg_is_valid(cpu, reg)) {
+        return;
+    }
+
+    uint32_t value = (uint32_t) cpu->registers[reg];
+    unsigned char bytes[CELL_SIZE] = { value, value >> 8, value >> 16, value >> 24 };
+    io_block_begin(cpu);
+    cpu->stats.bytes_out += fwrite(bytes, 1, CELL_SIZE, cpu->out);
+    cpu->instruction_index++;
+}
+
+static void trap(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    int32_t status = cpu->memory[++cpu->instruction_index];
+    int32_t handler = cpu->memory[++cpu->instruction_index];
+    if (status < TRAP_FIRST || status > TRAP_LAST) {
+        cpu->status = CPU_ILLEGAL_OPERAND;
+        return;
+    }
+
+    // the detector does not hash the handlers, so a repeated state proves nothing
+    if (cpu->detector != NULL) {
+        detector_forget(cpu->detector);
+    }
+
+    if (handler < 0) {
+        cpu->traps_armed &= ~(1u << status);
+    } else {
+        cpu->traps[status] = handler;
+        cpu->traps_armed |= 1u << status;
+    }
     cpu->instruction_index++;
 }
 
@@ -337,13 +717,20 @@ static void push(struct cpu *cpu)
         return;
     }
 
-    if (cpu->stack_size == cpu->stack_bottom - cpu->stack_top + 1) {
+    if (cpu->stack_size == cpu->stack_bottom - cpu->stack_limit + 1) {
         cpu->status = CPU_INVALID_STACK_OPERATION;
         return;
     }
 
     cpu->memory[(cpu->stack_bottom - cpu->stack_size - cpu->memory)] = cpu->registers[reg];
+    if (cpu->detector != NULL) {
+        detector_cell_written(cpu, cpu->stack_bottom - cpu->stack_size, 0);
+    }
     cpu->stack_size++;
+    if (cpu->stack_size > cpu->stats.stack_high_water) {
+        cpu->stats.stack_high_water = cpu->stack_size;
+    }
+    cpu->stats.pushes++;
     cpu->instruction_index++;
 }
 
@@ -366,119 +753,553 @@ static void pop(struct cpu *cpu)
     int32_t value = cpu->memory[idx];
     cpu->registers[reg] = value;
     cpu->memory[idx] = 0;
+    if (cpu->detector != NULL) {
+        detector_cell_written(cpu, &cpu->memory[idx], value);
+    }
+    cpu->stats.pops++;
     cpu->instruction_index++;
 }
 
-typedef void (*instruction)(struct cpu *cpu);
-
-static const instruction instructions[] = {
-    &nop,
-    &halt,
-    &add,
-    &sub,
-    &mul,
-    &div_reg,
-    &inc,
-    &dec,
-    &loop,
-    &movr,
-    &load,
-    &store,
-    &in,
-    &get,
-    &out,
-    &put,
-    &swap,
-    &push,
-    &pop
-};
-
-int32_t *cpu_create_memory(FILE *program, size_t stack_capacity, int32_t **stack_bottom)
+static bool init_reg_data_address(struct cpu *cpu, int32_t *reg, int32_t **target_address)
 {
-    assert(program != NULL);
-    assert(stack_bottom != NULL);
-
-    int32_t capacity = BLOCK_SIZE;
-    char *memory_init = malloc(capacity);
-    if (memory_init == NULL) {
-        return NULL;
-    }
-
-    int32_t size = 0;
-    int c;
-
-    while ((c = fgetc(program)) != EOF) {
-        if (size + 1 > capacity) {
-            char *old = memory_init;
-            capacity += BLOCK_SIZE;
-            memory_init = realloc(memory_init, capacity);
-            if (memory_init == NULL) {
-                free(old);
-                return NULL;
-            }
-        }
-
-        memory_init[size++] = c;
-    }
+    assert(cpu != NULL);
 
-    if (size % CELL_SIZE != 0) {
-        free(memory_init);
-        return NULL;
+    *reg = cpu->memory[++cpu->instruction_index];
+    if (!reg_is_valid(cpu, *reg)) {
+        return false;
     }
 
-    if ((size_t) (capacity - size) < stack_capacity * CELL_SIZE) {
-        char *old = memory_init;
-        capacity += BLOCK_SIZE * (((stack_capacity - 1) * CELL_SIZE - capacity + size + BLOCK_SIZE) / BLOCK_SIZE);
-
-        memory_init = realloc(memory_init, capacity);
-        if (memory_init == NULL) {
-            free(old);
-            return NULL;
-        }
+    int32_t num = cpu->memory[++cpu->instruction_index];
+    int64_t index = (int64_t) cpu->registers[REGISTER_D] + num;
+    if (index < 0 || (uint64_t) index >= cpu->data_cells) {
+        cpu->status = CPU_INVALID_ADDRESS;
+        return false;
     }
 
-    int32_t *memory = (int32_t *) memory_init;
-    *stack_bottom = &memory[capacity / CELL_SIZE - 1];
-    int32_t occupied_cells = size / CELL_SIZE;
-    memset(&memory[occupied_cells], 0, (*stack_bottom - &memory[occupied_cells] + 1) * CELL_SIZE);
-    return memory;
+    *target_address = &cpu->data[index];
+    return true;
 }
 
-struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom, size_t stack_capacity)
+static void dload(struct cpu *cpu)
 {
-    assert(memory != NULL);
-    assert(stack_bottom != NULL);
+    assert(cpu != NULL);
 
-    struct cpu *cpu = malloc(sizeof(struct cpu));
-    if (cpu == NULL) {
-        stack_bottom = NULL;
-        return NULL;
+    int32_t reg;
+    int32_t *target_address;
+
+    if (!init_reg_data_address(cpu, &reg, &target_address)) {
+        return;
     }
 
-    cpu_clear(cpu);
-    cpu->memory = memory;
-    cpu->stack_bottom = stack_bottom;
-    cpu->stack_top = stack_bottom - stack_capacity + 1;
-    return cpu;
+    cpu->registers[reg] = *target_address;
+    cpu->instruction_index++;
 }
 
-int32_t cpu_get_register(struct cpu *cpu, enum cpu_register reg)
+static void dstore(struct cpu *cpu)
 {
     assert(cpu != NULL);
 
-    assert(reg >= REGISTER_A && reg <= REGISTER_D);
-    return cpu->registers[reg];
-}
+    int32_t reg;
+    int32_t *target_address;
 
-void cpu_set_register(struct cpu *cpu, enum cpu_register reg, int32_t value)
-{
-    assert(cpu != NULL);
+    if (!init_reg_data_address(cpu, &reg, &target_address)) {
+        return;
+    }
 
-    assert(reg >= REGISTER_A && reg <= REGISTER_D);
-    cpu->registers[reg] = value;
+    if (!cpu->data_writable) {
+        cpu->status = CPU_INVALID_ADDRESS;
+        return;
+    }
+
+    // the detector does not hash the data region, so a repeated state proves nothing
+    if (cpu->detector != NULL) {
+        detector_forget(cpu->detector);
+    }
+    *target_address = cpu->registers[reg];
+    cpu->instruction_index++;
 }
 
-enum cpu_status cpu_get_status(struct cpu *cpu)
+static void dsize(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    int32_t reg = cpu->memory[++cpu->instruction_index];
+    if (!reg_is_valid(cpu, reg)) {
+        return;
+    }
+
+    cpu->registers[reg] = (cpu->data_cells > INT32_MAX) ? INT32_MAX : (int32_t) cpu->data_cells;
+    cpu->instruction_index++;
+}
+
+// Saves the running context and continues in context TARGET.
+static void switch_context(struct cpu *cpu, int32_t target)
+{
+    struct coroutines *coroutines = cpu->coroutines;
+    struct coroutine *from = &coroutines->contexts[coroutines->current];
+    const struct coroutine *to = &coroutines->contexts[target];
+
+    from->stack_size = cpu->stack_size;
+    from->instruction_index = cpu->instruction_index;
+    cpu->stack_bottom = to->stack_bottom;
+    cpu->stack_limit = to->stack_limit;
+    cpu->stack_size = to->stack_size;
+    cpu->instruction_index = to->instruction_index;
+    coroutines->current = target;
+
+    if (cpu->detector != NULL) {
+        detector_rehash(cpu);
+    }
+}
+
+static bool coroutines_init(struct cpu *cpu)
+{
+    struct coroutines *coroutines = malloc(sizeof(struct coroutines) + 8 * sizeof(struct coroutine));
+    if (coroutines == NULL) {
+        return false;
+    }
+
+    coroutines->count = 1;
+    coroutines->capacity = 8;
+    coroutines->current = 0;
+    coroutines->segments_end = cpu->stack_top;
+    coroutines->contexts[0] = (struct coroutine) {
+        .stack_bottom = cpu->stack_bottom,
+        .stack_limit = cpu->stack_limit,
+        .caller = 0,
+    };
+    cpu->coroutines = coroutines;
+    return true;
+}
+
+// Back to the main program, as if no coroutine had ever been created.
+static void coroutines_end(struct cpu *cpu)
+{
+    if (cpu->coroutines == NULL) {
+        return;
+    }
+
+    cpu->stack_bottom = cpu->coroutines->contexts[0].stack_bottom;
+    cpu->stack_limit = cpu->stack_top;
+    free(cpu->coroutines);
+    cpu->coroutines = NULL;
+}
+
+static void cocreate(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    int32_t reg = cpu->memory[++cpu->instruction_index];
+    if (!reg_is_valid(cpu, reg)) {
+        return;
+    }
+
+    int32_t entry = cpu->memory[++cpu->instruction_index];
+    int32_t cells = cpu->registers[reg];
+    if (cells < 1) {
+        cpu->status = CPU_ILLEGAL_OPERAND;
+        return;
+    }
+
+    // out of host memory is as good as out of stack
+    if (cpu->coroutines == NULL && !coroutines_init(cpu)) {
+        cpu->status = CPU_INVALID_STACK_OPERATION;
+        return;
+    }
+
+    struct coroutines *coroutines = cpu->coroutines;
+    struct coroutine *main_context = &coroutines->contexts[0];
+    int32_t main_size = (coroutines->current == 0) ? cpu->stack_size : main_context->stack_size;
+    if (cells > main_context->stack_bottom - main_size + 1 - coroutines->segments_end) {
+        cpu->status = CPU_INVALID_STACK_OPERATION;
+        return;
+    }
+
+    if (coroutines->count == coroutines->capacity) {
+        coroutines = realloc(coroutines, sizeof(struct coroutines) + 2 * coroutines->capacity * sizeof(struct coroutine));
+        if (coroutines == NULL) {
+            cpu->status = CPU_INVALID_STACK_OPERATION;
+            return;
+        }
+        coroutines->capacity *= 2;
+        cpu->coroutines = coroutines;
+        main_context = &coroutines->contexts[0];
+    }
+
+    // the main stack never reached the segment, so it starts out zeroed
+    coroutines->contexts[coroutines->count] = (struct coroutine) {
+        .stack_bottom = coroutines->segments_end + cells - 1,
+        .stack_limit = coroutines->segments_end,
+        .stack_size = 0,
+        .instruction_index = entry,
+        .caller = -1,
+    };
+    coroutines->segments_end += cells;
+    main_context->stack_limit = coroutines->segments_end;
+    if (coroutines->current == 0) {
+        cpu->stack_limit = coroutines->segments_end;
+    }
+
+    // the detector does not hash the coroutines, so a repeated state proves nothing
+    if (cpu->detector != NULL) {
+        detector_forget(cpu->detector);
+    }
+    cpu->registers[reg] = coroutines->count++;
+    cpu->instruction_index++;
+}
+
+static void yield(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->coroutines == NULL || cpu->coroutines->current == 0) {
+        cpu->status = CPU_INVALID_STACK_OPERATION;
+        return;
+    }
+
+    struct coroutine *self = &cpu->coroutines->contexts[cpu->coroutines->current];
+    int32_t caller = self->caller;
+    self->caller = -1;
+    cpu->instruction_index++;
+    switch_context(cpu, caller);
+}
+
+static void resume(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    int32_t reg = cpu->memory[++cpu->instruction_index];
+    if (!reg_is_valid(cpu, reg)) {
+        return;
+    }
+
+    // only a suspended coroutine can be resumed, never one waiting for another
+    int32_t target = cpu->registers[reg];
+    struct coroutines *coroutines = cpu->coroutines;
+    if (coroutines == NULL || target < 1 || target >= coroutines->count || coroutines->contexts[target].caller >= 0) {
+        cpu->status = CPU_ILLEGAL_OPERAND;
+        return;
+    }
+
+    coroutines->contexts[target].caller = coroutines->current;
+    cpu->instruction_index++;
+    switch_context(cpu, target);
+}
+
+typedef void (*instruction)(struct cpu *cpu);
+
+static const instruction instructions[OPCODE_COUNT] = {
+    &nop,
+    &halt,
+    &add,
+    &sub,
+    &mul,
+    &div_reg,
+    &inc,
+    &dec,
+    &loop,
+    &movr,
+    &load,
+    &store,
+    &in,
+    &get,
+    &out,
+    &put,
+    &swap,
+    &push,
+    &pop,
+    // 0x13 to 0x19 are taken by the assembler's bonus instructions
+    [OP_DLOAD] = &dload,
+    &dstore,
+    &dsize,
+    &inb,
+    &outb,
+    &trap,
+    &cocreate,
+    &yield,
+    &resume,
+};
+
+static void *loader_main(void *arg)
+{
+    struct cpu_loader *loader = arg;
+    struct pollfd ready[2] = {
+        { .fd = loader->program, .events = POLLIN },
+        { .fd = loader->stop[0], .events = POLLIN },
+    };
+    bool finished = false;
+
+    while (!finished) {
+        size_t chunk = loader->image_bytes - loader->loaded;
+        if (chunk > BLOCK_SIZE) {
+            chunk = BLOCK_SIZE;
+        }
+
+        if (chunk > 0 && poll(ready, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            chunk = 0;
+        }
+        if (ready[1].revents != 0) {
+            chunk = 0;
+        }
+
+        // only this thread writes LOADED, so it may read it unlocked
+        ssize_t got = (chunk > 0) ? read(loader->program, loader->memory + loader->loaded, chunk) : 0;
+        if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&loader->lock);
+        loader->loaded += (got > 0) ? (size_t) got : 0;
+        loader->finished = got <= 0 || loader->loaded == loader->image_bytes;
+        finished = loader->finished;
+        pthread_cond_broadcast(&loader->progress);
+        pthread_mutex_unlock(&loader->lock);
+    }
+    return NULL;
+}
+
+// Stops reading, even in the middle of a page, and waits for the thread.
+static void loader_destroy(struct cpu_loader *loader)
+{
+    // the thread may have finished and the pipe may be full, neither matters
+    char stop = 0;
+    ssize_t written = write(loader->stop[1], &stop, 1);
+    (void) written;
+
+    pthread_join(loader->thread, NULL);
+    close(loader->stop[0]);
+    close(loader->stop[1]);
+    pthread_cond_destroy(&loader->progress);
+    pthread_mutex_destroy(&loader->lock);
+    free(loader);
+}
+
+/**
+ * Waits until the image is present up to CELLS, or the loader gave up.
+ * @return false if the image ended before CELLS
+ */
+static bool loader_wait(struct cpu *cpu, size_t cells)
+{
+    struct cpu_loader *loader = cpu->loader;
+    size_t image_cells = loader->image_bytes / CELL_SIZE;
+    if (cells > image_cells) {
+        cells = image_cells;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    while (!loader->finished && loader->loaded / CELL_SIZE < cells) {
+        pthread_cond_wait(&loader->progress, &loader->lock);
+    }
+    size_t loaded = loader->loaded;
+    bool complete = loader->finished && loaded == loader->image_bytes;
+    pthread_mutex_unlock(&loader->lock);
+
+    if (complete) {
+        cpu->loaded_cells = INT32_MAX;
+        loader_destroy(loader);
+        cpu->loader = NULL;
+        return true;
+    }
+
+    cpu->loaded_cells = (int32_t) (loaded / CELL_SIZE);
+    return loaded / CELL_SIZE >= cells;
+}
+
+int32_t *cpu_create_memory(FILE *program, size_t stack_capacity, int32_t **stack_bottom)
+{
+    assert(program != NULL);
+    assert(stack_bottom != NULL);
+
+    int32_t capacity = BLOCK_SIZE;
+    char *memory_init = malloc(capacity);
+    if (memory_init == NULL) {
+        return NULL;
+    }
+
+    int32_t size = 0;
+    int c;
+
+    while ((c = fgetc(program)) != EOF) {
+        if (size + 1 > capacity) {
+            char *old = memory_init;
+            capacity += BLOCK_SIZE;
+            memory_init = realloc(memory_init, capacity);
+            if (memory_init == NULL) {
+                free(old);
+                return NULL;
+            }
+        }
+
+        memory_init[size++] = c;
+    }
+
+    if (size % CELL_SIZE != 0) {
+        free(memory_init);
+        return NULL;
+    }
+
+    if ((size_t) (capacity - size) < stack_capacity * CELL_SIZE) {
+        char *old = memory_init;
+        capacity += BLOCK_SIZE * (((stack_capacity - 1) * CELL_SIZE - capacity + size + BLOCK_SIZE) / BLOCK_SIZE);
+
+        memory_init = realloc(memory_init, capacity);
+        if (memory_init == NULL) {
+            free(old);
+            return NULL;
+        }
+    }
+
+    int32_t *memory = (int32_t *) memory_init;
+    *stack_bottom = &memory[capacity / CELL_SIZE - 1];
+    int32_t occupied_cells = size / CELL_SIZE;
+    memset(&memory[occupied_cells], 0, (*stack_bottom - &memory[occupied_cells] + 1) * CELL_SIZE);
+    return memory;
+}
+
+// Size of the block cpu_create_memory() ends up with for an image of IMAGE_BYTES.
+static size_t block_capacity(size_t image_bytes, size_t stack_capacity)
+{
+    size_t capacity = (image_bytes > 0) ? (image_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE : BLOCK_SIZE;
+    if (capacity - image_bytes < stack_capacity * CELL_SIZE) {
+        capacity += BLOCK_SIZE * (((stack_capacity - 1) * CELL_SIZE - capacity + image_bytes + BLOCK_SIZE) / BLOCK_SIZE);
+    }
+    return capacity;
+}
+
+int32_t *cpu_create_memory_compressed(FILE *program, size_t stack_capacity, int32_t **stack_bottom)
+{
+    assert(program != NULL);
+    assert(stack_bottom != NULL);
+
+    struct compressed_header header;
+    if (fread(&header, sizeof(header), 1, program) != 1 || header.magic != COMPRESSED_MAGIC
+            || header.version != COMPRESSED_VERSION || header.cells > (INT32_MAX - 2 * BLOCK_SIZE) / CELL_SIZE
+            || header.payload_bytes > COMPRESSED_BOUND((size_t) header.cells)) {
+        return NULL;
+    }
+
+    size_t capacity = block_capacity((size_t) header.cells * CELL_SIZE, stack_capacity);
+    uint8_t *payload = malloc(header.payload_bytes + 1);
+    int32_t *memory = malloc(capacity);
+    if (payload == NULL || memory == NULL
+            || fread(payload, 1, header.payload_bytes, program) != header.payload_bytes
+            || compressed_decode(payload, header.payload_bytes, (uint32_t *) memory, header.cells)
+                    != header.payload_bytes) {
+        free(payload);
+        free(memory);
+        return NULL;
+    }
+    free(payload);
+
+    *stack_bottom = &memory[capacity / CELL_SIZE - 1];
+    memset(&memory[header.cells], 0, capacity - (size_t) header.cells * CELL_SIZE);
+    return memory;
+}
+
+struct cpu *cpu_create_streaming(FILE *program, size_t image_bytes, size_t stack_capacity, int32_t **stack_bottom)
+{
+    assert(program != NULL);
+    assert(stack_bottom != NULL);
+
+    if (image_bytes % CELL_SIZE != 0 || image_bytes > INT32_MAX - 2 * BLOCK_SIZE) {
+        return NULL;
+    }
+
+    // the block cpu_create_memory() would end up with, zeroed up front
+    size_t capacity = block_capacity(image_bytes, stack_capacity);
+    int32_t *memory = calloc(capacity / CELL_SIZE, CELL_SIZE);
+    struct cpu_loader *loader = calloc(1, sizeof(struct cpu_loader));
+    struct cpu *cpu = (memory != NULL) ? cpu_create(memory, &memory[capacity / CELL_SIZE - 1], stack_capacity) : NULL;
+    if (cpu == NULL || loader == NULL) {
+        free(cpu);
+        free(loader);
+        free(memory);
+        return NULL;
+    }
+
+    // the thread reads the descriptor, so a seekable PROGRAM hands over its
+    // position and drops what it has buffered
+    fflush(program);
+    loader->program = fileno(program);
+    loader->memory = (char *) memory;
+    loader->image_bytes = image_bytes;
+    if (pipe(loader->stop) != 0) {
+        free(loader);
+        free(cpu);
+        free(memory);
+        return NULL;
+    }
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->progress, NULL);
+    if (pthread_create(&loader->thread, NULL, loader_main, loader) != 0) {
+        close(loader->stop[0]);
+        close(loader->stop[1]);
+        pthread_cond_destroy(&loader->progress);
+        pthread_mutex_destroy(&loader->lock);
+        free(loader);
+        free(cpu);
+        free(memory);
+        return NULL;
+    }
+
+    cpu->loader = loader;
+    cpu->loaded_cells = 0;
+    *stack_bottom = cpu->stack_bottom;
+    return cpu;
+}
+
+struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom, size_t stack_capacity)
+{
+    assert(memory != NULL);
+    assert(stack_bottom != NULL);
+
+    struct cpu *cpu = malloc(sizeof(struct cpu));
+    if (cpu == NULL) {
+        stack_bottom = NULL;
+        return NULL;
+    }
+
+    cpu_clear(cpu);
+    cpu->profile = NULL;
+    cpu->profile_cells = 0;
+    cpu->detector = NULL;
+    cpu->decoded = NULL;
+    cpu->decoded_cells = 0;
+    cpu->data = NULL;
+    cpu->data_cells = 0;
+    cpu->data_writable = false;
+    cpu->loaded_cells = INT32_MAX;
+    cpu->loader = NULL;
+    cpu->in = stdin;
+    cpu->out = stdout;
+    cpu->memory = memory;
+    cpu->stack_bottom = stack_bottom;
+    cpu->stack_top = stack_bottom - stack_capacity + 1;
+    cpu->stack_limit = cpu->stack_top;
+    cpu->coroutines = NULL;
+    return cpu;
+}
+
+int32_t cpu_get_register(struct cpu *cpu, enum cpu_register reg)
+{
+    assert(cpu != NULL);
+
+    assert(reg >= REGISTER_A && reg <= REGISTER_D);
+    return cpu->registers[reg];
+}
+
+void cpu_set_register(struct cpu *cpu, enum cpu_register reg, int32_t value)
+{
+    assert(cpu != NULL);
+
+    assert(reg >= REGISTER_A && reg <= REGISTER_D);
+    cpu->registers[reg] = value;
+}
+
+enum cpu_status cpu_get_status(struct cpu *cpu)
 {
     assert(cpu != NULL);
 
@@ -492,11 +1313,178 @@ int32_t cpu_get_stack_size(struct cpu *cpu)
     return cpu->stack_size;
 }
 
+int32_t cpu_get_instruction_index(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    return cpu->instruction_index;
+}
+
+void cpu_get_stats(struct cpu *cpu, struct cpu_stats *stats)
+{
+    assert(cpu != NULL);
+    assert(stats != NULL);
+
+    *stats = cpu->stats;
+}
+
+void cpu_get_state(struct cpu *cpu, struct cpu_state *state)
+{
+    assert(cpu != NULL);
+    assert(state != NULL);
+
+    memcpy(state->registers, cpu->registers, sizeof(state->registers));
+    state->status = cpu->status;
+    state->stack_size = cpu->stack_size;
+    state->instruction_index = cpu->instruction_index;
+}
+
+const int32_t *cpu_get_stack(struct cpu *cpu, size_t *size)
+{
+    assert(cpu != NULL);
+    assert(size != NULL);
+
+    *size = (size_t) cpu->stack_size;
+    return cpu->stack_bottom - cpu->stack_size + 1;
+}
+
+void cpu_set_io(struct cpu *cpu, FILE *in, FILE *out)
+{
+    assert(cpu != NULL);
+    assert(in != NULL);
+    assert(out != NULL);
+
+    cpu->in = in;
+    cpu->out = out;
+}
+
+void cpu_set_profile(struct cpu *cpu, uint64_t *counts, size_t cells)
+{
+    assert(cpu != NULL);
+
+    cpu->profile = counts;
+    cpu->profile_cells = (counts != NULL) ? cells : 0;
+}
+
+int cpu_set_loop_detection(struct cpu *cpu, bool enabled)
+{
+    assert(cpu != NULL);
+
+    if (!enabled || cpu->detector != NULL) {
+        if (!enabled && cpu->detector != NULL) {
+            free(cpu->detector->stack);
+            free(cpu->detector);
+            cpu->detector = NULL;
+        }
+        return 0;
+    }
+
+    // any context may be running later, so room for the whole stack region
+    struct loop_detector *detector = calloc(1, sizeof(struct loop_detector));
+    const int32_t *region_bottom = (cpu->coroutines != NULL) ? cpu->coroutines->contexts[0].stack_bottom : cpu->stack_bottom;
+    size_t capacity = region_bottom - cpu->stack_top + 1;
+    int32_t *stack = malloc(capacity * CELL_SIZE + 1);
+    if (detector == NULL || stack == NULL) {
+        free(detector);
+        free(stack);
+        return -1;
+    }
+
+    detector->stack = stack;
+    cpu->detector = detector;
+    detector_rehash(cpu);
+    return 0;
+}
+
+int cpu_load_decoded(struct cpu *cpu, FILE *file)
+{
+    assert(cpu != NULL);
+    assert(file != NULL);
+
+    if (cpu_wait_loaded(cpu) != 0) {
+        return -1;
+    }
+
+    // only the hash is checked, the records are trusted
+    struct decoded_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != DECODED_MAGIC
+            || header.version != DECODED_VERSION || header.cells > (size_t) (cpu->stack_top - cpu->memory)
+            || decoded_hash((const uint32_t *) cpu->memory, header.cells) != header.hash) {
+        return -1;
+    }
+
+    struct decoded_record *records = malloc(header.cells * sizeof(*records) + 1);
+    if (records == NULL || fread(records, sizeof(*records), header.cells, file) != header.cells) {
+        free(records);
+        return -1;
+    }
+
+    free(cpu->decoded);
+    cpu->decoded = records;
+    cpu->decoded_cells = header.cells;
+    return 0;
+}
+
+int cpu_wait_loaded(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    return (cpu->loader == NULL || loader_wait(cpu, SIZE_MAX)) ? 0 : -1;
+}
+
+static void data_unmap(int32_t *data, size_t cells)
+{
+    if (data != NULL) {
+        munmap(data, cells * CELL_SIZE);
+    }
+}
+
+int cpu_map_data(struct cpu *cpu, FILE *file, bool writable)
+{
+    assert(cpu != NULL);
+    assert(file != NULL);
+
+    // a pipe or terminal reports a size of 0 and would map as an empty region
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode) || info.st_size % CELL_SIZE != 0) {
+        return -1;
+    }
+
+    // an empty file maps nothing, the region is empty all the same
+    int32_t *data = NULL;
+    size_t cells = (size_t) info.st_size / CELL_SIZE;
+    if (cells > 0) {
+        int protection = PROT_READ | (writable ? PROT_WRITE : 0);
+        data = mmap(NULL, cells * CELL_SIZE, protection, MAP_PRIVATE, fileno(file), 0);
+        if (data == MAP_FAILED) {
+            return -1;
+        }
+    }
+
+    data_unmap(cpu->data, cpu->data_cells);
+    cpu->data = data;
+    cpu->data_cells = cells;
+    cpu->data_writable = writable;
+    return 0;
+}
+
 void cpu_destroy(struct cpu *cpu)
 {
     assert(cpu != NULL);
 
     cpu_clear(cpu);
+    coroutines_end(cpu);
+    cpu_set_loop_detection(cpu, false);
+    free(cpu->decoded);
+    cpu->decoded = NULL;
+    cpu->decoded_cells = 0;
+    data_unmap(cpu->data, cpu->data_cells);
+    cpu->data = NULL;
+    cpu->data_cells = 0;
+    if (cpu->loader != NULL) {
+        loader_destroy(cpu->loader);
+        cpu->loader = NULL;
+    }
     free(cpu->memory);
     cpu->memory = NULL;
     cpu->stack_bottom = NULL;
@@ -507,35 +1495,502 @@ void cpu_reset(struct cpu *cpu)
     assert(cpu != NULL);
 
     cpu_clear(cpu);
+    coroutines_end(cpu);
     memset(cpu->stack_bottom, 0, cpu->stack_size * CELL_SIZE);
     cpu->stack_bottom = NULL;
 }
 
-int cpu_step(struct cpu *cpu)
+static bool config_is_private(const struct parked_config *config)
 {
-    assert(cpu != NULL);
+    return config->decoded != NULL || config->data != NULL;
+}
 
-    if (cpu->status != CPU_OK) {
+// Stores the block for the settings of CPU in CONFIG, NULL for the defaults.
+// Returns -1 if out of memory.
+static int config_acquire(const struct cpu *cpu, struct parked_config **config)
+{
+    struct parked_config wanted = {
+        .references = 1,
+        .next = NULL,
+        .in = cpu->in,
+        .out = cpu->out,
+        .profile = cpu->profile,
+        .profile_cells = cpu->profile_cells,
+        .loop_detection = cpu->detector != NULL,
+        .decoded = cpu->decoded,
+        .decoded_cells = cpu->decoded_cells,
+        .data = cpu->data,
+        .data_cells = cpu->data_cells,
+        .data_writable = cpu->data_writable,
+    };
+
+    *config = NULL;
+    if (!config_is_private(&wanted) && wanted.in == stdin && wanted.out == stdout && wanted.profile == NULL
+            && !wanted.loop_detection) {
+        return 0;
+    }
+
+    if (config_is_private(&wanted)) {
+        *config = malloc(sizeof(struct parked_config));
+        if (*config == NULL) {
+            return -1;
+        }
+        **config = wanted;
         return 0;
     }
 
+    pthread_mutex_lock(&parked_configs_lock);
+    for (struct parked_config *shared = parked_configs; shared != NULL; shared = shared->next) {
+        if (shared->in == wanted.in && shared->out == wanted.out && shared->profile == wanted.profile
+                && shared->profile_cells == wanted.profile_cells && shared->loop_detection == wanted.loop_detection) {
+            shared->references++;
+            *config = shared;
+            break;
+        }
+    }
+    if (*config == NULL && (*config = malloc(sizeof(struct parked_config))) != NULL) {
+        **config = wanted;
+        (*config)->next = parked_configs;
+        parked_configs = *config;
+    }
+    pthread_mutex_unlock(&parked_configs_lock);
+    return (*config != NULL) ? 0 : -1;
+}
+
+// Drops a reference to CONFIG (may be NULL). Whatever a private block owns
+// has to be released or handed on before.
+static void config_release(struct parked_config *config)
+{
+    if (config == NULL) {
+        return;
+    }
+    if (config_is_private(config)) {
+        free(config);
+        return;
+    }
+
+    pthread_mutex_lock(&parked_configs_lock);
+    if (--config->references == 0) {
+        struct parked_config **link = &parked_configs;
+        while (*link != config) {
+            link = &(*link)->next;
+        }
+        *link = config->next;
+        free(config);
+    }
+    pthread_mutex_unlock(&parked_configs_lock);
+}
+
+struct cpu_parked *cpu_park(struct cpu *cpu, const int32_t *image, size_t image_cells, FILE *spill)
+{
+    assert(cpu != NULL);
+    assert(cpu->memory != NULL);
+
+    // a record holds one stack
+    if (cpu->coroutines != NULL || cpu_wait_loaded(cpu) != 0) {
+        return NULL;
+    }
+
+    // nothing writes below the stack, so the code region is the image followed by zeros
+    int32_t code_cells = cpu->stack_top - cpu->memory;
+    int32_t owned_cells = code_cells;
+    while (owned_cells > 0 && cpu->memory[owned_cells - 1] == 0) {
+        owned_cells--;
+    }
+
+    if (image != NULL) {
+        if (image_cells < (size_t) owned_cells || image_cells > (size_t) code_cells
+                || memcmp(image, cpu->memory, owned_cells * CELL_SIZE) != 0) {
+            return NULL;
+        }
+        for (size_t i = owned_cells; i < image_cells; ++i) {
+            if (image[i] != 0) {
+                return NULL;
+            }
+        }
+        owned_cells = 0;
+    }
+
+    int32_t payload_cells = owned_cells + cpu->stack_size;
+    int32_t *live_stack = cpu->stack_bottom - cpu->stack_size + 1;
+    struct cpu_parked *parked = malloc(sizeof(struct cpu_parked) + (spill == NULL ? payload_cells * CELL_SIZE : 0));
+    if (parked == NULL) {
+        return NULL;
+    }
+
+    if (config_acquire(cpu, &parked->config) != 0) {
+        free(parked);
+        return NULL;
+    }
+
+    parked->extra = NULL;
+    if (!stats_are_zero(&cpu->stats) || cpu->traps_armed != 0) {
+        parked->extra = malloc(sizeof(struct parked_extra) + traps_count(cpu->traps_armed) * CELL_SIZE);
+        if (parked->extra == NULL) {
+            config_release(parked->config);
+            free(parked);
+            return NULL;
+        }
+        parked->extra->stats = cpu->stats;
+        parked->extra->traps_armed = cpu->traps_armed;
+        int32_t armed = 0;
+        for (int32_t status = TRAP_FIRST; status <= TRAP_LAST; ++status) {
+            if (cpu->traps_armed & (1u << status)) {
+                parked->extra->handlers[armed++] = cpu->traps[status];
+            }
+        }
+    }
+
+    memcpy(parked->registers, cpu->registers, 4 * CELL_SIZE);
+    parked->status = cpu->status;
+    parked->stack_size = cpu->stack_size;
+    parked->instruction_index = cpu->instruction_index;
+    parked->code_cells = code_cells;
+    parked->stack_capacity = cpu->stack_bottom - cpu->stack_top + 1;
+    parked->image_cells = (image != NULL) ? (int32_t) image_cells : owned_cells;
+    parked->image = image;
+    parked->spill = spill;
+    parked->spill_offset = 0;
+
+    if (spill == NULL) {
+        memcpy(parked->payload, cpu->memory, owned_cells * CELL_SIZE);
+        memcpy(parked->payload + owned_cells, live_stack, cpu->stack_size * CELL_SIZE);
+    } else {
+        if (fseek(spill, 0, SEEK_END) != 0 || (parked->spill_offset = ftell(spill)) < 0
+                || fwrite(cpu->memory, CELL_SIZE, owned_cells, spill) != (size_t) owned_cells
+                || fwrite(live_stack, CELL_SIZE, cpu->stack_size, spill) != (size_t) cpu->stack_size
+                || fflush(spill) != 0) {
+            config_release(parked->config);
+            free(parked->extra);
+            free(parked);
+            return NULL;
+        }
+    }
+
+    // the decoded form and the data region stay with the parked state
+    cpu->decoded = NULL;
+    cpu->data = NULL;
+    cpu_destroy(cpu);
+    return parked;
+}
+
+struct cpu *cpu_unpark(struct cpu_parked *parked)
+{
+    assert(parked != NULL);
+
+    int32_t block_cells = parked->code_cells + parked->stack_capacity;
+    int32_t *memory = malloc(block_cells * CELL_SIZE);
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    int32_t owned_cells = (parked->image != NULL) ? 0 : parked->image_cells;
+    int32_t *stack_bottom = &memory[block_cells - 1];
+    int32_t *live_stack = stack_bottom - parked->stack_size + 1;
+    memset(memory, 0, block_cells * CELL_SIZE);
+
+    if (parked->image != NULL) {
+        memcpy(memory, parked->image, parked->image_cells * CELL_SIZE);
+    }
+
+    if (parked->spill == NULL) {
+        memcpy(memory, parked->payload, owned_cells * CELL_SIZE);
+        memcpy(live_stack, parked->payload + owned_cells, parked->stack_size * CELL_SIZE);
+    } else if (fseek(parked->spill, parked->spill_offset, SEEK_SET) != 0
+            || fread(memory, CELL_SIZE, owned_cells, parked->spill) != (size_t) owned_cells
+            || fread(live_stack, CELL_SIZE, parked->stack_size, parked->spill) != (size_t) parked->stack_size) {
+        free(memory);
+        return NULL;
+    }
+
+    struct cpu *cpu = cpu_create(memory, stack_bottom, parked->stack_capacity);
+    if (cpu == NULL) {
+        free(memory);
+        return NULL;
+    }
+
+    memcpy(cpu->registers, parked->registers, 4 * CELL_SIZE);
+    cpu->status = parked->status;
+    cpu->stack_size = parked->stack_size;
+    cpu->instruction_index = parked->instruction_index;
+    if (parked->extra != NULL) {
+        cpu->stats = parked->extra->stats;
+        cpu->traps_armed = parked->extra->traps_armed;
+        int32_t armed = 0;
+        for (int32_t status = TRAP_FIRST; status <= TRAP_LAST; ++status) {
+            if (cpu->traps_armed & (1u << status)) {
+                cpu->traps[status] = parked->extra->handlers[armed++];
+            }
+        }
+    }
+    struct parked_config *config = parked->config;
+    if (config != NULL) {
+        cpu->in = config->in;
+        cpu->out = config->out;
+        cpu->profile = config->profile;
+        cpu->profile_cells = config->profile_cells;
+        if (config->loop_detection && cpu_set_loop_detection(cpu, true) != 0) {
+            cpu_destroy(cpu);
+            free(cpu);
+            return NULL;
+        }
+        cpu->decoded = config->decoded;
+        cpu->decoded_cells = config->decoded_cells;
+        cpu->data = config->data;
+        cpu->data_cells = config->data_cells;
+        cpu->data_writable = config->data_writable;
+    }
+    config_release(config);
+    free(parked->extra);
+    free(parked);
+    return cpu;
+}
+
+size_t cpu_parked_size(const struct cpu_parked *parked)
+{
+    assert(parked != NULL);
+
+    // an interned settings block is not counted, it is shared
+    size_t size = sizeof(struct cpu_parked);
+    if (parked->config != NULL && config_is_private(parked->config)) {
+        size += sizeof(struct parked_config) + parked->config->decoded_cells * sizeof(struct decoded_record);
+    }
+    if (parked->extra != NULL) {
+        size += sizeof(struct parked_extra) + traps_count(parked->extra->traps_armed) * CELL_SIZE;
+    }
+    if (parked->spill == NULL) {
+        size += (size_t) ((parked->image != NULL ? 0 : parked->image_cells) + parked->stack_size) * CELL_SIZE;
+    }
+    return size;
+}
+
+void cpu_parked_destroy(struct cpu_parked *parked)
+{
+    assert(parked != NULL);
+
+    if (parked->config != NULL) {
+        free(parked->config->decoded);
+        data_unmap(parked->config->data, parked->config->data_cells);
+    }
+    config_release(parked->config);
+    free(parked->extra);
+    free(parked);
+}
+
+static void execute(struct cpu *cpu)
+{
     int32_t index = cpu->instruction_index;
     if (index < 0 || index > cpu->stack_top - cpu->memory - 1) {
         cpu->status = CPU_INVALID_ADDRESS;
-        return 0;
+        return;
+    }
+
+    // a streamed image may not have arrived up to the opcode yet
+    if (index >= cpu->loaded_cells && !loader_wait(cpu, (size_t) index + 1)) {
+        cpu->status = CPU_INVALID_ADDRESS;
+        return;
     }
 
     int32_t instruction = cpu->memory[index];
-    if (instruction < 0 || instruction > 18) {
+    if (instruction < 0 || instruction >= OPCODE_COUNT || instructions[instruction] == NULL) {
         cpu->status = CPU_ILLEGAL_INSTRUCTION;
-        return 0;
+        return;
+    }
+
+    // nor up to its last operand, of which there are at most two
+    if (index + 2 >= cpu->loaded_cells) {
+        size_t end = (size_t) index + 1 + strlen(decoded_operands[instruction]);
+        if (end > (size_t) cpu->loaded_cells && !loader_wait(cpu, end)) {
+            cpu->status = CPU_INVALID_ADDRESS;
+            return;
+        }
+    }
+
+    if (cpu->profile != NULL && (size_t) index < cpu->profile_cells) {
+        cpu->profile[index]++;
     }
 
     instructions[instruction](cpu);
+}
+
+// Runs the verified record of the current instruction without decoding it.
+// Everything else, including every instruction that fails, takes the raw
+// path through execute(), which sets the status and index the same way.
+static void execute_decoded(struct cpu *cpu)
+{
+    int32_t index = cpu->instruction_index;
+    if (index < 0 || (size_t) index >= cpu->decoded_cells || !(cpu->decoded[index].flags & DECODED_VERIFIED)) {
+        execute(cpu);
+        return;
+    }
+
+    const struct decoded_record *record = &cpu->decoded[index];
+    int32_t *registers = cpu->registers;
+    int32_t reg1 = record->reg1 & 3;
+    int32_t reg2 = record->reg2 & 3;
+    int32_t *target;
+
+    switch (record->opcode) {
+    case 0: // nop
+        cpu->instruction_index = index + 1;
+        break;
+    case 2: // add
+        registers[REGISTER_A] += registers[reg1];
+        cpu->instruction_index = index + 2;
+        break;
+    case 3: // sub
+        registers[REGISTER_A] -= registers[reg1];
+        cpu->instruction_index = index + 2;
+        break;
+    case 4: // mul
+        registers[REGISTER_A] *= registers[reg1];
+        cpu->instruction_index = index + 2;
+        break;
+    case 5: // div
+        if (registers[reg1] == 0) {
+            execute(cpu);
+            return;
+        }
+        registers[REGISTER_A] /= registers[reg1];
+        cpu->instruction_index = index + 2;
+        break;
+    case 6: // inc
+        registers[reg1]++;
+        cpu->instruction_index = index + 2;
+        break;
+    case 7: // dec
+        registers[reg1]--;
+        cpu->instruction_index = index + 2;
+        break;
+    case 8: // loop
+        if (registers[REGISTER_C] == 0) {
+            cpu->instruction_index = index + 2;
+            break;
+        }
+        cpu->instruction_index = record->immediate;
+        cpu->stats.loops_taken++;
+        if (cpu->detector != NULL) {
+            detector_back_edge(cpu);
+        }
+        break;
+    case 9: // movr
+        registers[reg1] = record->immediate;
+        cpu->instruction_index = index + 3;
+        break;
+    case 10: // load
+    case 11: // store
+        target = cpu->stack_bottom - cpu->stack_size + registers[REGISTER_D] + record->immediate + 1;
+        if (target < cpu->stack_bottom - cpu->stack_size + 1 || target > cpu->stack_bottom) {
+            execute(cpu);
+            return;
+        }
+        if (record->opcode == 10) {
+            registers[reg1] = *target;
+        } else {
+            int32_t old_value = *target;
+            *target = registers[reg1];
+            if (cpu->detector != NULL) {
+                detector_cell_written(cpu, target, old_value);
+            }
+        }
+        cpu->instruction_index = index + 3;
+        break;
+    case 16: { // swap
+        int32_t reg2_bckp = registers[reg2];
+        registers[reg2] = registers[reg1];
+        registers[reg1] = reg2_bckp;
+        cpu->instruction_index = index + 3;
+        break;
+    }
+    case 17: // push
+        if (cpu->stack_size == cpu->stack_bottom - cpu->stack_limit + 1) {
+            execute(cpu);
+            return;
+        }
+        target = cpu->stack_bottom - cpu->stack_size;
+        *target = registers[reg1];
+        if (cpu->detector != NULL) {
+            detector_cell_written(cpu, target, 0);
+        }
+        cpu->stack_size++;
+        if (cpu->stack_size > cpu->stats.stack_high_water) {
+            cpu->stats.stack_high_water = cpu->stack_size;
+        }
+        cpu->stats.pushes++;
+        cpu->instruction_index = index + 2;
+        break;
+    case 18: { // pop
+        if (cpu->stack_size <= 0) {
+            execute(cpu);
+            return;
+        }
+        cpu->stack_size--;
+        target = cpu->stack_bottom - cpu->stack_size;
+        int32_t value = *target;
+        registers[reg1] = value;
+        *target = 0;
+        if (cpu->detector != NULL) {
+            detector_cell_written(cpu, target, value);
+        }
+        cpu->stats.pops++;
+        cpu->instruction_index = index + 2;
+        break;
+    }
+    default: // halt and I/O gain nothing from decoding
+        execute(cpu);
+        return;
+    }
+
+    if (cpu->profile != NULL && (size_t) index < cpu->profile_cells) {
+        cpu->profile[index]++;
+    }
+}
+
+// Hands the fault of the instruction at INDEX to the handler the guest armed
+// for it, with the status in C and INDEX in D. A handler runs once; the guest
+// arms it again to catch the next fault.
+static void take_trap(struct cpu *cpu, int32_t index)
+{
+    enum cpu_status status = cpu->status;
+    if (status < TRAP_FIRST || status > TRAP_LAST || !(cpu->traps_armed & (1u << status))) {
+        return;
+    }
+
+    if (cpu->detector != NULL) {
+        detector_forget(cpu->detector);
+    }
+
+    cpu->traps_armed &= ~(1u << status);
+    cpu->registers[REGISTER_C] = status;
+    cpu->registers[REGISTER_D] = index;
+    cpu->instruction_index = cpu->traps[status];
+    cpu->status = CPU_OK;
+}
+
+int cpu_step(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->status != CPU_OK) {
+        return 0;
+    }
+
+    int32_t index = cpu->instruction_index;
+    if (cpu->decoded != NULL) {
+        execute_decoded(cpu);
+    } else {
+        execute(cpu);
+    }
+    if (cpu->status != CPU_OK && cpu->traps_armed != 0) {
+        take_trap(cpu, index);
+    }
+    io_block_end(cpu);
     if (cpu->status != CPU_OK) {
+        cpu->stats.retired += (cpu->status == CPU_HALTED);
         return 0;
     }
 
+    cpu->stats.retired++;
     return 1;
 }
 
@@ -548,14 +2003,33 @@ long long cpu_run(struct cpu *cpu, size_t steps)
     }
 
     long long performed = 0;
-    while (cpu->status == CPU_OK && (performed < (long long) steps)) {
-        cpu_step(cpu);
-        performed++;
+    if (cpu->decoded != NULL) {
+        while (cpu->status == CPU_OK && (performed < (long long) steps)) {
+            int32_t index = cpu->instruction_index;
+            execute_decoded(cpu);
+            performed++;
+            if (cpu->status != CPU_OK && cpu->traps_armed != 0) {
+                take_trap(cpu, index);
+            }
+        }
+    } else {
+        while (cpu->status == CPU_OK && (performed < (long long) steps)) {
+            int32_t index = cpu->instruction_index;
+            execute(cpu);
+            performed++;
+            if (cpu->status != CPU_OK && cpu->traps_armed != 0) {
+                take_trap(cpu, index);
+            }
+        }
     }
+    io_block_end(cpu);
 
+    // counted once per block, the failing instruction did not retire
     if (cpu->status == CPU_OK || cpu->status == CPU_HALTED) {
+        cpu->stats.retired += performed;
         return performed;
     }
 
+    cpu->stats.retired += performed - 1;
     return -performed;
 }
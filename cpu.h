@@ -1,6 +1,7 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -13,7 +14,8 @@ enum cpu_status
     CPU_INVALID_ADDRESS,
     CPU_INVALID_STACK_OPERATION,
     CPU_DIV_BY_ZERO,
-    CPU_IO_ERROR
+    CPU_IO_ERROR,
+    CPU_INFINITE_LOOP
 };
 
 enum cpu_register
@@ -29,10 +31,54 @@ enum cpu_register
 
 struct cpu;
 
+struct cpu_parked;
+
+struct cpu_stats
+{
+    // instructions that completed, a fault taken by a trap handler included
+    uint64_t retired;
+    uint64_t loops_taken;
+    uint64_t pushes;
+    uint64_t pops;
+    int32_t stack_high_water;
+    // bytes the guest consumed, the whitespace and sign of an `in` that found
+    // no number included
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t io_blocked_ns;
+};
+
+struct cpu_state
+{
+    int32_t registers[4];
+    enum cpu_status status;
+    int32_t stack_size;
+    int32_t instruction_index;
+};
+
 int32_t *cpu_create_memory(FILE *program, size_t stack_capacity, int32_t **stack_bottom);
 
+// As cpu_create_memory() for an image written by `compiler -z` or
+// `linker -z` (see compressed.h). Returns NULL if PROGRAM is malformed.
+int32_t *cpu_create_memory_compressed(FILE *program, size_t stack_capacity, int32_t **stack_bottom);
+
 struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom, size_t stack_capacity);
 
+// As cpu_create_memory() and cpu_create() for a program of IMAGE_BYTES bytes,
+// but returns before reading it: a thread reads PROGRAM page by page while the
+// CPU runs, and an instruction waits only until its own operands are present.
+// An image that ends early stops the guest with CPU_INVALID_ADDRESS once it
+// reaches the missing part. The thread reads the descriptor of PROGRAM, which
+// may be a pipe, from its current position; data PROGRAM has already read
+// ahead from a pipe is not seen. PROGRAM must stay open until
+// cpu_wait_loaded() or cpu_destroy(), which stops reading right away, even
+// while the writer of a pipe stalls.
+struct cpu *cpu_create_streaming(FILE *program, size_t image_bytes, size_t stack_capacity, int32_t **stack_bottom);
+
+// Waits until a streamed image is completely present. Returns -1 if it ended
+// early, 0 otherwise.
+int cpu_wait_loaded(struct cpu *cpu);
+
 int32_t cpu_get_register(struct cpu *cpu, enum cpu_register reg);
 
 void cpu_set_register(struct cpu *cpu, enum cpu_register reg, int32_t value);
@@ -41,10 +87,64 @@ enum cpu_status cpu_get_status(struct cpu *cpu);
 
 int32_t cpu_get_stack_size(struct cpu *cpu);
 
+int32_t cpu_get_instruction_index(struct cpu *cpu);
+
+void cpu_get_stats(struct cpu *cpu, struct cpu_stats *stats);
+
+// All registers, the status and both indices at once.
+void cpu_get_state(struct cpu *cpu, struct cpu_state *state);
+
+// The live stack in place, top first: element I is what `load` reads at index
+// I. Stores the number of cells in SIZE. Like the stack size and instruction
+// index, this is the stack of the guest coroutine that is running. Valid
+// until the guest runs again or the instance is reset, parked or destroyed.
+const int32_t *cpu_get_stack(struct cpu *cpu, size_t *size);
+
+// Guest I/O goes through IN and OUT instead of stdin and stdout.
+void cpu_set_io(struct cpu *cpu, FILE *in, FILE *out);
+
+// Counts every executed instruction in COUNTS[instruction_index] for indices
+// below CELLS; NULL turns counting off again. A parked record keeps counting
+// into COUNTS once unparked, so it must outlive the record.
+void cpu_set_profile(struct cpu *cpu, uint64_t *counts, size_t cells);
+
+// Stops the guest with CPU_INFINITE_LOOP once its complete state repeats at a
+// `loop` back-edge without any I/O in between. Returns -1 if out of memory.
+int cpu_set_loop_detection(struct cpu *cpu, bool enabled);
+
+// Executes from the pre-decoded form written by `compiler -d` (see decoded.h).
+// Returns -1 if FILE is malformed or was not built from this CPU's image.
+int cpu_load_decoded(struct cpu *cpu, FILE *file);
+
+// Maps FILE, a whole number of native 32-bit words, as the data region that
+// the guest reads with `dload` and `dsize` without copying it. With WRITABLE
+// the mapping is copy-on-write and `dstore` may change it; the file never
+// changes. Returns -1 if FILE is not a regular file or cannot be mapped.
+int cpu_map_data(struct cpu *cpu, FILE *file, bool writable);
+
 void cpu_destroy(struct cpu *cpu);
 
 void cpu_reset(struct cpu *cpu);
 
+// Shrinks an idle instance to its registers, indices and live stack. IMAGE
+// (may be NULL) is a shared copy of the program the record refers to instead
+// of keeping its own; it must outlive the record. With SPILL (may be NULL) the
+// image copy and the stack go to the end of that file. On success the memory
+// of CPU is released as by cpu_destroy(), on failure CPU is left untouched.
+// Fails once the guest has created a coroutine. The record takes at most 80
+// bytes besides the stack and the image copy; the counters and armed traps of
+// a guest that ran and a decoded form or data region add side allocations,
+// while other settings are shared between records.
+struct cpu_parked *cpu_park(struct cpu *cpu, const int32_t *image, size_t image_cells, FILE *spill);
+
+// Rebuilds a running instance and releases the record, on failure the record
+// is left untouched.
+struct cpu *cpu_unpark(struct cpu_parked *parked);
+
+size_t cpu_parked_size(const struct cpu_parked *parked);
+
+void cpu_parked_destroy(struct cpu_parked *parked);
+
 int cpu_step(struct cpu *cpu);
 
 long long cpu_run(struct cpu *cpu, size_t steps);
@@ -0,0 +1,774 @@
+#ifndef CPU_HPP
+#define CPU_HPP
+
+// Header-only C++20 mirror of the engine in cpu.c in which everything is
+// constexpr, so the compiler itself can run a program:
+//
+//     constexpr std::array<std::int32_t, 5> image = { 12, 0, 14, 0, 1 }; // in A, out A, halt
+//     constexpr auto result = constexpr_cpu::evaluate(image, 16, std::string_view("42"), 100);
+//     static_assert(result.status == constexpr_cpu::status::halted);
+//     static_assert(result.output_view() == "42");
+//
+// The memory block, the code region with its zero padding, the stack, the
+// parsing of `in` and the handling of end of input follow cpu.c step for
+// step; tools/fuzz.c checks both engines against each other. Where cpu.c
+// leaves the result to the hardware, arithmetic wraps around and
+// INT32_MIN / -1 traps, which is a compile error in a constant expression.
+// There are no files to map; set_data() gives the machine a copy of a data
+// region instead.
+// Coroutines carve their stacks off the stack region as in cpu.c, and
+// stack_cell() and stack_size() refer to the running one.
+// Long programs need a higher -fconstexpr-loop-limit and -fconstexpr-ops-limit.
+
+#include "isa.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace constexpr_cpu {
+
+inline constexpr std::size_t block_size = 4096;
+inline constexpr std::size_t cell_size = sizeof(std::int32_t);
+
+inline constexpr std::size_t register_a = 0;
+inline constexpr std::size_t register_b = 1;
+inline constexpr std::size_t register_c = 2;
+inline constexpr std::size_t register_d = 3;
+
+// Same values as enum cpu_status; infinite_loop is never reported here.
+enum class status : std::int32_t
+{
+    ok,
+    halted,
+    illegal_instruction,
+    illegal_operand,
+    invalid_address,
+    invalid_stack_operation,
+    div_by_zero,
+    io_error,
+    infinite_loop,
+};
+
+// Faults a guest can handle itself with `trap`.
+inline constexpr std::int32_t trap_first = static_cast<std::int32_t>(status::illegal_instruction);
+inline constexpr std::int32_t trap_last = static_cast<std::int32_t>(status::io_error);
+
+// struct cpu_stats without io_blocked_ns.
+struct stats
+{
+    std::uint64_t retired = 0;
+    std::uint64_t loops_taken = 0;
+    std::uint64_t pushes = 0;
+    std::uint64_t pops = 0;
+    std::int32_t stack_high_water = 0;
+    std::uint64_t bytes_in = 0;
+    std::uint64_t bytes_out = 0;
+};
+
+// Size of the block cpu_create_memory() allocates for an image of IMAGE_BYTES.
+constexpr std::size_t memory_bytes(std::size_t image_bytes, std::size_t stack_capacity)
+{
+    std::size_t capacity = std::max<std::size_t>(1, (image_bytes + block_size - 1) / block_size) * block_size;
+    if (capacity - image_bytes < stack_capacity * cell_size) {
+        capacity += block_size * (((stack_capacity - 1) * cell_size - capacity + image_bytes + block_size) / block_size);
+    }
+    return capacity;
+}
+
+class machine
+{
+public:
+    // As cpu_create_memory() and cpu_create(), with INPUT in place of stdin.
+    constexpr machine(std::span<const std::int32_t> image, std::size_t stack_capacity,
+            std::span<const char> input = {})
+        : input_(input)
+    {
+        std::size_t cells = memory_bytes(image.size() * cell_size, stack_capacity) / cell_size;
+
+        // two cells past the block, which operands of an instruction in the
+        // last cells of a code region without stack would read from
+        memory_.assign(cells + 2, 0);
+        std::copy(image.begin(), image.end(), memory_.begin());
+        stack_bottom_ = cells - 1;
+        stack_top_ = cells - stack_capacity;
+        stack_limit_ = stack_top_;
+    }
+
+    // As cpu_map_data(), with a copy of DATA in place of the mapping.
+    constexpr void set_data(std::span<const std::int32_t> data, bool writable)
+    {
+        data_.assign(data.begin(), data.end());
+        data_writable_ = writable;
+    }
+
+    // As cpu_step(): returns 1 if the machine can continue, 0 otherwise.
+    constexpr int step()
+    {
+        if (status_ != status::ok) {
+            return 0;
+        }
+
+        std::int32_t index = instruction_index_;
+        execute();
+        if (status_ != status::ok && traps_armed_ != 0) {
+            take_trap(index);
+        }
+        if (status_ != status::ok) {
+            stats_.retired += (status_ == status::halted);
+            return 0;
+        }
+
+        stats_.retired++;
+        return 1;
+    }
+
+    // As cpu_run(): the number of steps performed, negated on an error.
+    constexpr long long run(std::size_t steps)
+    {
+        if (status_ != status::ok) {
+            return 0;
+        }
+
+        long long performed = 0;
+        while (status_ == status::ok && performed < static_cast<long long>(steps)) {
+            std::int32_t index = instruction_index_;
+            execute();
+            performed++;
+            if (status_ != status::ok && traps_armed_ != 0) {
+                take_trap(index);
+            }
+        }
+
+        if (status_ == status::ok || status_ == status::halted) {
+            stats_.retired += performed;
+            return performed;
+        }
+
+        stats_.retired += performed - 1;
+        return -performed;
+    }
+
+    constexpr status get_status() const
+    {
+        return status_;
+    }
+
+    constexpr std::int32_t get_register(std::size_t reg) const
+    {
+        return registers_[reg];
+    }
+
+    constexpr std::int32_t instruction_index() const
+    {
+        return instruction_index_;
+    }
+
+    constexpr std::int32_t stack_size() const
+    {
+        return stack_size_;
+    }
+
+    // The I-th cell from the bottom of the stack, stack_bottom[-I] in cpu.c.
+    constexpr std::int32_t stack_cell(std::size_t i) const
+    {
+        return memory_[stack_bottom_ - i];
+    }
+
+    constexpr const constexpr_cpu::stats &get_stats() const
+    {
+        return stats_;
+    }
+
+    constexpr std::string_view output() const
+    {
+        return output_;
+    }
+
+private:
+    // As struct coroutine in cpu.c, with cells as indices into memory_.
+    struct context
+    {
+        std::size_t stack_bottom;
+        std::size_t stack_limit;
+        std::int32_t stack_size;
+        std::int32_t instruction_index;
+        std::int32_t caller;
+    };
+
+    std::vector<std::int32_t> memory_;
+    std::size_t stack_bottom_ = 0;
+    std::size_t stack_top_ = 0;
+    std::size_t stack_limit_ = 0;
+    std::vector<context> contexts_; // empty until the first `cocreate`
+    std::size_t current_ = 0;
+    std::size_t segments_end_ = 0;
+    std::vector<std::int32_t> data_;
+    bool data_writable_ = false;
+    std::array<std::int32_t, 4> registers_ = {};
+    status status_ = status::ok;
+    std::int32_t stack_size_ = 0;
+    std::int32_t instruction_index_ = 0;
+    std::array<std::int32_t, trap_last + 1> traps_ = {};
+    std::uint32_t traps_armed_ = 0;
+    constexpr_cpu::stats stats_;
+    std::span<const char> input_;
+    std::size_t input_position_ = 0;
+    std::string output_;
+
+    static constexpr std::int32_t wrap(std::int64_t value)
+    {
+        return static_cast<std::int32_t>(static_cast<std::uint32_t>(value));
+    }
+
+    static constexpr bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    static constexpr bool is_digit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    constexpr std::int32_t operand()
+    {
+        return memory_[static_cast<std::size_t>(++instruction_index_)];
+    }
+
+    constexpr bool reg_is_valid(std::int32_t reg)
+    {
+        if (reg >= 0 && reg <= 3) {
+            return true;
+        }
+
+        status_ = status::illegal_operand;
+        return false;
+    }
+
+    constexpr void handle_eof(std::int32_t reg)
+    {
+        registers_[register_c] = 0;
+        registers_[reg] = -1;
+        instruction_index_++;
+    }
+
+    // fscanf(in, "%d%n") as glibc does it: the number is read as a long,
+    // saturating on overflow, and truncated to 32 bits.
+    // Returns 1, 0 on a matching failure or -1 at end of input. CONSUMED counts
+    // the whitespace and sign a failure used up as well.
+    constexpr int scan(std::int32_t &value, std::size_t &consumed)
+    {
+        std::size_t start = input_position_;
+        while (input_position_ < input_.size() && is_space(input_[input_position_])) {
+            input_position_++;
+        }
+        if (input_position_ == input_.size()) {
+            consumed = input_position_ - start;
+            return -1;
+        }
+
+        bool negative = false;
+        if (input_[input_position_] == '+' || input_[input_position_] == '-') {
+            negative = input_[input_position_] == '-';
+            input_position_++;
+        }
+        if (input_position_ == input_.size() || !is_digit(input_[input_position_])) {
+            consumed = input_position_ - start;
+            return 0;
+        }
+
+        constexpr std::uint64_t long_max = std::numeric_limits<std::int64_t>::max();
+        std::uint64_t magnitude = 0;
+        bool overflow = false;
+        for (; input_position_ < input_.size() && is_digit(input_[input_position_]); ++input_position_) {
+            std::uint64_t digit = static_cast<std::uint64_t>(input_[input_position_] - '0');
+            if (magnitude > (long_max + 1 - digit) / 10) {
+                overflow = true;
+            } else {
+                magnitude = magnitude * 10 + digit;
+            }
+        }
+
+        std::uint64_t number;
+        if (negative) {
+            number = (overflow || magnitude > long_max + 1) ? long_max + 1 : 0 - magnitude;
+        } else {
+            number = (overflow || magnitude > long_max) ? long_max : magnitude;
+        }
+
+        value = static_cast<std::int32_t>(static_cast<std::uint32_t>(number));
+        consumed = input_position_ - start;
+        return 1;
+    }
+
+    constexpr void print(std::int32_t value)
+    {
+        char digits[12];
+        std::size_t length = 0;
+        std::int64_t rest = value;
+        bool negative = rest < 0;
+        if (negative) {
+            rest = -rest;
+        }
+        do {
+            digits[length++] = static_cast<char>('0' + rest % 10);
+            rest /= 10;
+        } while (rest > 0);
+        if (negative) {
+            digits[length++] = '-';
+        }
+
+        stats_.bytes_out += length;
+        while (length > 0) {
+            output_.push_back(digits[--length]);
+        }
+    }
+
+    // As take_trap() in cpu.c.
+    constexpr void take_trap(std::int32_t index)
+    {
+        auto fault = static_cast<std::int32_t>(status_);
+        if (fault < trap_first || fault > trap_last || !(traps_armed_ & (1u << fault))) {
+            return;
+        }
+
+        traps_armed_ &= ~(1u << fault);
+        registers_[register_c] = fault;
+        registers_[register_d] = index;
+        instruction_index_ = traps_[static_cast<std::size_t>(fault)];
+        status_ = status::ok;
+    }
+
+    // As switch_context() in cpu.c.
+    constexpr void switch_context(std::size_t target)
+    {
+        contexts_[current_].stack_size = stack_size_;
+        contexts_[current_].instruction_index = instruction_index_;
+        stack_bottom_ = contexts_[target].stack_bottom;
+        stack_limit_ = contexts_[target].stack_limit;
+        stack_size_ = contexts_[target].stack_size;
+        instruction_index_ = contexts_[target].instruction_index;
+        current_ = target;
+    }
+
+    // The stack cell D + NUM counted from the top, or nothing if it is not live.
+    constexpr bool target_index(std::int32_t num, std::size_t &target)
+    {
+        std::int32_t index = wrap(static_cast<std::int64_t>(registers_[register_d]) + num);
+        if (index < 0 || index > stack_size_ - 1) {
+            status_ = status::invalid_stack_operation;
+            return false;
+        }
+
+        target = stack_bottom_ - static_cast<std::size_t>(stack_size_) + static_cast<std::size_t>(index) + 1;
+        return true;
+    }
+
+    constexpr void execute()
+    {
+        std::int32_t index = instruction_index_;
+        if (index < 0 || static_cast<std::size_t>(index) > stack_top_ - 1) {
+            status_ = status::invalid_address;
+            return;
+        }
+
+        std::int32_t instruction = memory_[static_cast<std::size_t>(index)];
+        if (instruction < 0 || (instruction > OP_POP && instruction < OP_DLOAD) || instruction >= OPCODE_COUNT) {
+            status_ = status::illegal_instruction;
+            return;
+        }
+
+        std::int32_t reg;
+        switch (instruction) {
+        case 0: // nop
+            instruction_index_++;
+            return;
+
+        case 1: // halt
+            status_ = status::halted;
+            return;
+
+        case 2: // add
+        case 3: // sub
+        case 4: // mul
+        case 5: // div
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            if (instruction == 2) {
+                registers_[register_a] = wrap(static_cast<std::int64_t>(registers_[register_a]) + registers_[reg]);
+            } else if (instruction == 3) {
+                registers_[register_a] = wrap(static_cast<std::int64_t>(registers_[register_a]) - registers_[reg]);
+            } else if (instruction == 4) {
+                registers_[register_a] = wrap(static_cast<std::int64_t>(registers_[register_a]) * registers_[reg]);
+            } else {
+                if (registers_[reg] == 0) {
+                    status_ = status::div_by_zero;
+                    return;
+                }
+                registers_[register_a] /= registers_[reg];
+            }
+            instruction_index_++;
+            return;
+
+        case 6: // inc
+        case 7: // dec
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            registers_[reg] = wrap(static_cast<std::int64_t>(registers_[reg]) + (instruction == 6 ? 1 : -1));
+            instruction_index_++;
+            return;
+
+        case 8: // loop
+            if (registers_[register_c] == 0) {
+                instruction_index_ += 2;
+                return;
+            }
+            instruction_index_ = operand();
+            stats_.loops_taken++;
+            return;
+
+        case 9: // movr
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            registers_[reg] = operand();
+            instruction_index_++;
+            return;
+
+        case 10: // load
+        case 11: { // store
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            std::size_t target;
+            if (!target_index(operand(), target)) {
+                return;
+            }
+            if (instruction == 10) {
+                registers_[reg] = memory_[target];
+            } else {
+                memory_[target] = registers_[reg];
+            }
+            instruction_index_++;
+            return;
+        }
+
+        case 12: { // in
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            std::int32_t num = 0;
+            std::size_t consumed = 0;
+            int result = scan(num, consumed);
+            stats_.bytes_in += consumed;
+            if (result == 0) {
+                status_ = status::io_error;
+                return;
+            }
+            if (result < 0) {
+                handle_eof(reg);
+                return;
+            }
+            registers_[reg] = num;
+            instruction_index_++;
+            return;
+        }
+
+        case 13: // get
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            if (input_position_ == input_.size()) {
+                handle_eof(reg);
+                return;
+            }
+            registers_[reg] = static_cast<unsigned char>(input_[input_position_++]);
+            stats_.bytes_in++;
+            instruction_index_++;
+            return;
+
+        case 14: // out
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            print(registers_[reg]);
+            instruction_index_++;
+            return;
+
+        case 15: // put
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            if (registers_[reg] < 0 || registers_[reg] > 255) {
+                status_ = status::illegal_operand;
+                return;
+            }
+            output_.push_back(static_cast<char>(registers_[reg]));
+            stats_.bytes_out++;
+            instruction_index_++;
+            return;
+
+        case 16: { // swap
+            std::int32_t reg1 = operand();
+            std::int32_t reg2 = operand();
+            if (!reg_is_valid(reg1) || !reg_is_valid(reg2)) {
+                return;
+            }
+            std::swap(registers_[reg1], registers_[reg2]);
+            instruction_index_++;
+            return;
+        }
+
+        case 17: // push
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            if (static_cast<std::size_t>(stack_size_) == stack_bottom_ - stack_limit_ + 1) {
+                status_ = status::invalid_stack_operation;
+                return;
+            }
+            memory_[stack_bottom_ - static_cast<std::size_t>(stack_size_)] = registers_[reg];
+            stack_size_++;
+            stats_.stack_high_water = std::max(stats_.stack_high_water, stack_size_);
+            stats_.pushes++;
+            instruction_index_++;
+            return;
+
+        case 0x1a: // dload
+        case 0x1b: { // dstore
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            std::int64_t cell = static_cast<std::int64_t>(registers_[register_d]) + operand();
+            if (cell < 0 || static_cast<std::uint64_t>(cell) >= data_.size()) {
+                status_ = status::invalid_address;
+                return;
+            }
+            if (instruction == 0x1a) {
+                registers_[reg] = data_[static_cast<std::size_t>(cell)];
+            } else if (!data_writable_) {
+                status_ = status::invalid_address;
+                return;
+            } else {
+                data_[static_cast<std::size_t>(cell)] = registers_[reg];
+            }
+            instruction_index_++;
+            return;
+        }
+
+        case 0x1c: // dsize
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            registers_[reg] = static_cast<std::int32_t>(
+                    std::min<std::size_t>(data_.size(), std::numeric_limits<std::int32_t>::max()));
+            instruction_index_++;
+            return;
+
+        case 0x1d: { // inb
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            std::size_t got = std::min(input_.size() - input_position_, cell_size);
+            std::uint32_t value = 0;
+            for (std::size_t i = 0; i < got; ++i) {
+                value |= static_cast<std::uint32_t>(static_cast<unsigned char>(input_[input_position_++])) << (8 * i);
+            }
+            stats_.bytes_in += got;
+            if (got == 0) {
+                handle_eof(reg);
+                return;
+            }
+            if (got < cell_size) {
+                status_ = status::io_error;
+                return;
+            }
+            registers_[reg] = static_cast<std::int32_t>(value);
+            instruction_index_++;
+            return;
+        }
+
+        case 0x1e: { // outb
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            auto value = static_cast<std::uint32_t>(registers_[reg]);
+            for (std::size_t i = 0; i < cell_size; ++i) {
+                output_.push_back(static_cast<char>(value >> (8 * i) & 0xff));
+            }
+            stats_.bytes_out += cell_size;
+            instruction_index_++;
+            return;
+        }
+
+        case 0x1f: { // trap
+            std::int32_t fault = operand();
+            std::int32_t handler = operand();
+            if (fault < trap_first || fault > trap_last) {
+                status_ = status::illegal_operand;
+                return;
+            }
+            if (handler < 0) {
+                traps_armed_ &= ~(1u << fault);
+            } else {
+                traps_[static_cast<std::size_t>(fault)] = handler;
+                traps_armed_ |= 1u << fault;
+            }
+            instruction_index_++;
+            return;
+        }
+
+        case 0x20: { // cocreate
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            std::int32_t entry = operand();
+            std::int32_t cells = registers_[reg];
+            if (cells < 1) {
+                status_ = status::illegal_operand;
+                return;
+            }
+            if (contexts_.empty()) {
+                contexts_.push_back({ stack_bottom_, stack_limit_, 0, 0, 0 });
+                segments_end_ = stack_top_;
+            }
+            std::int32_t main_size = (current_ == 0) ? stack_size_ : contexts_[0].stack_size;
+            if (static_cast<std::int64_t>(cells) > static_cast<std::int64_t>(contexts_[0].stack_bottom + 1 - segments_end_) - main_size) {
+                status_ = status::invalid_stack_operation;
+                return;
+            }
+            contexts_.push_back({ segments_end_ + static_cast<std::size_t>(cells) - 1, segments_end_, 0, entry, -1 });
+            segments_end_ += static_cast<std::size_t>(cells);
+            contexts_[0].stack_limit = segments_end_;
+            if (current_ == 0) {
+                stack_limit_ = segments_end_;
+            }
+            registers_[reg] = static_cast<std::int32_t>(contexts_.size() - 1);
+            instruction_index_++;
+            return;
+        }
+
+        case 0x21: { // yield
+            if (current_ == 0) {
+                status_ = status::invalid_stack_operation;
+                return;
+            }
+            auto caller = static_cast<std::size_t>(contexts_[current_].caller);
+            contexts_[current_].caller = -1;
+            instruction_index_++;
+            switch_context(caller);
+            return;
+        }
+
+        case 0x22: { // resume
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            std::int32_t target = registers_[reg];
+            if (target < 1 || static_cast<std::size_t>(target) >= contexts_.size()
+                    || contexts_[static_cast<std::size_t>(target)].caller >= 0) {
+                status_ = status::illegal_operand;
+                return;
+            }
+            contexts_[static_cast<std::size_t>(target)].caller = static_cast<std::int32_t>(current_);
+            instruction_index_++;
+            switch_context(static_cast<std::size_t>(target));
+            return;
+        }
+
+        default: { // pop
+            reg = operand();
+            if (!reg_is_valid(reg)) {
+                return;
+            }
+            if (stack_size_ <= 0) {
+                status_ = status::invalid_stack_operation;
+                return;
+            }
+            stack_size_--;
+            std::size_t cell = stack_bottom_ - static_cast<std::size_t>(stack_size_);
+            registers_[reg] = memory_[cell];
+            memory_[cell] = 0;
+            stats_.pops++;
+            instruction_index_++;
+            return;
+        }
+        }
+    }
+};
+
+// What evaluate() leaves behind; OUTPUT holds the first OUTPUT_LENGTH bytes.
+template <std::size_t OutputCapacity>
+struct result
+{
+    std::array<std::int32_t, 4> registers;
+    constexpr_cpu::status status;
+    std::int32_t instruction_index;
+    std::int32_t stack_size;
+    long long run_result;
+    constexpr_cpu::stats stats;
+    std::array<char, OutputCapacity> output;
+    std::size_t output_length;
+
+    constexpr std::string_view output_view() const
+    {
+        return std::string_view(output.data(), output_length);
+    }
+};
+
+// Runs IMAGE for at most STEPS steps as cpu_run() would. Throws
+// std::length_error, a compile error in a constant expression, if the
+// program writes more than OutputCapacity bytes.
+template <std::size_t OutputCapacity = 256, std::size_t ImageCells>
+constexpr result<OutputCapacity> evaluate(const std::array<std::int32_t, ImageCells> &image,
+        std::size_t stack_capacity, std::span<const char> input, std::size_t steps)
+{
+    machine cpu(image, stack_capacity, input);
+
+    result<OutputCapacity> outcome = {};
+    outcome.run_result = cpu.run(steps);
+    for (std::size_t reg = register_a; reg <= register_d; ++reg) {
+        outcome.registers[reg] = cpu.get_register(reg);
+    }
+    outcome.status = cpu.get_status();
+    outcome.instruction_index = cpu.instruction_index();
+    outcome.stack_size = cpu.stack_size();
+    outcome.stats = cpu.get_stats();
+
+    std::string_view output = cpu.output();
+    if (output.size() > OutputCapacity) {
+        throw std::length_error("constexpr_cpu::evaluate: output exceeds OutputCapacity");
+    }
+    std::copy(output.begin(), output.end(), outcome.output.begin());
+    outcome.output_length = output.size();
+    return outcome;
+}
+
+} // namespace constexpr_cpu
+
+#endif // CPU_HPP
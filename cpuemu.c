@@ -0,0 +1,223 @@
+#define CPUEMU_BUILD
+#include "cpuemu.h"
+
+#include "cpu.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cpuemu
+{
+    struct cpu *cpu;
+    uint64_t budget;
+};
+
+_Static_assert((int) CPUEMU_INFINITE_LOOP == (int) CPU_INFINITE_LOOP, "cpuemu_status must mirror cpu_status");
+_Static_assert((int) CPUEMU_REGISTER_D == (int) REGISTER_D, "cpuemu_register must mirror cpu_register");
+
+unsigned cpuemu_abi_version(void)
+{
+    return CPUEMU_ABI_VERSION;
+}
+
+cpuemu *cpuemu_create_from_file(FILE *program, size_t stack_capacity)
+{
+    assert(program != NULL);
+
+    cpuemu *emu = malloc(sizeof(cpuemu));
+    if (emu == NULL) {
+        return NULL;
+    }
+
+    int32_t *stack_bottom;
+    int32_t *memory = cpu_create_memory(program, stack_capacity, &stack_bottom);
+    emu->cpu = (memory != NULL) ? cpu_create(memory, stack_bottom, stack_capacity) : NULL;
+    if (emu->cpu == NULL) {
+        free(memory);
+        free(emu);
+        return NULL;
+    }
+
+    emu->budget = 0;
+    return emu;
+}
+
+cpuemu *cpuemu_create(const void *image, size_t image_bytes, size_t stack_capacity)
+{
+    assert(image != NULL || image_bytes == 0);
+
+    // fmemopen does not accept an empty buffer
+    FILE *program = (image_bytes > 0) ? fmemopen((void *) image, image_bytes, "rb") : tmpfile();
+    if (program == NULL) {
+        return NULL;
+    }
+
+    cpuemu *emu = cpuemu_create_from_file(program, stack_capacity);
+    fclose(program);
+    return emu;
+}
+
+void cpuemu_destroy(cpuemu *emu)
+{
+    if (emu == NULL) {
+        return;
+    }
+
+    cpu_destroy(emu->cpu);
+    free(emu->cpu);
+    free(emu);
+}
+
+void cpuemu_set_io(cpuemu *emu, FILE *in, FILE *out)
+{
+    assert(emu != NULL);
+
+    cpu_set_io(emu->cpu, in, out);
+}
+
+void cpuemu_set_budget(cpuemu *emu, uint64_t steps)
+{
+    assert(emu != NULL);
+
+    emu->budget = steps;
+}
+
+uint64_t cpuemu_remaining_budget(const cpuemu *emu)
+{
+    assert(emu != NULL);
+
+    if (emu->budget == 0) {
+        return UINT64_MAX;
+    }
+
+    struct cpu_stats stats;
+    cpu_get_stats(emu->cpu, &stats);
+    return (stats.retired < emu->budget) ? emu->budget - stats.retired : 0;
+}
+
+int cpuemu_set_loop_detection(cpuemu *emu, int enabled)
+{
+    assert(emu != NULL);
+
+    return cpu_set_loop_detection(emu->cpu, enabled != 0);
+}
+
+long long cpuemu_run(cpuemu *emu, size_t steps)
+{
+    assert(emu != NULL);
+
+    uint64_t remaining = cpuemu_remaining_budget(emu);
+    if ((uint64_t) steps > remaining) {
+        steps = (size_t) remaining;
+    }
+    return (steps > 0) ? cpu_run(emu->cpu, steps) : 0;
+}
+
+int cpuemu_step(cpuemu *emu)
+{
+    assert(emu != NULL);
+
+    if (cpuemu_remaining_budget(emu) == 0) {
+        return 0;
+    }
+    return cpu_step(emu->cpu);
+}
+
+enum cpuemu_status cpuemu_get_status(const cpuemu *emu)
+{
+    assert(emu != NULL);
+
+    return (enum cpuemu_status) cpu_get_status(emu->cpu);
+}
+
+int32_t cpuemu_get_register(const cpuemu *emu, enum cpuemu_register reg)
+{
+    assert(emu != NULL);
+
+    return cpu_get_register(emu->cpu, (enum cpu_register) reg);
+}
+
+void cpuemu_set_register(cpuemu *emu, enum cpuemu_register reg, int32_t value)
+{
+    assert(emu != NULL);
+
+    cpu_set_register(emu->cpu, (enum cpu_register) reg, value);
+}
+
+int32_t cpuemu_get_instruction_index(const cpuemu *emu)
+{
+    assert(emu != NULL);
+
+    return cpu_get_instruction_index(emu->cpu);
+}
+
+int32_t cpuemu_get_stack_size(const cpuemu *emu)
+{
+    assert(emu != NULL);
+
+    return cpu_get_stack_size(emu->cpu);
+}
+
+int cpuemu_get_stats(const cpuemu *emu, struct cpuemu_stats *stats)
+{
+    assert(emu != NULL);
+    assert(stats != NULL);
+
+    if (stats->size < offsetof(struct cpuemu_stats, stack_high_water) + sizeof(stats->stack_high_water)) {
+        return -1;
+    }
+
+    struct cpu_stats current;
+    cpu_get_stats(emu->cpu, &current);
+
+    struct cpuemu_stats full = {
+        .size = stats->size,
+        .stack_high_water = current.stack_high_water,
+        .retired = current.retired,
+        .loops_taken = current.loops_taken,
+        .pushes = current.pushes,
+        .pops = current.pops,
+        .bytes_in = current.bytes_in,
+        .bytes_out = current.bytes_out,
+        .io_blocked_ns = current.io_blocked_ns,
+    };
+
+    // an older caller gets the prefix its struct has room for
+    size_t size = stats->size < sizeof(full) ? stats->size : sizeof(full);
+    memcpy(stats, &full, size);
+    return 0;
+}
+
+int cpuemu_get_state(const cpuemu *emu, struct cpuemu_state *state)
+{
+    assert(emu != NULL);
+    assert(state != NULL);
+
+    if (state->size < offsetof(struct cpuemu_state, status) + sizeof(state->status)) {
+        return -1;
+    }
+
+    struct cpu_state current;
+    cpu_get_state(emu->cpu, &current);
+
+    struct cpuemu_state full = {
+        .size = state->size,
+        .status = (int32_t) current.status,
+        .instruction_index = current.instruction_index,
+        .stack_size = current.stack_size,
+    };
+    memcpy(full.registers, current.registers, sizeof(full.registers));
+
+    size_t size = state->size < sizeof(full) ? state->size : sizeof(full);
+    memcpy(state, &full, size);
+    return 0;
+}
+
+const int32_t *cpuemu_get_stack(const cpuemu *emu, size_t *size)
+{
+    assert(emu != NULL);
+    assert(size != NULL);
+
+    return cpu_get_stack(emu->cpu, size);
+}
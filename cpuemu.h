@@ -0,0 +1,135 @@
+#ifndef CPUEMU_H
+#define CPUEMU_H
+
+// Embedding API of libcpuemu.
+//
+// Every symbol is versioned (see libcpuemu.map) and all types are either
+// opaque or carry their own size, so programs built against ABI version 1
+// keep working with later builds of the library. Nothing in cpu.h is part of
+// this ABI.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(CPUEMU_BUILD) && defined(__GNUC__)
+#define CPUEMU_API __attribute__((visibility("default")))
+#else
+#define CPUEMU_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CPUEMU_ABI_VERSION 1
+
+typedef struct cpuemu cpuemu;
+
+// Values are fixed; new statuses are only ever appended.
+enum cpuemu_status
+{
+    CPUEMU_OK = 0,
+    CPUEMU_HALTED = 1,
+    CPUEMU_ILLEGAL_INSTRUCTION = 2,
+    CPUEMU_ILLEGAL_OPERAND = 3,
+    CPUEMU_INVALID_ADDRESS = 4,
+    CPUEMU_INVALID_STACK_OPERATION = 5,
+    CPUEMU_DIV_BY_ZERO = 6,
+    CPUEMU_IO_ERROR = 7,
+    CPUEMU_INFINITE_LOOP = 8,
+};
+
+enum cpuemu_register
+{
+    CPUEMU_REGISTER_A = 0,
+    CPUEMU_REGISTER_B = 1,
+    CPUEMU_REGISTER_C = 2,
+    CPUEMU_REGISTER_D = 3,
+};
+
+// The caller sets SIZE to sizeof(struct cpuemu_stats); the library fills in
+// the fields it knows up to that size. New fields are only ever appended.
+struct cpuemu_stats
+{
+    uint32_t size;
+    int32_t stack_high_water;
+    uint64_t retired; // a fault taken by a trap handler included
+    uint64_t loops_taken;
+    uint64_t pushes;
+    uint64_t pops;
+    uint64_t bytes_in; // what a failing `in` skipped included
+    uint64_t bytes_out;
+    uint64_t io_blocked_ns;
+};
+
+// Sized like struct cpuemu_stats.
+struct cpuemu_state
+{
+    uint32_t size;
+    int32_t status; // enum cpuemu_status
+    int32_t registers[4];
+    int32_t instruction_index;
+    int32_t stack_size;
+};
+
+// The ABI version of the loaded library.
+CPUEMU_API unsigned cpuemu_abi_version(void);
+
+// Creates an instance from a program image of IMAGE_BYTES bytes (a multiple of
+// 4) with room for STACK_CAPACITY stack cells. The image is copied.
+// Returns NULL if the image is malformed or memory runs out.
+CPUEMU_API cpuemu *cpuemu_create(const void *image, size_t image_bytes, size_t stack_capacity);
+
+// As cpuemu_create(), reading the image from PROGRAM.
+CPUEMU_API cpuemu *cpuemu_create_from_file(FILE *program, size_t stack_capacity);
+
+CPUEMU_API void cpuemu_destroy(cpuemu *emu);
+
+// Guest input and output of this instance; stdin and stdout by default.
+CPUEMU_API void cpuemu_set_io(cpuemu *emu, FILE *in, FILE *out);
+
+// Limits the total number of steps this instance may ever take, 0 for none.
+CPUEMU_API void cpuemu_set_budget(cpuemu *emu, uint64_t steps);
+
+// Steps the instance may still take, UINT64_MAX without a budget.
+CPUEMU_API uint64_t cpuemu_remaining_budget(const cpuemu *emu);
+
+// Stops guests that provably loop forever with CPUEMU_INFINITE_LOOP.
+// Returns 0, or -1 if memory runs out.
+CPUEMU_API int cpuemu_set_loop_detection(cpuemu *emu, int enabled);
+
+// Runs at most STEPS steps, fewer if the budget runs out first. Returns the
+// steps performed, negated if the guest stopped on an error.
+CPUEMU_API long long cpuemu_run(cpuemu *emu, size_t steps);
+
+// Performs one step. Returns 1 while the guest can continue, 0 otherwise.
+CPUEMU_API int cpuemu_step(cpuemu *emu);
+
+CPUEMU_API enum cpuemu_status cpuemu_get_status(const cpuemu *emu);
+
+CPUEMU_API int32_t cpuemu_get_register(const cpuemu *emu, enum cpuemu_register reg);
+
+CPUEMU_API void cpuemu_set_register(cpuemu *emu, enum cpuemu_register reg, int32_t value);
+
+CPUEMU_API int32_t cpuemu_get_instruction_index(const cpuemu *emu);
+
+CPUEMU_API int32_t cpuemu_get_stack_size(const cpuemu *emu);
+
+// Returns 0, or -1 if STATS->size is too small for the first field.
+CPUEMU_API int cpuemu_get_stats(const cpuemu *emu, struct cpuemu_stats *stats);
+
+// Status, registers and indices in one call. Returns 0, or -1 if STATE->size
+// is too small for the first field.
+CPUEMU_API int cpuemu_get_state(const cpuemu *emu, struct cpuemu_state *state);
+
+// The live stack without copying, top first as the guest's `load` indexes it.
+// Stores the number of cells in SIZE. Valid until the instance runs, steps or
+// is destroyed.
+CPUEMU_API const int32_t *cpuemu_get_stack(const cpuemu *emu, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CPUEMU_H
@@ -0,0 +1,95 @@
+#ifndef DECODED_H
+#define DECODED_H
+
+// Pre-decoded programs, written by `compiler -d` next to the raw image and
+// run by cpu.c once cpu_load_decoded() found the hash to match the image:
+//
+//   struct decoded_header
+//   struct decoded_record[cells]    one for every index of the image
+//
+// `loop` may jump to any index, so every index gets the record of the
+// instruction that would start there. A record is verified when its opcode
+// exists and its operands lie inside the image and name valid registers;
+// only verified records skip decoding, the rest run from the raw image.
+
+#include "isa.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DECODED_MAGIC 0x44555043u // "CPUD"
+#define DECODED_VERSION 1
+
+#define DECODED_VERIFIED 0x1u
+
+struct decoded_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cells;
+    uint32_t reserved;
+    uint64_t hash; // decoded_hash() of the raw image
+};
+
+struct decoded_record
+{
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t reg1;
+    uint8_t reg2;
+    int32_t immediate; // the number of movr, load and store, the target of loop
+};
+
+// Operands of every opcode: 'r' register, 'n' number, 'l' loop target; NULL
+// for the codes the CPU does not implement.
+static const char *const decoded_operands[OPCODE_COUNT] = {
+    "", "", "r", "r", "r", "r", "r", "r", "l", "rn",
+    "rn", "rn", "r", "r", "r", "r", "rr", "r", "r",
+    [0x1a] = "rn", "rn", "r", "r", "r", "nl", "rl", "", "r"
+};
+
+// FNV-1a over the words of the image.
+static inline uint64_t decoded_hash(const uint32_t *image, size_t cells)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ cells;
+    for (size_t i = 0; i < cells; ++i) {
+        hash ^= image[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// The record of the instruction starting at INDEX of an image of CELLS words.
+static inline struct decoded_record decoded_record_at(const uint32_t *image, size_t cells, size_t index)
+{
+    struct decoded_record record = { 0 };
+    if (image[index] >= sizeof(decoded_operands) / sizeof(decoded_operands[0])
+            || decoded_operands[image[index]] == NULL) {
+        return record;
+    }
+
+    record.opcode = (uint8_t) image[index];
+    const char *operands = decoded_operands[image[index]];
+    if (strlen(operands) >= cells - index) {
+        return record;
+    }
+
+    for (size_t i = 0; operands[i] != '\0'; ++i) {
+        uint32_t word = image[index + 1 + i];
+        if (operands[i] != 'r') {
+            record.immediate = (int32_t) word;
+        } else if (word > 3) {
+            return record;
+        } else if (i == 0) {
+            record.reg1 = (uint8_t) word;
+        } else {
+            record.reg2 = (uint8_t) word;
+        }
+    }
+
+    record.flags = DECODED_VERIFIED;
+    return record;
+}
+
+#endif // DECODED_H
@@ -0,0 +1,52 @@
+#ifndef ISA_H
+#define ISA_H
+
+// Opcodes of the instruction set and their mnemonics, shared by cpu.c, the
+// C++ mirror in cpu.hpp, the profiler, the benchmarks and the fuzzer. The
+// operands of every opcode are listed in decoded.h. Plain C that a C++
+// translation unit can include as well.
+
+#include <stddef.h>
+
+enum opcode
+{
+    OP_NOP,
+    OP_HALT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_INC,
+    OP_DEC,
+    OP_LOOP,
+    OP_MOVR,
+    OP_LOAD,
+    OP_STORE,
+    OP_IN,
+    OP_GET,
+    OP_OUT,
+    OP_PUT,
+    OP_SWAP,
+    OP_PUSH,
+    OP_POP,
+    OP_DLOAD = 0x1a,
+    OP_DSTORE,
+    OP_DSIZE,
+    OP_INB,
+    OP_OUTB,
+    OP_TRAP,
+    OP_COCREATE,
+    OP_YIELD,
+    OP_RESUME,
+    OPCODE_COUNT
+};
+
+// NULL for the codes the CPU does not implement.
+static const char *const opcode_mnemonics[OPCODE_COUNT] = {
+    "nop", "halt", "add", "sub", "mul", "div", "inc", "dec", "loop", "movr",
+    "load", "store", "in", "get", "out", "put", "swap", "push", "pop",
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    "dload", "dstore", "dsize", "inb", "outb", "trap", "cocreate", "yield", "resume"
+};
+
+#endif // ISA_H
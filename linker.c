@@ -0,0 +1,554 @@
+// Links relocatable objects written by `compiler -r` into an image for ./cpu.
+//
+// Build: gcc -o linker linker.c
+//
+// ./linker [-z] [-m MAP] -o IMAGE OBJECT... [-l LIBRARY]...
+//
+// Every OBJECT is linked whole, in the order given, and the first one starts
+// at index 0. A LIBRARY only contributes the sections that are referenced
+// from code already in the image, or that such a section falls through into,
+// so a program pays only for the routines it uses. Global labels must be
+// defined once across all objects and libraries. MAP receives the
+// "INDEX LABEL" lines ./cpu profile reads, as `compiler -m` writes them.
+// With -z the image is written compressed (see compressed.h).
+
+#include "compressed.h"
+#include "object.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_INPUTS 256
+
+struct input
+{
+    const char *path;
+    bool library;
+    struct object_header header;
+    uint32_t *words;
+    const uint32_t *code;
+    const struct object_section *sections;
+    const struct object_symbol *symbols;
+    struct object_relocation *relocations;
+    const char *names;
+    bool *kept;
+    uint32_t *address; // of every kept section in the image
+};
+
+struct global
+{
+    const char *name;
+    size_t input;
+    uint32_t value;
+};
+
+struct map_line
+{
+    uint32_t index;
+    const char *name;
+};
+
+static struct input inputs[MAX_INPUTS];
+static size_t input_count;
+
+static struct global *globals;
+static size_t global_count;
+
+// sections waiting for their references to be followed
+static struct
+{
+    size_t input;
+    size_t section;
+} *pending;
+static size_t pending_count;
+
+static uint32_t section_end(const struct input *input, size_t section)
+{
+    return (section + 1 < input->header.section_count) ? input->sections[section + 1].start
+                                                      : input->header.code_cells;
+}
+
+/**
+ * @return the section holding code index VALUE; an index at a section boundary
+ * belongs to the section that starts there
+ */
+static size_t section_of(const struct input *input, uint32_t value)
+{
+    size_t low = 0;
+    size_t high = input->header.section_count;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (input->sections[middle].start <= value) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static int relocation_cmp(const void *a, const void *b)
+{
+    const struct object_relocation *ra = a;
+    const struct object_relocation *rb = b;
+
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+/**
+ * @return the first relocation at or after code index OFFSET
+ */
+static size_t first_relocation(const struct input *input, uint32_t offset)
+{
+    size_t low = 0;
+    size_t high = input->header.relocation_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (input->relocations[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static int global_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct global *) a)->name, ((const struct global *) b)->name);
+}
+
+static int map_line_cmp(const void *a, const void *b)
+{
+    const struct map_line *la = a;
+    const struct map_line *lb = b;
+
+    if (la->index != lb->index) {
+        return (la->index > lb->index) - (la->index < lb->index);
+    }
+    return strcmp(la->name, lb->name);
+}
+
+static bool load_error(const struct input *input, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", input->path, what);
+    return false;
+}
+
+/**
+ * Reads and validates one object.
+ */
+static bool load_input(struct input *input)
+{
+    FILE *file = fopen(input->path, "rb");
+    if (file == NULL) {
+        return load_error(input, "cannot open");
+    }
+
+    size_t capacity = 4096;
+    size_t bytes = 0;
+    input->words = malloc(capacity);
+    assert(input->words != NULL);
+    size_t got;
+    while ((got = fread((char *) input->words + bytes, 1, capacity - bytes, file)) > 0) {
+        bytes += got;
+        if (bytes == capacity) {
+            capacity *= 2;
+            input->words = realloc(input->words, capacity);
+            assert(input->words != NULL);
+        }
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    if (failed) {
+        return load_error(input, "cannot read");
+    }
+    if (bytes % sizeof(uint32_t) != 0) {
+        return load_error(input, "not a whole number of words");
+    }
+
+    size_t length = bytes / sizeof(uint32_t);
+    const size_t header_words = sizeof(struct object_header) / sizeof(uint32_t);
+    if (length < header_words) {
+        return load_error(input, "not an object");
+    }
+    memcpy(&input->header, input->words, sizeof(input->header));
+    const struct object_header *header = &input->header;
+    if (header->magic != OBJECT_MAGIC || header->version != OBJECT_VERSION) {
+        return load_error(input, "not an object of this version");
+    }
+
+    uint64_t expected = header_words + (uint64_t) header->code_cells
+            + (uint64_t) header->section_count * (sizeof(struct object_section) / sizeof(uint32_t))
+            + (uint64_t) header->symbol_count * (sizeof(struct object_symbol) / sizeof(uint32_t))
+            + (uint64_t) header->relocation_count * (sizeof(struct object_relocation) / sizeof(uint32_t))
+            + header->names_bytes / sizeof(uint32_t);
+    if (header->section_count == 0 || header->names_bytes % sizeof(uint32_t) != 0 || expected != length) {
+        return load_error(input, "truncated or malformed object");
+    }
+
+    input->code = input->words + header_words;
+    input->sections = (const struct object_section *) (input->code + header->code_cells);
+    input->symbols = (const struct object_symbol *) (input->sections + header->section_count);
+    input->relocations = (struct object_relocation *) (input->symbols + header->symbol_count);
+    input->names = (const char *) (input->relocations + header->relocation_count);
+
+    for (size_t i = 0; i < header->section_count; ++i) {
+        bool ordered = (i == 0) ? input->sections[i].start == 0
+                                : input->sections[i].start > input->sections[i - 1].start;
+        if (!ordered || input->sections[i].start > header->code_cells) {
+            return load_error(input, "malformed section table");
+        }
+    }
+
+    for (size_t i = 0; i < header->symbol_count; ++i) {
+        const struct object_symbol *symbol = &input->symbols[i];
+        if (symbol->name >= header->names_bytes
+                || memchr(input->names + symbol->name, '\0', header->names_bytes - symbol->name) == NULL
+                || (symbol->value != OBJECT_UNDEFINED && symbol->value > header->code_cells)
+                || (symbol->value == OBJECT_UNDEFINED && (symbol->flags & SYMBOL_LOCAL) != 0)) {
+            return load_error(input, "malformed symbol table");
+        }
+    }
+
+    for (size_t i = 0; i < header->relocation_count; ++i) {
+        if (input->relocations[i].offset >= header->code_cells
+                || input->relocations[i].symbol >= header->symbol_count) {
+            return load_error(input, "malformed relocation table");
+        }
+    }
+    qsort(input->relocations, header->relocation_count, sizeof(*input->relocations), relocation_cmp);
+
+    input->kept = calloc(header->section_count, sizeof(*input->kept));
+    input->address = calloc(header->section_count, sizeof(*input->address));
+    assert(input->kept != NULL && input->address != NULL);
+    return true;
+}
+
+static bool collect_globals(void)
+{
+    size_t capacity = 0;
+    for (size_t i = 0; i < input_count; ++i) {
+        for (size_t j = 0; j < inputs[i].header.symbol_count; ++j) {
+            const struct object_symbol *symbol = &inputs[i].symbols[j];
+            if ((symbol->flags & SYMBOL_LOCAL) != 0 || symbol->value == OBJECT_UNDEFINED) {
+                continue;
+            }
+            if (global_count == capacity) {
+                capacity = (capacity > 0) ? capacity * 2 : 256;
+                globals = realloc(globals, capacity * sizeof(*globals));
+                assert(globals != NULL);
+            }
+            globals[global_count++] = (struct global) {
+                .name = inputs[i].names + symbol->name,
+                .input = i,
+                .value = symbol->value,
+            };
+        }
+    }
+
+    qsort(globals, global_count, sizeof(*globals), global_cmp);
+    for (size_t i = 1; i < global_count; ++i) {
+        if (strcmp(globals[i - 1].name, globals[i].name) == 0) {
+            fprintf(stderr, "%s: %s already defined in %s\n", inputs[globals[i].input].path, globals[i].name,
+                    inputs[globals[i - 1].input].path);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Finds the definition of symbol SYMBOL of input INPUT.
+ * @return false if it is defined nowhere
+ */
+static bool resolve(size_t input, uint32_t symbol, size_t *target_input, uint32_t *value)
+{
+    const struct object_symbol *entry = &inputs[input].symbols[symbol];
+    if ((entry->flags & SYMBOL_LOCAL) != 0) {
+        *target_input = input;
+        *value = entry->value;
+        return true;
+    }
+
+    struct global key = { .name = inputs[input].names + entry->name };
+    const struct global *found = bsearch(&key, globals, global_count, sizeof(*globals), global_cmp);
+    if (found == NULL) {
+        fprintf(stderr, "%s: undefined reference to %s\n", inputs[input].path, key.name);
+        return false;
+    }
+
+    *target_input = found->input;
+    *value = found->value;
+    return true;
+}
+
+static void keep(size_t input, size_t section)
+{
+    if (inputs[input].kept[section]) {
+        return;
+    }
+
+    static size_t capacity;
+    if (pending_count == capacity) {
+        capacity = (capacity > 0) ? capacity * 2 : 256;
+        pending = realloc(pending, capacity * sizeof(*pending));
+        assert(pending != NULL);
+    }
+
+    inputs[input].kept[section] = true;
+    pending[pending_count].input = input;
+    pending[pending_count].section = section;
+    pending_count++;
+}
+
+/**
+ * Keeps every section reachable from the whole objects.
+ */
+static bool mark(void)
+{
+    for (size_t i = 0; i < input_count; ++i) {
+        for (size_t j = 0; !inputs[i].library && j < inputs[i].header.section_count; ++j) {
+            keep(i, j);
+        }
+    }
+
+    while (pending_count > 0) {
+        pending_count--;
+        size_t i = pending[pending_count].input;
+        size_t section = pending[pending_count].section;
+        const struct input *input = &inputs[i];
+
+        if ((input->sections[section].flags & SECTION_FALLS_THROUGH) != 0
+                && section + 1 < input->header.section_count) {
+            keep(i, section + 1);
+        }
+
+        uint32_t end = section_end(input, section);
+        size_t r = first_relocation(input, input->sections[section].start);
+        for (; r < input->header.relocation_count && input->relocations[r].offset < end; ++r) {
+            size_t target;
+            uint32_t value;
+            if (!resolve(i, input->relocations[r].symbol, &target, &value)) {
+                return false;
+            }
+            keep(target, section_of(&inputs[target], value));
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Places the kept sections, whole objects first, and patches every relocation.
+ */
+static uint32_t *layout(size_t *image_cells)
+{
+    uint64_t address = 0;
+    for (int library = 0; library <= 1; ++library) {
+        for (size_t i = 0; i < input_count; ++i) {
+            for (size_t j = 0; inputs[i].library == library && j < inputs[i].header.section_count; ++j) {
+                if (inputs[i].kept[j]) {
+                    inputs[i].address[j] = (uint32_t) address;
+                    address += section_end(&inputs[i], j) - inputs[i].sections[j].start;
+                }
+            }
+        }
+    }
+    if (address > INT32_MAX) {
+        fprintf(stderr, "image of %llu cells is too large\n", (unsigned long long) address);
+        return NULL;
+    }
+
+    uint32_t *image = malloc((address > 0 ? address : 1) * sizeof(*image));
+    assert(image != NULL);
+    for (size_t i = 0; i < input_count; ++i) {
+        const struct input *input = &inputs[i];
+        for (size_t j = 0; j < input->header.section_count; ++j) {
+            if (input->kept[j]) {
+                uint32_t start = input->sections[j].start;
+                memcpy(image + input->address[j], input->code + start,
+                        (section_end(input, j) - start) * sizeof(*image));
+            }
+        }
+
+        for (size_t r = 0; r < input->header.relocation_count; ++r) {
+            const struct object_relocation *relocation = &input->relocations[r];
+            size_t section = section_of(input, relocation->offset);
+            if (!input->kept[section]) {
+                continue;
+            }
+
+            size_t target;
+            uint32_t value;
+            if (!resolve(i, relocation->symbol, &target, &value)) {
+                free(image);
+                return NULL;
+            }
+            size_t target_section = section_of(&inputs[target], value);
+            image[input->address[section] + relocation->offset - input->sections[section].start] =
+                    inputs[target].address[target_section] + value - inputs[target].sections[target_section].start;
+        }
+    }
+
+    *image_cells = (size_t) address;
+    return image;
+}
+
+static void write_map(FILE *map)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < input_count; ++i) {
+        count += inputs[i].header.symbol_count;
+    }
+
+    struct map_line *lines = malloc((count > 0 ? count : 1) * sizeof(*lines));
+    assert(lines != NULL);
+    count = 0;
+    for (size_t i = 0; i < input_count; ++i) {
+        const struct input *input = &inputs[i];
+        for (size_t j = 0; j < input->header.symbol_count; ++j) {
+            const struct object_symbol *symbol = &input->symbols[j];
+            if (symbol->value == OBJECT_UNDEFINED) {
+                continue;
+            }
+            size_t section = section_of(input, symbol->value);
+            if (input->kept[section]) {
+                lines[count].index = input->address[section] + symbol->value - input->sections[section].start;
+                lines[count].name = input->names + symbol->name;
+                count++;
+            }
+        }
+    }
+
+    qsort(lines, count, sizeof(*lines), map_line_cmp);
+    for (size_t i = 0; i < count; ++i) {
+        fprintf(map, "%u %s\n", lines[i].index, lines[i].name);
+    }
+    free(lines);
+}
+
+static bool write_image(FILE *file, const uint32_t *image, size_t image_cells, bool compress)
+{
+    if (!compress) {
+        return fwrite(image, sizeof(*image), image_cells, file) == image_cells;
+    }
+
+    uint8_t *payload = malloc(COMPRESSED_BOUND(image_cells) + 1);
+    if (payload == NULL) {
+        return false;
+    }
+
+    struct compressed_header header = {
+        .magic = COMPRESSED_MAGIC,
+        .version = COMPRESSED_VERSION,
+        .cells = (uint32_t) image_cells,
+        .payload_bytes = (uint32_t) compressed_encode(image, image_cells, payload),
+    };
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(payload, 1, header.payload_bytes, file) == header.payload_bytes;
+    free(payload);
+    return written;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tlinker [-z] [-m MAP] -o IMAGE OBJECT... [-l LIBRARY]...\n");
+}
+
+static bool add_input(const char *path, bool library)
+{
+    if (input_count == MAX_INPUTS) {
+        fprintf(stderr, "more than %d inputs\n", MAX_INPUTS);
+        return false;
+    }
+
+    inputs[input_count].path = path;
+    inputs[input_count].library = library;
+    input_count++;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    const char *map_path = NULL;
+    bool compress = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:m:l:z")) != -1) {
+        switch (opt) {
+        case 'z':
+            compress = true;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'm':
+            map_path = optarg;
+            break;
+        case 'l':
+            if (!add_input(optarg, true)) {
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    // libraries were added while parsing, whole objects go in front of them
+    size_t libraries = input_count;
+    if (output == NULL || optind == argc || (size_t) (argc - optind) > MAX_INPUTS - libraries) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    size_t objects = (size_t) (argc - optind);
+    memmove(inputs + objects, inputs, libraries * sizeof(*inputs));
+    input_count = 0;
+    for (int i = optind; i < argc; ++i) {
+        add_input(argv[i], false);
+    }
+    input_count += libraries;
+
+    for (size_t i = 0; i < input_count; ++i) {
+        if (!load_input(&inputs[i])) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t image_cells;
+    uint32_t *image;
+    if (!collect_globals() || !mark() || (image = layout(&image_cells)) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(output, "wb");
+    if (file == NULL || !write_image(file, image, image_cells, compress) || fclose(file) != 0) {
+        fprintf(stderr, "cannot write %s\n", output);
+        return EXIT_FAILURE;
+    }
+
+    if (map_path != NULL) {
+        FILE *map = fopen(map_path, "w");
+        if (map == NULL) {
+            fprintf(stderr, "cannot write %s\n", map_path);
+            return EXIT_FAILURE;
+        }
+        write_map(map);
+        if (fclose(map) != 0) {
+            fprintf(stderr, "cannot write %s\n", map_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    free(image);
+    return EXIT_SUCCESS;
+}
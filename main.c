@@ -1,4 +1,7 @@
+#include "compressed.h"
 #include "cpu.h"
+#include "metrics.h"
+#include "profile.h"
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
@@ -6,6 +9,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 const char *status_name(enum cpu_status status)
 {
@@ -26,6 +31,8 @@ const char *status_name(enum cpu_status status)
         return "CPU_DIV_BY_ZERO";
     case CPU_IO_ERROR:
         return "CPU_IO_ERROR";
+    case CPU_INFINITE_LOOP:
+        return "CPU_INFINITE_LOOP";
     default:
         fprintf(stderr, "BUG: Unknown status (%d)\n", status);
         abort();
@@ -35,16 +42,170 @@ const char *status_name(enum cpu_status status)
 
 static void state(struct cpu *cpu)
 {
-    printf("A: %d, B: %d, C: %d, D: %d\n", cpu_get_register(cpu, REGISTER_A),
-        cpu_get_register(cpu, REGISTER_B), cpu_get_register(cpu, REGISTER_C),
-        cpu_get_register(cpu, REGISTER_D));
+    struct cpu_state current;
+    cpu_get_state(cpu, &current);
 
-    printf("Stack size: %d\n", cpu_get_stack_size(cpu));
+    printf("A: %d, B: %d, C: %d, D: %d\n", current.registers[REGISTER_A],
+        current.registers[REGISTER_B], current.registers[REGISTER_C],
+        current.registers[REGISTER_D]);
+
+    printf("Stack size: %d\n", current.stack_size);
+}
+
+static bool env_enabled(const char *name)
+{
+    const char *value = getenv(name);
+    return value != NULL && *value != '\0' && strcmp(value, "0") != 0;
+}
+
+#define METRICS_BLOCK (1 << 20)
+
+// cpu_run in blocks, publishing the counters after each of them
+static long long run_published(struct cpu *cpu, size_t steps)
+{
+    char name[64];
+    snprintf(name, sizeof(name), METRICS_PREFIX "%d", (int) getpid());
+    struct metrics *metrics = metrics_create(name, 1);
+    if (metrics == NULL) {
+        perror(name);
+        return cpu_run(cpu, steps);
+    }
+
+    long long performed = 0;
+    uint64_t busy_ns = 0;
+    while (performed < (long long) steps) {
+        size_t block = steps - performed < METRICS_BLOCK ? steps - performed : METRICS_BLOCK;
+        uint64_t start = metrics_now_ns();
+        long long result = cpu_run(cpu, block);
+        busy_ns += metrics_now_ns() - start;
+        metrics_publish(metrics, 0, cpu, busy_ns);
+
+        if (result < 0) {
+            performed = -(performed - result);
+            break;
+        }
+        performed += result;
+        if (cpu_get_status(cpu) != CPU_OK) {
+            break;
+        }
+    }
+
+    metrics_destroy(metrics);
+    return performed;
+}
+
+// Runs with per-instruction counts and reports the cost per label. Labels
+// come from FILE.map (`compiler -m`), costs from the table named by CPU_COSTS
+// (`opbench -C`); without them the whole program is one region of unit cost.
+static int profile(struct cpu *cpu, const char *path, const int32_t *code, size_t code_cells)
+{
+    struct cost_table costs;
+    profile_default_costs(&costs);
+    const char *costs_path = getenv("CPU_COSTS");
+    if (costs_path != NULL) {
+        FILE *file = fopen(costs_path, "r");
+        if (file == NULL) {
+            perror(costs_path);
+            return EXIT_FAILURE;
+        }
+        int line = profile_load_costs(file, &costs);
+        fclose(file);
+        if (line != 0) {
+            fprintf(stderr, "%s:%d: invalid cost\n", costs_path, line);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct label_map map = { NULL, 0 };
+    char *map_path = malloc(strlen(path) + 5);
+    assert(map_path != NULL);
+    sprintf(map_path, "%s.map", path);
+    FILE *file = fopen(map_path, "r");
+    if (file != NULL) {
+        int line = profile_load_map(file, &map);
+        fclose(file);
+        if (line != 0) {
+            fprintf(stderr, "%s:%d: invalid label\n", map_path, line);
+            free(map_path);
+            return EXIT_FAILURE;
+        }
+    }
+    free(map_path);
+
+    uint64_t *counts = calloc(code_cells + 1, sizeof(*counts));
+    assert(counts != NULL);
+    cpu_set_profile(cpu, counts, code_cells);
+
+    int run_result = cpu_run(cpu, INT_MAX);
+    cpu_set_profile(cpu, NULL, 0);
+    state(cpu);
+    printf("\'cpu_run\' result: %d\n", run_result);
+    profile_report(stdout, code, counts, code_cells, &costs, &map);
+
+    free(counts);
+    profile_free_map(&map);
+    return EXIT_SUCCESS;
+}
+
+// FILE.dec (`compiler -d`) saves decoding every instruction, if it was built
+// from this image
+static void load_decoded(struct cpu *cpu, const char *path)
+{
+    char *decoded_path = malloc(strlen(path) + 5);
+    assert(decoded_path != NULL);
+    sprintf(decoded_path, "%s.dec", path);
+
+    FILE *file = fopen(decoded_path, "rb");
+    if (file != NULL) {
+        if (cpu_load_decoded(cpu, file) != 0) {
+            fprintf(stderr, "%s does not belong to %s, ignored\n", decoded_path, path);
+        }
+        fclose(file);
+    }
+    free(decoded_path);
+}
+
+// CPU_DATA=PATH maps PATH as the guest's data region, copy-on-write with
+// CPU_DATA_WRITABLE=1
+static bool map_data(struct cpu *cpu)
+{
+    const char *path = getenv("CPU_DATA");
+    if (path == NULL) {
+        return true;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    // the mapping outlives the stream
+    bool mapped = cpu_map_data(cpu, file, env_enabled("CPU_DATA_WRITABLE")) == 0;
+    if (!mapped) {
+        fprintf(stderr, "%s: cannot map as data\n", path);
+    }
+    fclose(file);
+    return mapped;
+}
+
+// Images from `compiler -z` start with COMPRESSED_MAGIC; only files that can
+// be rewound are checked.
+static bool is_compressed(FILE *file)
+{
+    uint32_t magic;
+    if (fseek(file, 0, SEEK_SET) != 0) {
+        return false;
+    }
+
+    bool compressed = fread(&magic, sizeof(magic), 1, file) == 1 && magic == COMPRESSED_MAGIC;
+    rewind(file);
+    return compressed;
 }
 
 static void usage(void)
 {
-    printf("Invalid arguments, run ./cpu (run|trace) [stack_capacity] FILE\n");
+    printf("Invalid arguments, run ./cpu (run|trace|profile) [stack_capacity] FILE\n");
 }
 
 int main(int argc, char *argv[])
@@ -73,26 +234,75 @@ int main(int argc, char *argv[])
         perror(argv[argc - 1]);
         return EXIT_FAILURE;
     }
+    // CPU_STREAM=1 starts running while the rest of the image is still read;
+    // profiling needs all of it up front
+    struct stat info;
+    bool compressed = is_compressed(fptr);
+    bool stream = env_enabled("CPU_STREAM") && !compressed && strcmp(argv[1], "profile") != 0
+            && fstat(fileno(fptr), &info) == 0 && S_ISREG(info.st_mode);
+
     int32_t *stack_ptr;
-    int32_t *memory = cpu_create_memory(fptr, stack_capacity, &stack_ptr);
-    if (memory == NULL) {
+    int32_t *memory = NULL;
+    struct cpu *cp;
+    if (stream) {
+        cp = cpu_create_streaming(fptr, (size_t) info.st_size, stack_capacity, &stack_ptr);
+        if (cp == NULL) {
+            fprintf(stderr, "Memory failure");
+            fclose(fptr);
+            return EXIT_FAILURE;
+        }
+    } else {
+        memory = compressed ? cpu_create_memory_compressed(fptr, stack_capacity, &stack_ptr)
+                            : cpu_create_memory(fptr, stack_capacity, &stack_ptr);
+        if (memory == NULL) {
+            fprintf(stderr, "Memory failure");
+            fclose(fptr);
+            return EXIT_FAILURE;
+        }
+
+        cp = cpu_create(memory, stack_ptr, stack_capacity);
+        if (cp == NULL) {
+            fprintf(stderr, "Memory failure");
+            free(memory);
+            fclose(fptr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // CPU_DETECT_LOOPS=1 stops guests that provably never finish
+    if (env_enabled("CPU_DETECT_LOOPS") && cpu_set_loop_detection(cp, true) != 0) {
         fprintf(stderr, "Memory failure");
+        cpu_destroy(cp);
+        free(cp);
         fclose(fptr);
         return EXIT_FAILURE;
     }
 
-    struct cpu *cp = cpu_create(memory, stack_ptr, stack_capacity);
-    if (cp == NULL) {
-        fprintf(stderr, "Memory failure");
-        free(memory);
+    // checking FILE.dec against the image would wait for all of it
+    if (!stream) {
+        load_decoded(cp, argv[argc - 1]);
+    }
+
+    if (!map_data(cp)) {
+        cpu_destroy(cp);
+        free(cp);
         fclose(fptr);
         return EXIT_FAILURE;
     }
 
     if (strcmp(argv[1], "run") == 0) {
-        int run_result = cpu_run(cp, INT_MAX);
+        // CPU_METRICS=1 makes the run visible to tools/cpustat while it lasts
+        int run_result = env_enabled("CPU_METRICS") ? run_published(cp, INT_MAX) : cpu_run(cp, INT_MAX);
         state(cp);
         printf("\'cpu_run\' result: %d\n", run_result);
+    } else if (strcmp(argv[1], "profile") == 0) {
+        size_t code_cells = stack_ptr - memory + 1 - stack_capacity;
+        if (profile(cp, argv[argc - 1], memory, code_cells) != EXIT_SUCCESS) {
+            cpu_destroy(cp);
+            free(cp);
+            fclose(fptr);
+            return EXIT_FAILURE;
+        }
     } else if (strcmp(argv[1], "trace") == 0) {
         printf("Press Enter to execute the next instruction or type 'q' to quit.\n");
         while (true) {
@@ -112,8 +322,9 @@ int main(int argc, char *argv[])
         usage();
     }
 
-    fclose(fptr);
+    // the loader of a streamed image may still be reading
     cpu_destroy(cp);
     free(cp);
+    fclose(fptr);
     return EXIT_SUCCESS;
 }
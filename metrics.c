@@ -0,0 +1,239 @@
+#include "metrics.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Layout of the segment, version METRICS_VERSION. Readers check magic,
+// version and slot_size before they look at any slot.
+struct metrics_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slot_count;
+    int32_t pid;
+    uint32_t reserved;
+    uint64_t started_ns;
+};
+
+// A slot is written by one worker only. The sequence is odd while a write is
+// in progress and stays zero until the first publish.
+struct metrics_slot
+{
+    alignas(64) atomic_uint sequence;
+    atomic_int instruction_index;
+    atomic_int stack_size;
+    atomic_int status;
+    atomic_ullong steps;
+    atomic_ullong bytes_in;
+    atomic_ullong bytes_out;
+    atomic_ullong busy_ns;
+    atomic_ullong updated_ns;
+};
+
+struct metrics
+{
+    char *name;
+    bool owner;
+    size_t length;
+    struct metrics_header *header;
+    struct metrics_slot *slots;
+};
+
+#define SLOTS_OFFSET sizeof(struct metrics_slot)
+
+_Static_assert(sizeof(struct metrics_header) <= SLOTS_OFFSET, "header must fit in front of the first slot");
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static struct metrics *metrics_map(const char *name, int fd, size_t length, bool owner)
+{
+    struct metrics *metrics = malloc(sizeof(struct metrics));
+    char *name_copy = malloc(strlen(name) + 1);
+    void *base = mmap(NULL, length, owner ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (metrics == NULL || name_copy == NULL || base == MAP_FAILED) {
+        free(metrics);
+        free(name_copy);
+        if (base != MAP_FAILED) {
+            munmap(base, length);
+        }
+        return NULL;
+    }
+
+    strcpy(name_copy, name);
+    metrics->name = name_copy;
+    metrics->owner = owner;
+    metrics->length = length;
+    metrics->header = base;
+    metrics->slots = (struct metrics_slot *) ((char *) base + SLOTS_OFFSET);
+    return metrics;
+}
+
+struct metrics *metrics_create(const char *name, size_t slots)
+{
+    assert(name != NULL);
+    assert(slots > 0);
+
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    size_t length = SLOTS_OFFSET + slots * sizeof(struct metrics_slot);
+    if (ftruncate(fd, length) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    struct metrics *metrics = metrics_map(name, fd, length, true);
+    if (metrics == NULL) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // the file is zero-filled, so every slot starts unpublished
+    metrics->header->version = METRICS_VERSION;
+    metrics->header->slot_size = sizeof(struct metrics_slot);
+    metrics->header->slot_count = slots;
+    metrics->header->pid = getpid();
+    metrics->header->started_ns = metrics_now_ns();
+    atomic_thread_fence(memory_order_release);
+    metrics->header->magic = METRICS_MAGIC;
+    return metrics;
+}
+
+struct metrics *metrics_attach(const char *name)
+{
+    assert(name != NULL);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    off_t length = lseek(fd, 0, SEEK_END);
+    if (length < (off_t) SLOTS_OFFSET) {
+        close(fd);
+        return NULL;
+    }
+
+    struct metrics *metrics = metrics_map(name, fd, length, false);
+    if (metrics == NULL) {
+        return NULL;
+    }
+
+    const struct metrics_header *header = metrics->header;
+    if (header->magic != METRICS_MAGIC || header->version != METRICS_VERSION
+            || header->slot_size != sizeof(struct metrics_slot)
+            || SLOTS_OFFSET + (size_t) header->slot_count * header->slot_size > (size_t) length) {
+        metrics_destroy(metrics);
+        return NULL;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    return metrics;
+}
+
+void metrics_publish(struct metrics *metrics, size_t slot, struct cpu *cpu, uint64_t busy_ns)
+{
+    assert(metrics != NULL && metrics->owner);
+    assert(slot < metrics->header->slot_count);
+    assert(cpu != NULL);
+
+    struct cpu_stats stats;
+    cpu_get_stats(cpu, &stats);
+
+    struct metrics_slot *s = &metrics->slots[slot];
+    unsigned sequence = atomic_load_explicit(&s->sequence, memory_order_relaxed);
+    atomic_store_explicit(&s->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&s->instruction_index, cpu_get_instruction_index(cpu), memory_order_relaxed);
+    atomic_store_explicit(&s->stack_size, cpu_get_stack_size(cpu), memory_order_relaxed);
+    atomic_store_explicit(&s->status, cpu_get_status(cpu), memory_order_relaxed);
+    atomic_store_explicit(&s->steps, stats.retired, memory_order_relaxed);
+    atomic_store_explicit(&s->bytes_in, stats.bytes_in, memory_order_relaxed);
+    atomic_store_explicit(&s->bytes_out, stats.bytes_out, memory_order_relaxed);
+    atomic_store_explicit(&s->busy_ns, busy_ns, memory_order_relaxed);
+    atomic_store_explicit(&s->updated_ns, metrics_now_ns(), memory_order_relaxed);
+
+    atomic_store_explicit(&s->sequence, sequence + 2, memory_order_release);
+}
+
+bool metrics_read(const struct metrics *metrics, size_t slot, struct metrics_sample *sample)
+{
+    assert(metrics != NULL);
+    assert(sample != NULL);
+
+    if (slot >= metrics->header->slot_count) {
+        return false;
+    }
+
+    // readers cannot write the mapping, the casts only drop const for the atomic loads
+    struct metrics_slot *s = (struct metrics_slot *) &metrics->slots[slot];
+    unsigned before;
+    unsigned after;
+    do {
+        before = atomic_load_explicit(&s->sequence, memory_order_acquire);
+        sample->instruction_index = atomic_load_explicit(&s->instruction_index, memory_order_relaxed);
+        sample->stack_size = atomic_load_explicit(&s->stack_size, memory_order_relaxed);
+        sample->status = atomic_load_explicit(&s->status, memory_order_relaxed);
+        sample->steps = atomic_load_explicit(&s->steps, memory_order_relaxed);
+        sample->bytes_in = atomic_load_explicit(&s->bytes_in, memory_order_relaxed);
+        sample->bytes_out = atomic_load_explicit(&s->bytes_out, memory_order_relaxed);
+        sample->busy_ns = atomic_load_explicit(&s->busy_ns, memory_order_relaxed);
+        sample->updated_ns = atomic_load_explicit(&s->updated_ns, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&s->sequence, memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+
+    return before != 0;
+}
+
+size_t metrics_slots(const struct metrics *metrics)
+{
+    assert(metrics != NULL);
+
+    return metrics->header->slot_count;
+}
+
+pid_t metrics_pid(const struct metrics *metrics)
+{
+    assert(metrics != NULL);
+
+    return metrics->header->pid;
+}
+
+uint64_t metrics_started_ns(const struct metrics *metrics)
+{
+    assert(metrics != NULL);
+
+    return metrics->header->started_ns;
+}
+
+void metrics_destroy(struct metrics *metrics)
+{
+    assert(metrics != NULL);
+
+    munmap(metrics->header, metrics->length);
+    if (metrics->owner) {
+        shm_unlink(metrics->name);
+    }
+    free(metrics->name);
+    free(metrics);
+}
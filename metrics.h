@@ -0,0 +1,54 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define METRICS_MAGIC 0x43505553u // "CPUS"
+#define METRICS_VERSION 1
+#define METRICS_PREFIX "/cpu-emulator."
+
+struct metrics;
+
+// One instance as seen by a reader, copied out of its seqlock-protected slot.
+struct metrics_sample
+{
+    uint64_t steps;
+    int32_t instruction_index;
+    int32_t stack_size;
+    enum cpu_status status;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t busy_ns;
+    uint64_t updated_ns;
+};
+
+// Creates the segment NAME (e.g. METRICS_PREFIX "1234") with SLOTS slots,
+// one per instance.
+struct metrics *metrics_create(const char *name, size_t slots);
+
+// Maps an existing segment read-only, NULL if it is missing or of another version.
+struct metrics *metrics_attach(const char *name);
+
+// Publishes the counters of CPU into SLOT; BUSY_NS is the time the worker has
+// spent inside cpu_run for this instance so far. Costs a few relaxed stores.
+void metrics_publish(struct metrics *metrics, size_t slot, struct cpu *cpu, uint64_t busy_ns);
+
+// Copies a consistent snapshot of SLOT, false if it was never published.
+bool metrics_read(const struct metrics *metrics, size_t slot, struct metrics_sample *sample);
+
+size_t metrics_slots(const struct metrics *metrics);
+
+pid_t metrics_pid(const struct metrics *metrics);
+
+uint64_t metrics_started_ns(const struct metrics *metrics);
+
+uint64_t metrics_now_ns(void);
+
+// Unmaps the segment, and removes it if it was created by metrics_create().
+void metrics_destroy(struct metrics *metrics);
+
+#endif // METRICS_H
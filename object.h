@@ -0,0 +1,63 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+// Relocatable guest objects, written by `compiler -r` and combined into an
+// image by the linker. An object is a sequence of native 32-bit words, like
+// an image:
+//
+//   struct object_header
+//   code[code_cells]
+//   struct object_section[section_count]
+//   struct object_symbol[symbol_count]
+//   struct object_relocation[relocation_count]
+//   names[names_bytes]          NUL-terminated, padded to a whole word
+//
+// Every global label starts a section, the unit the linker keeps or drops;
+// labels starting with '.' are local to their object. A relocation marks a
+// code cell holding the index of a label. Numeric `loop` targets are absolute
+// and not relocated.
+
+#include <stdint.h>
+
+#define OBJECT_MAGIC 0x4f555043u // "CPUO"
+#define OBJECT_VERSION 1
+#define OBJECT_UNDEFINED UINT32_MAX
+
+// Execution can run off the end of the section into the next one.
+#define SECTION_FALLS_THROUGH 0x1u
+
+#define SYMBOL_LOCAL 0x1u
+
+struct object_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t code_cells;
+    uint32_t section_count;
+    uint32_t symbol_count;
+    uint32_t relocation_count;
+    uint32_t names_bytes;
+};
+
+// Sections are sorted by START; the first one starts at 0 and each one ends
+// where the next one starts.
+struct object_section
+{
+    uint32_t start;
+    uint32_t flags;
+};
+
+struct object_symbol
+{
+    uint32_t name;  // offset into names
+    uint32_t value; // code index, OBJECT_UNDEFINED for an external symbol
+    uint32_t flags;
+};
+
+struct object_relocation
+{
+    uint32_t offset; // code index of the cell to patch
+    uint32_t symbol;
+};
+
+#endif // OBJECT_H
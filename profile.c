@@ -0,0 +1,237 @@
+#include "profile.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct region
+{
+    const char *name;
+    int32_t first;
+    uint64_t executed;
+    double cost;
+};
+
+void profile_default_costs(struct cost_table *table)
+{
+    assert(table != NULL);
+
+    for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+        table->costs[i] = 1.0;
+    }
+}
+
+const char *profile_mnemonic(int32_t opcode)
+{
+    return (opcode >= 0 && opcode < OPCODE_COUNT) ? opcode_mnemonics[opcode] : NULL;
+}
+
+static char *strip(char *line)
+{
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+
+    while (isspace((unsigned char) *line)) {
+        line++;
+    }
+    return line;
+}
+
+int profile_load_costs(FILE *file, struct cost_table *table)
+{
+    assert(file != NULL);
+    assert(table != NULL);
+
+    char buffer[256];
+    for (int lineno = 1; fgets(buffer, sizeof(buffer), file) != NULL; ++lineno) {
+        char *line = strip(buffer);
+        if (*line == '\0') {
+            continue;
+        }
+
+        char name[16];
+        double cost;
+        char extra;
+        if (sscanf(line, "%15s %lf %c", name, &cost, &extra) != 2 || cost < 0) {
+            return lineno;
+        }
+
+        size_t opcode = 0;
+        while (opcode < OPCODE_COUNT
+                && (opcode_mnemonics[opcode] == NULL || strcmp(opcode_mnemonics[opcode], name) != 0)) {
+            opcode++;
+        }
+        if (opcode == OPCODE_COUNT) {
+            return lineno;
+        }
+
+        table->costs[opcode] = cost;
+    }
+
+    return 0;
+}
+
+int profile_write_costs(FILE *file, const struct cost_table *table, const char *comment)
+{
+    assert(file != NULL);
+    assert(table != NULL);
+
+    if (comment != NULL) {
+        fprintf(file, "# %s\n", comment);
+    }
+    for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+        if (opcode_mnemonics[i] == NULL) {
+            continue;
+        }
+        if (isnan(table->costs[i])) {
+            fprintf(file, "# %-4s not measured\n", opcode_mnemonics[i]);
+        } else {
+            fprintf(file, "%-6s %.4f\n", opcode_mnemonics[i], table->costs[i]);
+        }
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+int profile_load_map(FILE *file, struct label_map *map)
+{
+    assert(file != NULL);
+    assert(map != NULL);
+
+    map->entries = NULL;
+    map->count = 0;
+
+    size_t capacity = 0;
+    char buffer[512];
+    for (int lineno = 1; fgets(buffer, sizeof(buffer), file) != NULL; ++lineno) {
+        char *line = strip(buffer);
+        if (*line == '\0') {
+            continue;
+        }
+
+        long index;
+        char name[sizeof(buffer)];
+        if (sscanf(line, "%ld %511s", &index, name) != 2 || index < 0 || index > INT32_MAX) {
+            profile_free_map(map);
+            return lineno;
+        }
+
+        if (map->count == capacity) {
+            capacity = (capacity > 0) ? capacity * 2 : 64;
+            struct label_entry *entries = realloc(map->entries, capacity * sizeof(*entries));
+            assert(entries != NULL);
+            map->entries = entries;
+        }
+
+        map->entries[map->count].index = (int32_t) index;
+        map->entries[map->count].name = strdup(name);
+        assert(map->entries[map->count].name != NULL);
+        map->count++;
+    }
+
+    return 0;
+}
+
+void profile_free_map(struct label_map *map)
+{
+    assert(map != NULL);
+
+    for (size_t i = 0; i < map->count; ++i) {
+        free(map->entries[i].name);
+    }
+    free(map->entries);
+    map->entries = NULL;
+    map->count = 0;
+}
+
+static int region_cmp(const void *a, const void *b)
+{
+    const struct region *ra = a;
+    const struct region *rb = b;
+
+    if (ra->cost != rb->cost) {
+        return (ra->cost > rb->cost) ? -1 : 1;
+    }
+    return (ra->first > rb->first) - (ra->first < rb->first);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct label_entry *ea = a;
+    const struct label_entry *eb = b;
+
+    return (ea->index > eb->index) - (ea->index < eb->index);
+}
+
+void profile_report(FILE *out, const int32_t *code, const uint64_t *counts, size_t cells,
+        const struct cost_table *table, const struct label_map *map)
+{
+    assert(out != NULL);
+    assert(code != NULL);
+    assert(counts != NULL);
+    assert(table != NULL);
+    assert(map != NULL);
+
+    qsort(map->entries, map->count, sizeof(*map->entries), entry_cmp);
+
+    // one region per distinct label index, plus the code in front of the first label
+    struct region *regions = calloc(map->count + 1, sizeof(*regions));
+    assert(regions != NULL);
+    size_t region_count = 1;
+    bool start_labelled = false;
+    regions[0].name = "(start)";
+    regions[0].first = 0;
+    for (size_t i = 0; i < map->count; ++i) {
+        if (map->entries[i].index == regions[region_count - 1].first) {
+            // the first label at an index names the region, the others are aliases
+            if (region_count == 1 && !start_labelled) {
+                regions[0].name = map->entries[i].name;
+                start_labelled = true;
+            }
+            continue;
+        }
+        regions[region_count].name = map->entries[i].name;
+        regions[region_count].first = map->entries[i].index;
+        region_count++;
+    }
+
+    uint64_t total_executed = 0;
+    double total_cost = 0;
+    size_t region = 0;
+    for (size_t index = 0; index < cells; ++index) {
+        while (region + 1 < region_count && (size_t) regions[region + 1].first <= index) {
+            region++;
+        }
+        if (counts[index] == 0) {
+            continue;
+        }
+
+        // only instruction starts are counted, so code[index] is an opcode here
+        double cost = (code[index] >= 0 && code[index] < OPCODE_COUNT) ? table->costs[code[index]] : 0.0;
+        regions[region].executed += counts[index];
+        regions[region].cost += cost * (double) counts[index];
+        total_executed += counts[index];
+        total_cost += cost * (double) counts[index];
+    }
+
+    qsort(regions, region_count, sizeof(*regions), region_cmp);
+
+    fprintf(out, "%-24s %8s %14s %7s %16s %7s\n", "label", "index", "executed", "steps%", "cost", "cost%");
+    for (size_t i = 0; i < region_count; ++i) {
+        if (regions[i].executed == 0) {
+            continue;
+        }
+        fprintf(out, "%-24s %8d %14llu %6.2f%% %16.1f %6.2f%%\n", regions[i].name, regions[i].first,
+                (unsigned long long) regions[i].executed,
+                100.0 * (double) regions[i].executed / (double) total_executed, regions[i].cost,
+                total_cost > 0 ? 100.0 * regions[i].cost / total_cost : 0.0);
+    }
+    fprintf(out, "%-24s %8s %14llu %6.2f%% %16.1f %6.2f%%\n", "total", "",
+            (unsigned long long) total_executed, 100.0, total_cost, 100.0);
+
+    free(regions);
+}
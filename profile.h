@@ -0,0 +1,53 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "isa.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Cost of one execution of every opcode, in whatever unit the table was
+// calibrated in (opbench writes nanoseconds).
+struct cost_table
+{
+    double costs[OPCODE_COUNT];
+};
+
+struct label_entry
+{
+    int32_t index;
+    char *name;
+};
+
+struct label_map
+{
+    struct label_entry *entries;
+    size_t count;
+};
+
+// Every opcode costs 1, so costs equal step counts.
+void profile_default_costs(struct cost_table *table);
+
+// NULL for codes the CPU does not implement.
+const char *profile_mnemonic(int32_t opcode);
+
+// Reads "MNEMONIC COST" lines, '#' starts a comment. Opcodes not listed keep
+// their cost. Returns 0, or the number of the first malformed line.
+int profile_load_costs(FILE *file, struct cost_table *table);
+
+// Writes the table as profile_load_costs() reads it. Opcodes that cost NaN
+// are only named in a comment, so loading the table keeps their cost.
+int profile_write_costs(FILE *file, const struct cost_table *table, const char *comment);
+
+// Reads the "INDEX LABEL" lines written by `compiler -m`.
+// Returns 0, or the number of the first malformed line.
+int profile_load_map(FILE *file, struct label_map *map);
+
+void profile_free_map(struct label_map *map);
+
+// Prints executed instructions and weighted cost per label, most expensive
+// first. COUNTS holds the executions of each of the CELLS instruction indices.
+void profile_report(FILE *out, const int32_t *code, const uint64_t *counts, size_t cells,
+        const struct cost_table *table, const struct label_map *map);
+
+#endif // PROFILE_H
@@ -0,0 +1,295 @@
+// Synthetic assembly source generator.
+//
+// Build: gcc -O2 -o asmgen tools/asmgen.c
+//
+// ./asmgen [-b BYTES] [-s SEED] [-l LABEL_DENSITY] [-f FORWARD_RATIO] [-m MIX] > program.asm
+//
+// LABEL_DENSITY is the number of label definitions per instruction,
+// FORWARD_RATIO the share of `loop` operands that refer to a label defined
+// further down, and MIX a list of relative instruction weights such as
+// "add=4,loop=1,out=0".
+
+#include "asmgen.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct mnemonic
+{
+    const char *name;
+    const char *operands;
+};
+
+// operand kinds: 'r' register, 'n' number, 'l' label
+static const struct mnemonic mnemonics[ASMGEN_MNEMONICS] = {
+    { "nop", "" }, { "halt", "" }, { "add", "r" }, { "sub", "r" }, { "mul", "r" },
+    { "div", "r" }, { "inc", "r" }, { "dec", "r" }, { "loop", "l" }, { "movr", "rn" },
+    { "load", "rn" }, { "store", "rn" }, { "in", "r" }, { "get", "r" }, { "out", "r" },
+    { "put", "r" }, { "swap", "rr" }, { "push", "r" }, { "pop", "r" },
+};
+
+// how far ahead a forward reference may point, in labels
+#define FORWARD_WINDOW 8
+
+struct generator
+{
+    FILE *out;
+    uint64_t state;
+    size_t defined;
+    size_t pending;
+    struct asmgen_stats *stats;
+    bool failed;
+};
+
+static uint64_t next_random(struct generator *gen)
+{
+    gen->state ^= gen->state >> 12;
+    gen->state ^= gen->state << 25;
+    gen->state ^= gen->state >> 27;
+    return gen->state * 0x2545f4914f6cdd1dULL;
+}
+
+static double next_unit(struct generator *gen)
+{
+    return (double) (next_random(gen) >> 11) / (double) (1ULL << 53);
+}
+
+static void emit(struct generator *gen, const char *format, const char *text)
+{
+    int written = fprintf(gen->out, format, text);
+    if (written < 0) {
+        gen->failed = true;
+        return;
+    }
+    gen->stats->bytes += (size_t) written;
+}
+
+static void emit_number(struct generator *gen, const char *format, long long value)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), format, value);
+    emit(gen, " %s", buffer);
+}
+
+static void emit_label_reference(struct generator *gen, const struct asmgen_options *options)
+{
+    size_t label;
+    if (gen->defined == 0 || next_unit(gen) < options->forward_ratio) {
+        label = gen->defined + next_random(gen) % FORWARD_WINDOW;
+        if (label + 1 > gen->pending) {
+            gen->pending = label + 1;
+        }
+    } else {
+        label = next_random(gen) % gen->defined;
+    }
+
+    emit_number(gen, "L%lld", (long long) label);
+    gen->stats->references++;
+}
+
+static void define_label(struct generator *gen)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "L%zu:", gen->defined++);
+    emit(gen, "%s\n", name);
+    gen->stats->labels++;
+    gen->stats->lines++;
+}
+
+static size_t pick_mnemonic(struct generator *gen, const struct asmgen_options *options)
+{
+    unsigned total = 0;
+    for (size_t i = 0; i < ASMGEN_MNEMONICS; ++i) {
+        total += options->weights[i];
+    }
+
+    unsigned pick = (unsigned) (next_random(gen) % total);
+    for (size_t i = 0; i < ASMGEN_MNEMONICS; ++i) {
+        if (pick < options->weights[i]) {
+            return i;
+        }
+        pick -= options->weights[i];
+    }
+
+    return 0;
+}
+
+static void emit_instruction(struct generator *gen, const struct asmgen_options *options)
+{
+    static const char *const registers[] = { "a", "b", "c", "d", "A", "B", "C", "D" };
+    const struct mnemonic *mnemonic = &mnemonics[pick_mnemonic(gen, options)];
+
+    emit(gen, (next_random(gen) % 4 == 0) ? "\t%s" : "    %s", mnemonic->name);
+    for (const char *kind = mnemonic->operands; *kind != '\0'; ++kind) {
+        switch (*kind) {
+        case 'r':
+            emit(gen, " %s", registers[next_random(gen) % 8]);
+            break;
+        case 'n':
+            if (next_random(gen) % 8 == 0) {
+                emit_number(gen, "0x%llx", (long long) (next_random(gen) % 256));
+            } else {
+                emit_number(gen, "%lld", (long long) (next_random(gen) % 200) - 50);
+            }
+            break;
+        default:
+            emit_label_reference(gen, options);
+            break;
+        }
+    }
+
+    emit(gen, "%s\n", (next_random(gen) % 16 == 0) ? " ; trailing comment" : "");
+    gen->stats->instructions++;
+    gen->stats->lines++;
+}
+
+void asmgen_default_options(struct asmgen_options *options)
+{
+    assert(options != NULL);
+
+    options->seed = 1;
+    options->bytes = 64 * 1024;
+    options->label_density = 1.0 / 16;
+    options->forward_ratio = 0.5;
+    for (size_t i = 0; i < ASMGEN_MNEMONICS; ++i) {
+        options->weights[i] = 4;
+    }
+    options->weights[1] = 0;
+}
+
+int asmgen_parse_mix(struct asmgen_options *options, const char *mix)
+{
+    assert(options != NULL);
+    assert(mix != NULL);
+
+    while (*mix != '\0') {
+        size_t length = strcspn(mix, "=");
+        if (mix[length] != '=') {
+            return -1;
+        }
+
+        size_t index = ASMGEN_MNEMONICS;
+        for (size_t i = 0; i < ASMGEN_MNEMONICS; ++i) {
+            if (strlen(mnemonics[i].name) == length && strncmp(mnemonics[i].name, mix, length) == 0) {
+                index = i;
+            }
+        }
+        if (index == ASMGEN_MNEMONICS) {
+            return -1;
+        }
+
+        char *end;
+        unsigned long weight = strtoul(mix + length + 1, &end, 10);
+        if (end == mix + length + 1 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        options->weights[index] = (unsigned) weight;
+        mix = (*end == ',') ? end + 1 : end;
+    }
+
+    unsigned total = 0;
+    for (size_t i = 0; i < ASMGEN_MNEMONICS; ++i) {
+        total += options->weights[i];
+    }
+    return total > 0 ? 0 : -1;
+}
+
+int asmgen_write(FILE *out, const struct asmgen_options *options, struct asmgen_stats *stats)
+{
+    assert(out != NULL);
+    assert(options != NULL);
+    assert(stats != NULL);
+
+    memset(stats, 0, sizeof(*stats));
+    struct generator gen = {
+        .out = out,
+        .state = options->seed * 0x9e3779b97f4a7c15ULL + 1,
+        .stats = stats,
+    };
+
+    char header[64];
+    snprintf(header, sizeof(header), "; generated by asmgen, seed %llu", (unsigned long long) options->seed);
+    emit(&gen, "%s\n", header);
+    stats->lines++;
+
+    while (stats->bytes < options->bytes && !gen.failed) {
+        if (next_unit(&gen) < options->label_density) {
+            define_label(&gen);
+        }
+        if (next_random(&gen) % 64 == 0) {
+            emit(&gen, "%s\n", (next_random(&gen) % 2 == 0) ? "; comment line" : "");
+            stats->lines++;
+        }
+        emit_instruction(&gen, options);
+    }
+
+    // labels referenced ahead of the end still need a definition and an instruction
+    while (gen.defined < gen.pending) {
+        define_label(&gen);
+    }
+    emit(&gen, "%s\n", "    halt");
+    stats->instructions++;
+    stats->lines++;
+
+    return gen.failed ? -1 : 0;
+}
+
+#ifndef NO_ASMGEN_MAIN
+static void usage(const char *program)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "%s [-b BYTES] [-s SEED] [-l LABEL_DENSITY] [-f FORWARD_RATIO] [-m MIX]\n", program);
+    fprintf(stderr, "\twrites valid assembly of at least BYTES bytes to stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct asmgen_options options;
+    asmgen_default_options(&options);
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc || argv[i][0] != '-' || argv[i][2] != '\0') {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        const char *value = argv[i + 1];
+        switch (argv[i][1]) {
+        case 'b':
+            options.bytes = strtoull(value, NULL, 10);
+            break;
+        case 's':
+            options.seed = strtoull(value, NULL, 10);
+            break;
+        case 'l':
+            options.label_density = atof(value);
+            break;
+        case 'f':
+            options.forward_ratio = atof(value);
+            break;
+        case 'm':
+            if (asmgen_parse_mix(&options, value) != 0) {
+                fprintf(stderr, "Invalid instruction mix %s\n", value);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct asmgen_stats stats;
+    if (asmgen_write(stdout, &options, &stats) != 0) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%zu bytes, %zu lines, %zu instructions, %zu labels, %zu references\n",
+            stats.bytes, stats.lines, stats.instructions, stats.labels, stats.references);
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,47 @@
+#ifndef ASMGEN_H
+#define ASMGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ASMGEN_MNEMONICS 19
+
+struct asmgen_options
+{
+    uint64_t seed;
+    size_t bytes;
+    double label_density;
+    double forward_ratio;
+    unsigned weights[ASMGEN_MNEMONICS];
+};
+
+struct asmgen_stats
+{
+    size_t bytes;
+    size_t lines;
+    size_t instructions;
+    size_t labels;
+    size_t references;
+};
+
+/**
+ * Default options: 64 KiB, one label per 16 instructions, half of the
+ * references forward, every instruction equally likely except halt.
+ */
+void asmgen_default_options(struct asmgen_options *options);
+
+/**
+ * Parses an instruction mix such as "add=4,loop=1,out=0" into the weights.
+ * @return 0 on success, -1 on an unknown mnemonic or malformed weight
+ */
+int asmgen_parse_mix(struct asmgen_options *options, const char *mix);
+
+/**
+ * Writes syntactically valid assembly of at least options->bytes bytes.
+ * Every referenced label is defined exactly once.
+ * @return 0 on success, -1 on a write error
+ */
+int asmgen_write(FILE *out, const struct asmgen_options *options, struct asmgen_stats *stats);
+
+#endif // ASMGEN_H
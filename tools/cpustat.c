@@ -0,0 +1,265 @@
+// Live view of running emulators that publish a metrics segment.
+//
+// Build: gcc -O2 -pthread -I. -o cpustat tools/cpustat.c metrics.c cpu.c
+//
+// ./cpustat [-i SECONDS] [-n COUNT] [-e] [SEGMENT...]
+//
+// Without SEGMENT every /dev/shm/cpu-emulator.* segment is shown; emulators
+// publish one when started with CPU_METRICS=1, and segments left behind by
+// killed emulators are skipped. The default is a top-style table refreshed
+// every SECONDS (default 1) until COUNT refreshes are done; -e prints the
+// counters once in the Prometheus text exposition format.
+
+#include "metrics.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SEGMENTS 256
+#define SHM_DIRECTORY "/dev/shm"
+#define NAME_LENGTH (NAME_MAX + 2)
+
+struct previous
+{
+    char name[NAME_LENGTH];
+    size_t slot;
+    struct metrics_sample sample;
+};
+
+static struct previous previous[MAX_SEGMENTS];
+static size_t previous_count;
+
+static const char *const status_names[] = {
+    "ok", "halted", "illegal_instruction", "illegal_operand", "invalid_address",
+    "invalid_stack_operation", "div_by_zero", "io_error", "infinite_loop",
+};
+
+static const char *status_name(enum cpu_status status)
+{
+    if ((size_t) status < sizeof(status_names) / sizeof(status_names[0])) {
+        return status_names[status];
+    }
+    return "unknown";
+}
+
+static size_t find_segments(int argc, char **argv, char names[][NAME_LENGTH])
+{
+    size_t count = 0;
+    if (argc > 0) {
+        for (int i = 0; i < argc && count < MAX_SEGMENTS; ++i) {
+            snprintf(names[count++], NAME_LENGTH, "%s", argv[i]);
+        }
+        return count;
+    }
+
+    DIR *directory = opendir(SHM_DIRECTORY);
+    if (directory == NULL) {
+        return 0;
+    }
+
+    const char *prefix = METRICS_PREFIX + 1;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL && count < MAX_SEGMENTS) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+            snprintf(names[count++], NAME_LENGTH, "/%s", entry->d_name);
+        }
+    }
+
+    closedir(directory);
+    return count;
+}
+
+static struct metrics *attach_live(const char *name)
+{
+    struct metrics *metrics = metrics_attach(name);
+    if (metrics != NULL && kill(metrics_pid(metrics), 0) != 0 && errno == ESRCH) {
+        metrics_destroy(metrics);
+        return NULL;
+    }
+    return metrics;
+}
+
+static struct metrics_sample *find_previous(const char *name, size_t slot)
+{
+    for (size_t i = 0; i < previous_count; ++i) {
+        if (previous[i].slot == slot && strcmp(previous[i].name, name) == 0) {
+            return &previous[i].sample;
+        }
+    }
+
+    if (previous_count == MAX_SEGMENTS) {
+        return NULL;
+    }
+
+    struct previous *entry = &previous[previous_count++];
+    snprintf(entry->name, sizeof(entry->name), "%.*s", NAME_LENGTH - 1, name);
+    entry->slot = slot;
+    memset(&entry->sample, 0, sizeof(entry->sample));
+    return &entry->sample;
+}
+
+static void show_table(char names[][NAME_LENGTH], size_t count)
+{
+    if (isatty(STDOUT_FILENO)) {
+        printf("\033[H\033[J");
+    }
+    printf("%-24s %8s %4s %-24s %14s %12s %10s %8s %12s %12s %6s\n", "SEGMENT", "PID", "SLOT",
+            "STATUS", "STEPS", "STEPS/S", "INDEX", "STACK", "BYTES_IN", "BYTES_OUT", "UTIL%");
+
+    for (size_t i = 0; i < count; ++i) {
+        struct metrics *metrics = attach_live(names[i]);
+        if (metrics == NULL) {
+            continue;
+        }
+
+        for (size_t slot = 0; slot < metrics_slots(metrics); ++slot) {
+            struct metrics_sample sample;
+            if (!metrics_read(metrics, slot, &sample)) {
+                continue;
+            }
+
+            // rates over the last refresh, or since the segment was created the first time
+            struct metrics_sample *last = find_previous(names[i], slot);
+            struct metrics_sample since = { 0 };
+            since.updated_ns = metrics_started_ns(metrics);
+            if (last != NULL && last->updated_ns != 0) {
+                since = *last;
+            }
+
+            double wall = (double) (sample.updated_ns - since.updated_ns);
+            double rate = wall > 0 ? (double) (sample.steps - since.steps) * 1e9 / wall : 0.0;
+            double utilisation = wall > 0 ? 100.0 * (double) (sample.busy_ns - since.busy_ns) / wall : 0.0;
+
+            printf("%-24s %8d %4zu %-24s %14llu %12.0f %10d %8d %12llu %12llu %6.1f\n", names[i],
+                    (int) metrics_pid(metrics), slot, status_name(sample.status),
+                    (unsigned long long) sample.steps, rate, sample.instruction_index,
+                    sample.stack_size, (unsigned long long) sample.bytes_in,
+                    (unsigned long long) sample.bytes_out, utilisation);
+
+            if (last != NULL && sample.updated_ns != since.updated_ns) {
+                *last = sample;
+            }
+        }
+
+        metrics_destroy(metrics);
+    }
+
+    fflush(stdout);
+}
+
+static void export_metric(const char *metric, const char *type, const char *help)
+{
+    printf("# HELP cpu_emulator_%s %s\n", metric, help);
+    printf("# TYPE cpu_emulator_%s %s\n", metric, type);
+}
+
+static void show_export(char names[][NAME_LENGTH], size_t count)
+{
+    static const struct
+    {
+        const char *name;
+        const char *type;
+        const char *help;
+    } metrics_list[] = {
+        { "steps_total", "counter", "Instructions retired." },
+        { "instruction_index", "gauge", "Current instruction index." },
+        { "stack_size", "gauge", "Current stack size in cells." },
+        { "status", "gauge", "Current cpu_status value." },
+        { "bytes_in_total", "counter", "Bytes read by the guest." },
+        { "bytes_out_total", "counter", "Bytes written by the guest." },
+        { "busy_seconds_total", "counter", "Time the worker spent in cpu_run." },
+    };
+
+    for (size_t m = 0; m < sizeof(metrics_list) / sizeof(metrics_list[0]); ++m) {
+        export_metric(metrics_list[m].name, metrics_list[m].type, metrics_list[m].help);
+
+        for (size_t i = 0; i < count; ++i) {
+            struct metrics *metrics = attach_live(names[i]);
+            if (metrics == NULL) {
+                continue;
+            }
+
+            for (size_t slot = 0; slot < metrics_slots(metrics); ++slot) {
+                struct metrics_sample sample;
+                if (!metrics_read(metrics, slot, &sample)) {
+                    continue;
+                }
+
+                double values[] = {
+                    (double) sample.steps, sample.instruction_index, sample.stack_size,
+                    sample.status, (double) sample.bytes_in, (double) sample.bytes_out,
+                    (double) sample.busy_ns / 1e9,
+                };
+                printf("cpu_emulator_%s{segment=\"%s\",pid=\"%d\",slot=\"%zu\"} %.17g\n",
+                        metrics_list[m].name, names[i], (int) metrics_pid(metrics), slot, values[m]);
+            }
+
+            metrics_destroy(metrics);
+        }
+    }
+
+    fflush(stdout);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tcpustat [-i SECONDS] [-n COUNT] [-e] [SEGMENT...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 1.0;
+    long refreshes = -1;
+    bool export = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:e")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            refreshes = atol(optarg);
+            break;
+        case 'e':
+            export = true;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (interval <= 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    static char names[MAX_SEGMENTS][NAME_LENGTH];
+    if (export) {
+        show_export(names, find_segments(argc - optind, argv + optind, names));
+        return EXIT_SUCCESS;
+    }
+
+    for (long i = 0; refreshes < 0 || i < refreshes; ++i) {
+        if (i > 0) {
+            struct timespec pause = {
+                .tv_sec = (time_t) interval,
+                .tv_nsec = (long) ((interval - (double) (time_t) interval) * 1e9),
+            };
+            nanosleep(&pause, NULL);
+        }
+        show_table(names, find_segments(argc - optind, argv + optind, names));
+    }
+
+    return EXIT_SUCCESS;
+}
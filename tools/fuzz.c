@@ -0,0 +1,1310 @@
+// Differential fuzzer for the execution engines built into cpu.c and the
+// embedding API of cpuemu.c.
+//
+// Every engine listed in `engines` runs the same randomly generated image and
+// input in a forked child, and its final state is compared with the reference
+// engine, which drives the machine through cpu_step only. Mismatches, and
+// crashes of the reference itself, which agreeing engines would hide, are
+// minimised and written out as reproducer files. Every fourth case is a
+// halting program from proggen, whose reference run must also take exactly
+// the number of steps the generator computed. A third of the other cases
+// come with a small data region, read-only or copy-on-write; the cpuemu
+// engine cannot map one and sits those out. The engines of cpu.c profile
+// their runs and compare the per-cell counts too, and the parked engine parks
+// and unparks the instance between slices of its run.
+//
+// Build: gcc -O2 -pthread -I. -Itools -DNO_PROGGEN_MAIN -o fuzz tools/fuzz.c tools/proggen.c cpu.c cpuemu.c
+//
+// With -DFUZZ_CONSTEXPR the constexpr engine of cpu.hpp takes part as well:
+//   g++ -std=c++20 -O2 -I. -Itools -c tools/fuzz_constexpr.cpp
+//   gcc -O2 -I. -Itools -DNO_PROGGEN_MAIN -DFUZZ_CONSTEXPR -c tools/fuzz.c tools/proggen.c cpu.c cpuemu.c
+//   g++ -pthread -o fuzz fuzz.o proggen.o cpu.o cpuemu.o fuzz_constexpr.o
+//
+// ./fuzz regress                              fixed seeds, quick regression suite
+// ./fuzz run [SEED] [SECONDS]                 long-running job (0 seconds = forever)
+// ./fuzz case SEED                            re-run a single generated case
+// ./fuzz replay IMAGE INPUT STACK_CAPACITY STEPS [DATA ro|rw]
+
+#include "compressed.h"
+#include "cpu.h"
+#include "cpuemu.h"
+#include "decoded.h"
+#include "proggen.h"
+
+#ifdef FUZZ_CONSTEXPR
+#include "fuzz_constexpr.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_IMAGE_CELLS 256
+#define MAX_INPUT 1024
+#define MAX_STACK_CAPACITY 64
+#define MAX_DATA_CELLS 16
+#define MAX_STEPS 4096
+#define REGRESS_CASES 2000
+#define MINIMIZE_ATTEMPTS 4000
+
+struct fuzz_case
+{
+    uint64_t seed;
+    int32_t image[MAX_IMAGE_CELLS];
+    size_t image_cells;
+    char input[MAX_INPUT];
+    size_t input_length;
+    int32_t data[MAX_DATA_CELLS];
+    size_t data_cells; // 0 for no data region
+    bool data_writable;
+    size_t stack_capacity;
+    size_t steps;
+    long long expected_steps;
+};
+
+struct outcome
+{
+    int signal;
+    bool loaded;
+    int32_t registers[4];
+    enum cpu_status status;
+    int32_t instruction_index;
+    int32_t stack_size;
+    int32_t stack[MAX_STACK_CAPACITY];
+    struct cpu_stats stats;
+    // per-cell counts of cpu_set_profile, which the engines outside cpu.c lack
+    bool profiled;
+    uint64_t profile[MAX_IMAGE_CELLS];
+    long long run_result;
+    char *output;
+    size_t output_length;
+};
+
+struct engine
+{
+    const char *name;
+    long long (*run)(struct cpu *cpu, size_t steps);
+    bool detects_loops;
+    // runs from the pre-decoded form of the image
+    bool predecoded;
+    // starts while a loader thread is still reading the image
+    bool streamed;
+    // loads the image from its compressed form
+    bool compressed;
+    // parks and unparks the instance between uneven slices of RUN
+    bool parks;
+    // has no way to map a data region and sits out cases with one
+    bool without_data;
+    // engines outside cpu.c run the whole case themselves instead of RUN
+    void (*evaluate)(const struct fuzz_case *fc, struct outcome *result);
+};
+
+/**
+ * The reference engine: cpu_run semantics expressed with cpu_step alone.
+ */
+static long long reference_run(struct cpu *cpu, size_t steps)
+{
+    if (cpu_get_status(cpu) != CPU_OK) {
+        return 0;
+    }
+
+    long long performed = 0;
+    while (cpu_get_status(cpu) == CPU_OK && performed < (long long) steps) {
+        cpu_step(cpu);
+        performed++;
+    }
+
+    enum cpu_status status = cpu_get_status(cpu);
+    return (status == CPU_OK || status == CPU_HALTED) ? performed : -performed;
+}
+
+/**
+ * cpu_run with the infinite-loop detector, which may stop a case early.
+ */
+static long long detecting_run(struct cpu *cpu, size_t steps)
+{
+    if (cpu_set_loop_detection(cpu, true) != 0) {
+        abort();
+    }
+    return cpu_run(cpu, steps);
+}
+
+/**
+ * RUN in uneven slices, parking the instance between them, in memory and
+ * spilled to a file by turns. The record has to bring back the complete state
+ * and every setting, the profile counts included.
+ */
+static long long parked_run(struct cpu **cpu, long long (*run)(struct cpu *cpu, size_t steps),
+        const struct fuzz_case *fc)
+{
+    long long performed = 0;
+    for (uint64_t call = 0; performed < (long long) fc->steps && cpu_get_status(*cpu) == CPU_OK; ++call) {
+        size_t slice = 1 + (size_t) ((fc->seed + 7 * call) % 40);
+        size_t left = fc->steps - (size_t) performed;
+        long long done = run(*cpu, (slice < left) ? slice : left);
+        performed += (done < 0) ? -done : done;
+
+        FILE *spill = NULL;
+        if (call % 2 == 1 && (spill = tmpfile()) == NULL) {
+            abort();
+        }
+
+        // a guest that created a coroutine cannot be parked and runs on as it is
+        struct cpu_parked *parked = cpu_park(*cpu, NULL, 0, spill);
+        if (parked != NULL) {
+            free(*cpu);
+            if ((*cpu = cpu_unpark(parked)) == NULL) {
+                abort();
+            }
+        }
+        if (spill != NULL) {
+            fclose(spill);
+        }
+    }
+
+    enum cpu_status status = cpu_get_status(*cpu);
+    return (status == CPU_OK || status == CPU_HALTED) ? performed : -performed;
+}
+
+/**
+ * The embedding API of cpuemu.c. The step count of the case becomes the
+ * budget, which uneven cpuemu_run slices and single cpuemu_step calls use up,
+ * and the results are read back through the size-prefixed structs. Budget
+ * accounting that is off or a short struct that gets more than its size
+ * aborts the child, which shows up as a signal mismatch.
+ */
+static void cpuemu_evaluate(const struct fuzz_case *fc, struct outcome *result)
+{
+    cpuemu *emu = cpuemu_create(fc->image, fc->image_cells * sizeof(int32_t), fc->stack_capacity);
+    result->loaded = emu != NULL;
+    if (emu == NULL) {
+        return;
+    }
+
+    // 0 means no budget, which cpu_run(cpu, 0) does not have to reproduce
+    cpuemu_set_budget(emu, fc->steps);
+    long long performed = 0;
+    for (uint64_t call = 0; fc->steps > 0 && cpuemu_get_status(emu) == CPUEMU_OK; ++call) {
+        if (cpuemu_remaining_budget(emu) == 0) {
+            break;
+        }
+
+        // slices may ask for more than is left, the budget cuts them short
+        size_t slice = (size_t) ((fc->seed + 7 * call) % 40);
+        if (slice == 0) {
+            cpuemu_step(emu);
+            performed++;
+        } else {
+            long long done = cpuemu_run(emu, slice);
+            performed += (done < 0) ? -done : done;
+        }
+
+        // the budget counts retired instructions, which the failing one is not
+        enum cpuemu_status status = cpuemu_get_status(emu);
+        uint64_t retired = (uint64_t) performed - (status != CPUEMU_OK && status != CPUEMU_HALTED);
+        if (cpuemu_remaining_budget(emu) != fc->steps - retired) {
+            abort();
+        }
+    }
+
+    // an exhausted budget stops the guest where it is
+    if (fc->steps > 0 && cpuemu_get_status(emu) == CPUEMU_OK
+            && (performed != (long long) fc->steps || cpuemu_run(emu, 1) != 0 || cpuemu_step(emu) != 0)) {
+        abort();
+    }
+
+    enum cpuemu_status status = cpuemu_get_status(emu);
+    result->run_result = (status == CPUEMU_OK || status == CPUEMU_HALTED) ? performed : -performed;
+
+    // a caller built against a shorter struct gets only what it has room for
+    struct cpuemu_state state;
+    memset(&state, 0xa5, sizeof(state));
+    state.size = offsetof(struct cpuemu_state, instruction_index);
+    if (cpuemu_get_state(emu, &state) != 0 || state.instruction_index != (int32_t) 0xa5a5a5a5
+            || state.stack_size != (int32_t) 0xa5a5a5a5) {
+        abort();
+    }
+    state.size = sizeof(state);
+    if (cpuemu_get_state(emu, &state) != 0) {
+        abort();
+    }
+
+    struct cpuemu_stats stats;
+    memset(&stats, 0xa5, sizeof(stats));
+    stats.size = offsetof(struct cpuemu_stats, bytes_in);
+    if (cpuemu_get_stats(emu, &stats) != 0 || stats.bytes_in != 0xa5a5a5a5a5a5a5a5u
+            || stats.io_blocked_ns != 0xa5a5a5a5a5a5a5a5u) {
+        abort();
+    }
+    stats.size = sizeof(stats);
+    if (cpuemu_get_stats(emu, &stats) != 0) {
+        abort();
+    }
+
+    memcpy(result->registers, state.registers, sizeof(result->registers));
+    result->status = (enum cpu_status) state.status;
+    result->instruction_index = state.instruction_index;
+    result->stack_size = state.stack_size;
+    result->stats = (struct cpu_stats) {
+        .retired = stats.retired,
+        .loops_taken = stats.loops_taken,
+        .pushes = stats.pushes,
+        .pops = stats.pops,
+        .stack_high_water = stats.stack_high_water,
+        .bytes_in = stats.bytes_in,
+        .bytes_out = stats.bytes_out,
+        .io_blocked_ns = stats.io_blocked_ns,
+    };
+
+    size_t size;
+    const int32_t *stack = cpuemu_get_stack(emu, &size);
+    for (size_t i = 0; i < size && i < MAX_STACK_CAPACITY; ++i) {
+        result->stack[i] = stack[size - 1 - i];
+    }
+    cpuemu_destroy(emu);
+}
+
+#ifdef FUZZ_CONSTEXPR
+/**
+ * The constexpr engine of cpu.hpp, executed at run time.
+ */
+static void constexpr_evaluate(const struct fuzz_case *fc, struct outcome *result)
+{
+    struct fuzz_constexpr_state state;
+    fuzz_constexpr_run(fc->image, fc->image_cells, fc->input, fc->input_length, fc->data, fc->data_cells,
+            fc->data_writable, fc->stack_capacity, fc->steps, stdout, result->stack, MAX_STACK_CAPACITY, &state);
+
+    memcpy(result->registers, state.registers, sizeof(result->registers));
+    result->status = state.status;
+    result->instruction_index = state.instruction_index;
+    result->stack_size = state.stack_size;
+    result->stats = state.stats;
+    result->run_result = state.run_result;
+}
+#endif
+
+static const struct engine engines[] = {
+    { "reference", &reference_run, false, false, false, false, false, false, NULL },
+    { "cpu_run", &cpu_run, false, false, false, false, false, false, NULL },
+    { "loop_detection", &detecting_run, true, false, false, false, false, false, NULL },
+    { "predecoded", &cpu_run, false, true, false, false, false, false, NULL },
+    { "streamed", &cpu_run, false, false, true, false, false, false, NULL },
+    { "compressed", &cpu_run, false, false, false, true, false, false, NULL },
+    { "parked", &cpu_run, false, false, false, false, true, false, NULL },
+    { "cpuemu", NULL, false, false, false, false, false, true, &cpuemu_evaluate },
+#ifdef FUZZ_CONSTEXPR
+    { "constexpr", NULL, false, false, false, false, false, false, &constexpr_evaluate },
+#endif
+};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+/* Random numbers */
+
+static uint64_t rng_seed(uint64_t seed)
+{
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return z != 0 ? z : 1;
+}
+
+static uint64_t rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static int32_t rng_range(uint64_t *state, int32_t low, int32_t high)
+{
+    return low + (int32_t) (rng_next(state) % (uint64_t) (high - low + 1));
+}
+
+static int32_t random_extreme(uint64_t *state)
+{
+    static const int32_t extremes[] = { INT32_MIN, INT32_MAX, -1, 0, 1, 255, 256 };
+    return extremes[rng_next(state) % (sizeof(extremes) / sizeof(extremes[0]))];
+}
+
+static int32_t random_register(uint64_t *state)
+{
+    if (rng_next(state) % 10 != 0) {
+        return rng_range(state, REGISTER_A, REGISTER_D);
+    }
+
+    return (rng_next(state) % 2 == 0) ? rng_range(state, -2, 6) : (int32_t) rng_next(state);
+}
+
+static int32_t random_number(uint64_t *state, int32_t opcode)
+{
+    if (rng_next(state) % 8 == 0) {
+        return random_extreme(state);
+    }
+
+    if (opcode == OP_MOVR) {
+        return rng_range(state, -16, 300);
+    }
+
+    if (opcode == OP_DLOAD || opcode == OP_DSTORE) {
+        return rng_range(state, -2, MAX_DATA_CELLS + 1);
+    }
+
+    return rng_range(state, -3, 8);
+}
+
+/* Case generation */
+
+static void generate_data(uint64_t *state, struct fuzz_case *fc)
+{
+    // a third of the cases get a small data region, read-only or copy-on-write
+    if (rng_next(state) % 3 != 0) {
+        return;
+    }
+
+    fc->data_cells = (size_t) rng_range(state, 1, MAX_DATA_CELLS);
+    for (size_t i = 0; i < fc->data_cells; ++i) {
+        fc->data[i] = (rng_next(state) % 4 == 0) ? random_extreme(state) : rng_range(state, -16, 300);
+    }
+    fc->data_writable = rng_next(state) % 2 == 0;
+}
+
+static void generate_image(uint64_t *state, struct fuzz_case *fc)
+{
+    size_t target = (size_t) rng_range(state, 0, MAX_IMAGE_CELLS - 3);
+    fc->image_cells = 0;
+
+    while (fc->image_cells < target) {
+        if (rng_next(state) % 12 == 0) {
+            fc->image[fc->image_cells++] = (rng_next(state) % 2 == 0)
+                    ? rng_range(state, -2, (int32_t) OPCODE_COUNT + 8)
+                    : (int32_t) rng_next(state);
+            continue;
+        }
+
+        int32_t opcode = rng_range(state, 0, (int32_t) OPCODE_COUNT - 1);
+        if (opcode == OP_HALT && rng_next(state) % 4 != 0) {
+            opcode = OP_NOP;
+        }
+
+        // random registers seldom hold a stack size or a handle, so coroutines
+        // are often set up as `movr R N; cocreate R label; resume R`
+        if (opcode == OP_COCREATE && fc->image_cells + 8 <= target && rng_next(state) % 2 == 0) {
+            int32_t reg = rng_range(state, REGISTER_A, REGISTER_D);
+            int32_t words[] = { OP_MOVR, reg, rng_range(state, 1, 8), OP_COCREATE, reg,
+                rng_range(state, 0, (int32_t) target + 1), OP_RESUME, reg };
+            memcpy(&fc->image[fc->image_cells], words, sizeof(words));
+            fc->image_cells += sizeof(words) / sizeof(words[0]);
+            continue;
+        }
+
+        // a loop whose registers repeat at every back-edge while it counts a
+        // data cell down to a division by zero, which only the reset on
+        // `dstore` keeps the loop detector from calling infinite
+        if (opcode == OP_DSTORE && fc->data_cells > 0 && fc->image_cells + 27 <= target
+                && rng_next(state) % 2 == 0) {
+            int32_t start = (int32_t) fc->image_cells;
+            int32_t cell = rng_range(state, 0, (int32_t) fc->data_cells - 1);
+            int32_t words[] = {
+                OP_MOVR, REGISTER_D, 0, OP_DLOAD, REGISTER_B, cell, OP_DEC, REGISTER_B, OP_DSTORE, REGISTER_B, cell,
+                OP_MOVR, REGISTER_A, 1, OP_DIV, REGISTER_B,
+                OP_MOVR, REGISTER_A, 0, OP_MOVR, REGISTER_B, 0, OP_MOVR, REGISTER_C, 1, OP_LOOP, start,
+            };
+            memcpy(&fc->image[fc->image_cells], words, sizeof(words));
+            fc->image_cells += sizeof(words) / sizeof(words[0]);
+            continue;
+        }
+
+        fc->image[fc->image_cells++] = opcode;
+        if (decoded_operands[opcode] == NULL) {
+            continue;
+        }
+        for (const char *kind = decoded_operands[opcode]; *kind != '\0'; ++kind) {
+            int32_t word;
+            switch (*kind) {
+            case 'r':
+                word = random_register(state);
+                break;
+            case 'n':
+                word = random_number(state, opcode);
+                break;
+            default:
+                word = (rng_next(state) % 16 == 0)
+                        ? random_extreme(state)
+                        : rng_range(state, 0, (int32_t) target + 1);
+                break;
+            }
+            fc->image[fc->image_cells++] = word;
+        }
+    }
+}
+
+static void append_input(struct fuzz_case *fc, const char *text)
+{
+    size_t length = strlen(text);
+    if (fc->input_length + length > MAX_INPUT) {
+        return;
+    }
+
+    memcpy(fc->input + fc->input_length, text, length);
+    fc->input_length += length;
+}
+
+static void generate_input(uint64_t *state, struct fuzz_case *fc)
+{
+    static const char *const separators[] = { " ", "\n", "\t", "  ", "" };
+    static const char *const garbage[] = { "x", "-", "+", "abc", "0x1f", "--1", "\x7f" };
+
+    fc->input_length = 0;
+    int tokens = rng_range(state, 0, 64);
+    for (int i = 0; i < tokens; ++i) {
+        char token[32];
+        switch (rng_next(state) % 6) {
+        case 0:
+            snprintf(token, sizeof(token), "%s",
+                    garbage[rng_next(state) % (sizeof(garbage) / sizeof(garbage[0]))]);
+            break;
+        case 1:
+            snprintf(token, sizeof(token), "%" PRId32, random_extreme(state));
+            break;
+        case 2:
+            snprintf(token, sizeof(token), "%c", (char) rng_range(state, 'A', 'z'));
+            break;
+        default:
+            snprintf(token, sizeof(token), "%" PRId32, rng_range(state, -1000, 1000));
+            break;
+        }
+
+        append_input(fc, token);
+        append_input(fc, separators[rng_next(state) % (sizeof(separators) / sizeof(separators[0]))]);
+    }
+}
+
+/**
+ * Fills the case with a halting program from proggen.
+ * @return false if the program does not fit into a case
+ */
+static bool generate_halting(uint64_t *state, struct fuzz_case *fc)
+{
+    struct proggen_options options;
+    proggen_default_options(&options);
+    options.seed = rng_next(state);
+    options.length = (size_t) rng_range(state, 1, 24);
+    options.max_iterations = 6;
+    options.stack_pressure = 4;
+    options.io_percent = (unsigned) rng_range(state, 0, 40);
+
+    struct proggen_program program;
+    if (proggen_generate(&options, &program) != 0) {
+        return false;
+    }
+
+    bool fits = program.cells <= MAX_IMAGE_CELLS && program.input_length <= MAX_INPUT
+            && program.stack_capacity <= MAX_STACK_CAPACITY;
+    if (fits) {
+        memcpy(fc->image, program.image, program.cells * sizeof(int32_t));
+        fc->image_cells = program.cells;
+        memcpy(fc->input, program.input, program.input_length);
+        fc->input_length = program.input_length;
+        fc->stack_capacity = program.stack_capacity;
+        fc->steps = (size_t) program.steps + (size_t) rng_range(state, 0, 2);
+        fc->expected_steps = program.steps;
+    }
+
+    proggen_free(&program);
+    return fits;
+}
+
+static void generate_case(uint64_t seed, struct fuzz_case *fc)
+{
+    uint64_t state = rng_seed(seed);
+
+    fc->seed = seed;
+    fc->expected_steps = 0;
+    fc->data_cells = 0;
+    fc->data_writable = false;
+    if (seed % 4 == 0 && generate_halting(&state, fc)) {
+        return;
+    }
+
+    generate_data(&state, fc);
+    generate_image(&state, fc);
+    generate_input(&state, fc);
+    fc->stack_capacity = (size_t) rng_range(&state, 0, MAX_STACK_CAPACITY);
+    fc->steps = (size_t) rng_range(&state, 1, MAX_STEPS);
+}
+
+/* Execution */
+
+static bool write_all(int fd, const void *data, size_t length)
+{
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        length -= (size_t) written;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t length)
+{
+    char *bytes = data;
+    while (length > 0) {
+        ssize_t got = read(fd, bytes, length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        length -= (size_t) got;
+    }
+
+    return true;
+}
+
+static int temporary_file(const void *data, size_t length)
+{
+    char path[] = "/tmp/cpu-fuzz-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+
+    unlink(path);
+    if (!write_all(fd, data, length)) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/**
+ * Maps the data region of the case, as CPU_DATA does for ./cpu.
+ */
+static bool map_data(struct cpu *cpu, const struct fuzz_case *fc)
+{
+    FILE *data = fdopen(temporary_file(fc->data, fc->data_cells * sizeof(int32_t)), "rb");
+    bool mapped = data != NULL && cpu_map_data(cpu, data, fc->data_writable) == 0;
+
+    // the mapping outlives the file
+    if (data != NULL) {
+        fclose(data);
+    }
+    return mapped;
+}
+
+/**
+ * Hands the CPU the pre-decoded form of the case, as `compiler -d` writes it.
+ */
+static bool load_decoded(struct cpu *cpu, const struct fuzz_case *fc)
+{
+    static char buffer[sizeof(struct decoded_header) + MAX_IMAGE_CELLS * sizeof(struct decoded_record)];
+    const uint32_t *image = (const uint32_t *) fc->image;
+
+    struct decoded_header header = {
+        .magic = DECODED_MAGIC,
+        .version = DECODED_VERSION,
+        .cells = (uint32_t) fc->image_cells,
+        .hash = decoded_hash(image, fc->image_cells),
+    };
+    memcpy(buffer, &header, sizeof(header));
+    for (size_t i = 0; i < fc->image_cells; ++i) {
+        struct decoded_record record = decoded_record_at(image, fc->image_cells, i);
+        memcpy(buffer + sizeof(header) + i * sizeof(record), &record, sizeof(record));
+    }
+
+    FILE *file = fmemopen(buffer, sizeof(header) + fc->image_cells * sizeof(struct decoded_record), "rb");
+    bool loaded = file != NULL && cpu_load_decoded(cpu, file) == 0;
+    if (file != NULL) {
+        fclose(file);
+    }
+    return loaded;
+}
+
+/**
+ * Creates the memory from the compressed form of the case, as `compiler -z`
+ * writes it.
+ */
+static int32_t *load_compressed(const struct fuzz_case *fc, int32_t **stack_bottom)
+{
+    static uint8_t buffer[sizeof(struct compressed_header) + COMPRESSED_BOUND(MAX_IMAGE_CELLS)];
+
+    struct compressed_header header = {
+        .magic = COMPRESSED_MAGIC,
+        .version = COMPRESSED_VERSION,
+        .cells = (uint32_t) fc->image_cells,
+        .payload_bytes = (uint32_t) compressed_encode((const uint32_t *) fc->image, fc->image_cells,
+                buffer + sizeof(header)),
+    };
+    memcpy(buffer, &header, sizeof(header));
+
+    FILE *file = fmemopen(buffer, sizeof(header) + header.payload_bytes, "rb");
+    int32_t *memory = (file != NULL) ? cpu_create_memory_compressed(file, fc->stack_capacity, stack_bottom) : NULL;
+    if (file != NULL) {
+        fclose(file);
+    }
+    return memory;
+}
+
+static void execute_child(const struct engine *engine, const struct fuzz_case *fc,
+        int image_fd, int input_fd, int output_fd, int result_fd)
+{
+    struct outcome result;
+    memset(&result, 0, sizeof(result));
+
+    lseek(image_fd, 0, SEEK_SET);
+    lseek(input_fd, 0, SEEK_SET);
+    if (dup2(input_fd, STDIN_FILENO) < 0 || dup2(output_fd, STDOUT_FILENO) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+
+    if (engine->evaluate != NULL) {
+        result.loaded = true;
+        engine->evaluate(fc, &result);
+        fflush(stdout);
+        _exit(write_all(result_fd, &result, sizeof(result)) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    FILE *program = fdopen(image_fd, "rb");
+    if (program == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+
+    int32_t *stack_bottom;
+    struct cpu *cpu;
+    if (engine->streamed) {
+        cpu = cpu_create_streaming(program, fc->image_cells * sizeof(int32_t), fc->stack_capacity, &stack_bottom);
+    } else {
+        int32_t *memory = engine->compressed ? load_compressed(fc, &stack_bottom)
+                                             : cpu_create_memory(program, fc->stack_capacity, &stack_bottom);
+        cpu = (memory != NULL) ? cpu_create(memory, stack_bottom, fc->stack_capacity) : NULL;
+    }
+
+    if (cpu != NULL && engine->predecoded && !load_decoded(cpu, fc)) {
+        _exit(EXIT_FAILURE);
+    }
+
+    if (cpu != NULL && fc->data_cells > 0 && !map_data(cpu, fc)) {
+        _exit(EXIT_FAILURE);
+    }
+
+    if (cpu != NULL) {
+        result.loaded = true;
+        result.profiled = true;
+        cpu_set_profile(cpu, result.profile, MAX_IMAGE_CELLS);
+        result.run_result = engine->parks ? parked_run(&cpu, engine->run, fc) : engine->run(cpu, fc->steps);
+        struct cpu_state state;
+        cpu_get_state(cpu, &state);
+        memcpy(result.registers, state.registers, sizeof(result.registers));
+        result.status = state.status;
+        result.instruction_index = state.instruction_index;
+        result.stack_size = state.stack_size;
+        cpu_get_stats(cpu, &result.stats);
+
+        // the view is top first, result.stack bottom first; a coroutine that
+        // is still running has its stack away from STACK_BOTTOM
+        size_t size;
+        const int32_t *stack = cpu_get_stack(cpu, &size);
+        assert(size == (size_t) state.stack_size);
+        for (size_t i = 0; i < size && i < MAX_STACK_CAPACITY; ++i) {
+            result.stack[i] = stack[size - 1 - i];
+        }
+    }
+
+    fflush(stdout);
+    _exit(write_all(result_fd, &result, sizeof(result)) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void execute(const struct engine *engine, const struct fuzz_case *fc,
+        int image_fd, int input_fd, int output_fd, struct outcome *result)
+{
+    int result_pipe[2];
+    if (pipe(result_pipe) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ftruncate(output_fd, 0) != 0) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    lseek(output_fd, 0, SEEK_SET);
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0) {
+        close(result_pipe[0]);
+        execute_child(engine, fc, image_fd, input_fd, output_fd, result_pipe[1]);
+    }
+
+    close(result_pipe[1]);
+    memset(result, 0, sizeof(*result));
+    bool received = read_all(result_pipe[0], result, sizeof(*result));
+    close(result_pipe[0]);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+        continue;
+    }
+
+    if (WIFSIGNALED(wstatus)) {
+        memset(result, 0, sizeof(*result));
+        result->signal = WTERMSIG(wstatus);
+    } else if (!received) {
+        memset(result, 0, sizeof(*result));
+        result->signal = -1;
+    }
+
+    struct stat info;
+    if (fstat(output_fd, &info) != 0) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+
+    result->output_length = (size_t) info.st_size;
+    result->output = malloc(result->output_length + 1);
+    assert(result->output != NULL);
+    if (result->output_length > 0
+            && pread(output_fd, result->output, result->output_length, 0)
+                    != (ssize_t) result->output_length) {
+        perror("pread");
+        exit(EXIT_FAILURE);
+    }
+    result->output[result->output_length] = '\0';
+}
+
+/**
+ * Compares two outcomes.
+ * @return NULL if they are identical, name of the first differing field otherwise
+ */
+static const char *outcome_diff(const struct outcome *a, const struct outcome *b)
+{
+    if (a->signal != b->signal) {
+        return "signal";
+    }
+    if (a->loaded != b->loaded) {
+        return "loaded";
+    }
+    if (a->run_result != b->run_result) {
+        return "cpu_run result";
+    }
+    if (a->status != b->status) {
+        return "status";
+    }
+    if (memcmp(a->registers, b->registers, sizeof(a->registers)) != 0) {
+        return "registers";
+    }
+    if (a->instruction_index != b->instruction_index) {
+        return "instruction_index";
+    }
+    if (a->stack_size != b->stack_size) {
+        return "stack_size";
+    }
+    if (memcmp(a->stack, b->stack, sizeof(a->stack)) != 0) {
+        return "stack contents";
+    }
+    if (a->stats.retired != b->stats.retired || a->stats.loops_taken != b->stats.loops_taken
+            || a->stats.pushes != b->stats.pushes || a->stats.pops != b->stats.pops
+            || a->stats.stack_high_water != b->stats.stack_high_water
+            || a->stats.bytes_in != b->stats.bytes_in || a->stats.bytes_out != b->stats.bytes_out) {
+        return "stats";
+    }
+    if (a->profiled && b->profiled && memcmp(a->profile, b->profile, sizeof(a->profile)) != 0) {
+        return "profile";
+    }
+    if (a->output_length != b->output_length
+            || memcmp(a->output, b->output, a->output_length) != 0) {
+        return "output";
+    }
+
+    return NULL;
+}
+
+enum finding
+{
+    FINDING_NONE,
+    FINDING_MISMATCH,
+    FINDING_CRASH // the reference itself died, whatever the others did
+};
+
+/**
+ * Runs the case through every engine.
+ * @param engine_name - where to put the name of the first diverging engine
+ * @param field - where to put the name of the first diverging field, or how
+ *                the reference died
+ * @return what was found, the crash of the reference before any mismatch
+ */
+static enum finding check_case(const struct fuzz_case *fc, const char **engine_name, const char **field)
+{
+    int image_fd = temporary_file(fc->image, fc->image_cells * sizeof(int32_t));
+    int input_fd = temporary_file(fc->input, fc->input_length);
+    int output_fd = temporary_file(NULL, 0);
+
+    struct outcome reference;
+    execute(&engines[0], fc, image_fd, input_fd, output_fd, &reference);
+
+    // agreeing engines prove nothing once the reference dies as well
+    if (reference.signal != 0) {
+        *engine_name = engines[0].name;
+        *field = (reference.signal > 0) ? strsignal(reference.signal) : "no result";
+        free(reference.output);
+        close(image_fd);
+        close(input_fd);
+        close(output_fd);
+        return FINDING_CRASH;
+    }
+
+    bool mismatch = false;
+    if (fc->expected_steps != 0
+            && (reference.run_result != fc->expected_steps || reference.status != CPU_HALTED)) {
+        mismatch = true;
+        *engine_name = "proggen";
+        *field = "expected step count";
+    }
+
+    for (size_t i = 1; i < ENGINE_COUNT && !mismatch; ++i) {
+        if (engines[i].without_data && fc->data_cells > 0) {
+            continue;
+        }
+
+        struct outcome other;
+        execute(&engines[i], fc, image_fd, input_fd, output_fd, &other);
+
+        // a detected loop is only sound if the reference ran out of steps
+        const char *diff;
+        if (engines[i].detects_loops && other.status == CPU_INFINITE_LOOP) {
+            bool budget_exhausted = reference.status == CPU_OK && reference.run_result == (long long) fc->steps;
+            diff = budget_exhausted ? NULL : "infinite loop reported for a finite run";
+        } else {
+            diff = outcome_diff(&reference, &other);
+        }
+        if (diff != NULL) {
+            mismatch = true;
+            *engine_name = engines[i].name;
+            *field = diff;
+        }
+        free(other.output);
+    }
+
+    free(reference.output);
+    close(image_fd);
+    close(input_fd);
+    close(output_fd);
+    return mismatch ? FINDING_MISMATCH : FINDING_NONE;
+}
+
+/* Minimisation */
+
+/**
+ * @return true if the case still leads to FINDING, a crash of the reference
+ *         that shrinks into a mismatch is not the same bug
+ */
+static bool still_fails(const struct fuzz_case *fc, enum finding finding, int *attempts)
+{
+    const char *engine_name;
+    const char *field;
+
+    (*attempts)++;
+    return check_case(fc, &engine_name, &field) == finding;
+}
+
+static bool shrink_steps(struct fuzz_case *fc, enum finding finding, int *attempts)
+{
+    bool progress = false;
+    for (size_t delta = fc->steps / 2; delta > 0 && *attempts < MINIMIZE_ATTEMPTS;) {
+        // steps shrink by DELTA for as long as that keeps failing, never to 0
+        struct fuzz_case candidate = *fc;
+        candidate.steps -= delta;
+        if (delta < fc->steps && still_fails(&candidate, finding, attempts)) {
+            *fc = candidate;
+            progress = true;
+        } else {
+            delta /= 2;
+        }
+    }
+
+    return progress;
+}
+
+static bool shrink_image(struct fuzz_case *fc, enum finding finding, int *attempts)
+{
+    bool progress = false;
+
+    for (size_t chunk = fc->image_cells / 2; chunk > 0 && *attempts < MINIMIZE_ATTEMPTS; chunk /= 2) {
+        for (size_t start = 0; start + chunk <= fc->image_cells && *attempts < MINIMIZE_ATTEMPTS;) {
+            struct fuzz_case candidate = *fc;
+            memmove(&candidate.image[start], &candidate.image[start + chunk],
+                    (candidate.image_cells - start - chunk) * sizeof(int32_t));
+            candidate.image_cells -= chunk;
+            if (still_fails(&candidate, finding, attempts)) {
+                *fc = candidate;
+                progress = true;
+            } else {
+                start += chunk;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < fc->image_cells && *attempts < MINIMIZE_ATTEMPTS; ++i) {
+        if (fc->image[i] == 0) {
+            continue;
+        }
+        struct fuzz_case candidate = *fc;
+        candidate.image[i] = 0;
+        if (still_fails(&candidate, finding, attempts)) {
+            *fc = candidate;
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+static bool shrink_input(struct fuzz_case *fc, enum finding finding, int *attempts)
+{
+    bool progress = false;
+    for (size_t delta = fc->input_length / 2 + 1; fc->input_length > 0 && *attempts < MINIMIZE_ATTEMPTS;) {
+        struct fuzz_case candidate = *fc;
+        candidate.input_length -= (delta < candidate.input_length) ? delta : candidate.input_length;
+        if (still_fails(&candidate, finding, attempts)) {
+            *fc = candidate;
+            progress = true;
+        } else if (delta == 1) {
+            break;
+        } else {
+            delta /= 2;
+        }
+    }
+
+    return progress;
+}
+
+static bool shrink_stack(struct fuzz_case *fc, enum finding finding, int *attempts)
+{
+    bool progress = false;
+    while (fc->stack_capacity > 0 && *attempts < MINIMIZE_ATTEMPTS) {
+        struct fuzz_case candidate = *fc;
+        candidate.stack_capacity--;
+        if (!still_fails(&candidate, finding, attempts)) {
+            break;
+        }
+        *fc = candidate;
+        progress = true;
+    }
+
+    return progress;
+}
+
+static void minimize(struct fuzz_case *fc, enum finding finding)
+{
+    int attempts = 0;
+    bool progress = true;
+    while (progress && attempts < MINIMIZE_ATTEMPTS) {
+        progress = shrink_steps(fc, finding, &attempts);
+        progress |= shrink_image(fc, finding, &attempts);
+        progress |= shrink_input(fc, finding, &attempts);
+        progress |= shrink_stack(fc, finding, &attempts);
+    }
+}
+
+/* Reporting */
+
+static void dump_file(const char *path, const void *data, size_t length)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(data, 1, length, file) != length) {
+        perror(path);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+}
+
+static void report_finding(const struct fuzz_case *fc, enum finding finding, const char *engine_name,
+        const char *field)
+{
+    if (finding == FINDING_CRASH) {
+        fprintf(stderr, "CRASH seed %" PRIu64 ": engine '%s' died: %s\n", fc->seed, engine_name, field);
+    } else {
+        fprintf(stderr, "MISMATCH seed %" PRIu64 ": engine '%s' differs from reference in %s\n",
+                fc->seed, engine_name, field);
+    }
+
+    struct fuzz_case minimal = *fc;
+    if (minimal.expected_steps == 0) {
+        minimize(&minimal, finding);
+    }
+
+    char image_path[64];
+    char input_path[64];
+    snprintf(image_path, sizeof(image_path), "fuzz-%" PRIu64 ".bin", fc->seed);
+    snprintf(input_path, sizeof(input_path), "fuzz-%" PRIu64 ".in", fc->seed);
+    dump_file(image_path, minimal.image, minimal.image_cells * sizeof(int32_t));
+    dump_file(input_path, minimal.input, minimal.input_length);
+
+    char data_arguments[80] = "";
+    if (minimal.data_cells > 0) {
+        char data_path[64];
+        snprintf(data_path, sizeof(data_path), "fuzz-%" PRIu64 ".data", fc->seed);
+        dump_file(data_path, minimal.data, minimal.data_cells * sizeof(int32_t));
+        snprintf(data_arguments, sizeof(data_arguments), " %s %s", data_path, minimal.data_writable ? "rw" : "ro");
+    }
+
+    fprintf(stderr, "minimised to %zu cells, %zu input bytes, stack capacity %zu, %zu steps\n",
+            minimal.image_cells, minimal.input_length, minimal.stack_capacity, minimal.steps);
+    fprintf(stderr, "reproduce: ./fuzz replay %s %s %zu %zu%s\n",
+            image_path, input_path, minimal.stack_capacity, minimal.steps, data_arguments);
+}
+
+static enum finding run_case(const struct fuzz_case *fc)
+{
+    const char *engine_name;
+    const char *field;
+
+    enum finding finding = check_case(fc, &engine_name, &field);
+    if (finding != FINDING_NONE) {
+        report_finding(fc, finding, engine_name, field);
+    }
+    return finding;
+}
+
+/**
+ * Streams images that end before their declared size: an instruction that
+ * arrived in full runs, one whose operand never arrives stops the guest, and
+ * an image whose pipe stalls can still be given up on.
+ */
+static bool check_truncated_streams(void)
+{
+    static const int32_t halting[] = { OP_MOVR, REGISTER_A, 7, OP_HALT };
+    static const int32_t cut[] = { OP_MOVR, REGISTER_A, 7, OP_MOVR, REGISTER_B }; // without the number
+    const struct
+    {
+        const int32_t *image;
+        size_t cells;
+        enum cpu_status expected;
+    } streams[] = {
+        { halting, sizeof(halting) / sizeof(halting[0]), CPU_HALTED },
+        { cut, sizeof(cut) / sizeof(cut[0]), CPU_INVALID_ADDRESS },
+    };
+
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); ++i) {
+        int fd = temporary_file(streams[i].image, streams[i].cells * sizeof(int32_t));
+        lseek(fd, 0, SEEK_SET);
+        FILE *program = fdopen(fd, "rb");
+        assert(program != NULL);
+
+        int32_t *stack_bottom;
+        size_t declared = (streams[i].cells + 16) * sizeof(int32_t);
+        struct cpu *cpu = cpu_create_streaming(program, declared, 16, &stack_bottom);
+        assert(cpu != NULL);
+        cpu_run(cpu, 100);
+        if (cpu_get_status(cpu) != streams[i].expected || cpu_get_register(cpu, REGISTER_A) != 7) {
+            printf("truncated stream %zu: status %d, expected %d\n", i, cpu_get_status(cpu), streams[i].expected);
+            passed = false;
+        }
+
+        cpu_destroy(cpu);
+        free(cpu);
+        fclose(program);
+    }
+
+    // a pipe whose writer stalls must not keep cpu_destroy() waiting for the
+    // rest of the image; a hang ends the run with SIGALRM
+    int stalled[2];
+    if (pipe(stalled) != 0 || !write_all(stalled[1], halting, sizeof(halting))) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    FILE *program = fdopen(stalled[0], "rb");
+    assert(program != NULL);
+
+    alarm(10);
+    int32_t *stack_bottom;
+    struct cpu *cpu = cpu_create_streaming(program, sizeof(halting) + 4096, 16, &stack_bottom);
+    assert(cpu != NULL);
+    cpu_run(cpu, 100);
+    if (cpu_get_status(cpu) != CPU_HALTED) {
+        printf("stalled stream: status %d, expected %d\n", cpu_get_status(cpu), CPU_HALTED);
+        passed = false;
+    }
+    cpu_destroy(cpu);
+    free(cpu);
+    alarm(0);
+
+    fclose(program);
+    close(stalled[1]);
+    return passed;
+}
+
+/* Modes */
+
+static int regress(void)
+{
+    struct fuzz_case fc;
+    int findings[FINDING_CRASH + 1] = { 0 };
+
+    for (uint64_t seed = 1; seed <= REGRESS_CASES; ++seed) {
+        generate_case(seed, &fc);
+        findings[run_case(&fc)]++;
+    }
+
+    if (!check_truncated_streams()) {
+        findings[FINDING_MISMATCH]++;
+    }
+
+    printf("%d cases, %zu engines, %d mismatches, %d crashes\n", REGRESS_CASES, ENGINE_COUNT,
+            findings[FINDING_MISMATCH], findings[FINDING_CRASH]);
+    return findings[FINDING_MISMATCH] + findings[FINDING_CRASH] == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run_forever(uint64_t seed, long seconds)
+{
+    struct fuzz_case fc;
+    time_t start = time(NULL);
+    time_t last_report = start;
+    unsigned long long cases = 0;
+    int findings[FINDING_CRASH + 1] = { 0 };
+
+    printf("fuzzing %zu engines from seed %" PRIu64 "\n", ENGINE_COUNT, seed);
+    while (seconds <= 0 || time(NULL) - start < seconds) {
+        generate_case(seed + cases, &fc);
+        findings[run_case(&fc)]++;
+        cases++;
+
+        time_t now = time(NULL);
+        if (now - last_report >= 10) {
+            printf("%llu cases, %.1f cases/s, %d mismatches, %d crashes\n", cases,
+                    (double) cases / (double) (now - start), findings[FINDING_MISMATCH], findings[FINDING_CRASH]);
+            fflush(stdout);
+            last_report = now;
+        }
+    }
+
+    printf("%llu cases, %d mismatches, %d crashes\n", cases, findings[FINDING_MISMATCH], findings[FINDING_CRASH]);
+    return findings[FINDING_MISMATCH] + findings[FINDING_CRASH] == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool load_file(const char *path, void *data, size_t capacity, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    *length = fread(data, 1, capacity, file);
+    bool fits = fgetc(file) == EOF;
+    fclose(file);
+
+    if (!fits) {
+        fprintf(stderr, "%s: larger than %zu bytes\n", path, capacity);
+    }
+    return fits;
+}
+
+static int replay(int argc, char *argv[])
+{
+    struct fuzz_case fc;
+    memset(&fc, 0, sizeof(fc));
+
+    size_t image_bytes;
+    if (!load_file(argv[0], fc.image, sizeof(fc.image), &image_bytes)
+            || !load_file(argv[1], fc.input, sizeof(fc.input), &fc.input_length)) {
+        return EXIT_FAILURE;
+    }
+
+    if (image_bytes % sizeof(int32_t) != 0) {
+        // cpu_create_memory rejects such images, keep the trailing bytes out of the case
+        fprintf(stderr, "warning: image size is not a multiple of %zu\n", sizeof(int32_t));
+    }
+
+    fc.image_cells = image_bytes / sizeof(int32_t);
+    fc.stack_capacity = strtoul(argv[2], NULL, 10);
+    fc.steps = strtoul(argv[3], NULL, 10);
+    if (fc.stack_capacity > MAX_STACK_CAPACITY) {
+        fprintf(stderr, "stack capacity is limited to %d\n", MAX_STACK_CAPACITY);
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 6) {
+        size_t data_bytes;
+        if (!load_file(argv[4], fc.data, sizeof(fc.data), &data_bytes)) {
+            return EXIT_FAILURE;
+        }
+        fc.data_cells = data_bytes / sizeof(int32_t);
+        fc.data_writable = strcmp(argv[5], "rw") == 0;
+    }
+
+    return run_case(&fc) == FINDING_NONE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "\tfuzz regress\n");
+    fprintf(stderr, "\tfuzz run [SEED] [SECONDS]\n");
+    fprintf(stderr, "\tfuzz case SEED\n");
+    fprintf(stderr, "\tfuzz replay IMAGE INPUT STACK_CAPACITY STEPS [DATA ro|rw]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "regress") == 0 && argc == 2) {
+        return regress();
+    }
+
+    if (strcmp(argv[1], "run") == 0 && argc <= 4) {
+        uint64_t seed = (argc > 2) ? strtoull(argv[2], NULL, 10) : (uint64_t) time(NULL);
+        long seconds = (argc > 3) ? strtol(argv[3], NULL, 10) : 0;
+        return run_forever(seed, seconds);
+    }
+
+    if (strcmp(argv[1], "case") == 0 && argc == 3) {
+        struct fuzz_case fc;
+        generate_case(strtoull(argv[2], NULL, 10), &fc);
+        return run_case(&fc) == FINDING_NONE ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "replay") == 0 && (argc == 6 || argc == 8)) {
+        return replay(argc - 2, &argv[2]);
+    }
+
+    usage();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,80 @@
+// The engine of cpu.hpp behind a C interface, for tools/fuzz.c. The static
+// assertions below run small programs through it inside the compiler.
+
+#include "fuzz_constexpr.h"
+
+#include "cpu.hpp"
+
+#include <array>
+#include <string_view>
+
+namespace {
+
+static_assert(static_cast<int>(constexpr_cpu::status::io_error) == CPU_IO_ERROR);
+static_assert(static_cast<int>(constexpr_cpu::status::infinite_loop) == CPU_INFINITE_LOOP);
+
+// in A, in B, add B, out A, halt
+constexpr std::array<std::int32_t, 9> sum = { 12, 0, 12, 1, 2, 1, 14, 0, 1 };
+constexpr auto summed = constexpr_cpu::evaluate(sum, 4, std::string_view(" 40\n2"), 100);
+static_assert(summed.status == constexpr_cpu::status::halted);
+static_assert(summed.run_result == 5 && summed.stats.bytes_in == 5);
+static_assert(summed.output_view() == "42");
+
+// get A at end of input sets A to -1 and C to 0, then push A, push A overflows a one-cell stack
+constexpr std::array<std::int32_t, 6> overflow = { 13, 0, 17, 0, 17, 0 };
+constexpr auto overflowed = constexpr_cpu::evaluate(overflow, 1, std::string_view(), 100);
+static_assert(overflowed.status == constexpr_cpu::status::invalid_stack_operation);
+static_assert(overflowed.run_result == -3 && overflowed.instruction_index == 5);
+static_assert(overflowed.registers[constexpr_cpu::register_a] == -1 && overflowed.stack_size == 1);
+
+// the zero padding runs as nops up to the stack
+constexpr std::array<std::int32_t, 0> empty = {};
+constexpr auto padded = constexpr_cpu::evaluate(empty, 24, std::string_view(), 2000);
+static_assert(padded.status == constexpr_cpu::status::invalid_address);
+static_assert(padded.run_result == -1001 && padded.instruction_index == 1000);
+
+// movr B 5, dstore B 1, dload A 1, dsize C, halt on a copy-on-write region of three cells
+constexpr std::int32_t loaded_back = [] {
+    constexpr std::array<std::int32_t, 12> image = { 9, 1, 5, 0x1b, 1, 1, 0x1a, 0, 1, 0x1c, 2, 1 };
+    constexpr std::array<std::int32_t, 3> data = { 1, 2, 3 };
+    constexpr_cpu::machine cpu(image, 4);
+    cpu.set_data(data, true);
+    cpu.run(100);
+    return cpu.get_register(constexpr_cpu::register_a) * 10 + cpu.get_register(constexpr_cpu::register_c);
+}();
+static_assert(loaded_back == 53);
+
+} // namespace
+
+extern "C" void fuzz_constexpr_run(const int32_t *image, size_t image_cells, const char *input,
+        size_t input_length, const int32_t *data, size_t data_cells, bool data_writable, size_t stack_capacity,
+        size_t steps, FILE *out, int32_t *stack, size_t stack_cells, struct fuzz_constexpr_state *state)
+{
+    constexpr_cpu::machine cpu({ image, image_cells }, stack_capacity, { input, input_length });
+    cpu.set_data({ data, data_cells }, data_writable);
+
+    state->run_result = cpu.run(steps);
+    for (size_t reg = constexpr_cpu::register_a; reg <= constexpr_cpu::register_d; ++reg) {
+        state->registers[reg] = cpu.get_register(reg);
+    }
+    state->status = static_cast<enum cpu_status>(cpu.get_status());
+    state->instruction_index = cpu.instruction_index();
+    state->stack_size = cpu.stack_size();
+
+    const constexpr_cpu::stats &stats = cpu.get_stats();
+    state->stats = {};
+    state->stats.retired = stats.retired;
+    state->stats.loops_taken = stats.loops_taken;
+    state->stats.pushes = stats.pushes;
+    state->stats.pops = stats.pops;
+    state->stats.stack_high_water = stats.stack_high_water;
+    state->stats.bytes_in = stats.bytes_in;
+    state->stats.bytes_out = stats.bytes_out;
+
+    for (size_t i = 0; i < stack_cells && i < static_cast<size_t>(state->stack_size); ++i) {
+        stack[i] = cpu.stack_cell(i);
+    }
+
+    std::string_view output = cpu.output();
+    fwrite(output.data(), 1, output.size(), out);
+}
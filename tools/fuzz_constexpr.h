@@ -0,0 +1,36 @@
+#ifndef FUZZ_CONSTEXPR_H
+#define FUZZ_CONSTEXPR_H
+
+#include "cpu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fuzz_constexpr_state
+{
+    int32_t registers[4];
+    enum cpu_status status;
+    int32_t instruction_index;
+    int32_t stack_size;
+    struct cpu_stats stats;
+    long long run_result;
+};
+
+// Runs an image through the engine of cpu.hpp as cpu_run() would, with
+// DATA_CELLS cells of DATA as its data region. The guest output goes to OUT
+// and the first STACK_CELLS stack cells, counted from the bottom, to STACK.
+void fuzz_constexpr_run(const int32_t *image, size_t image_cells, const char *input, size_t input_length,
+        const int32_t *data, size_t data_cells, bool data_writable, size_t stack_capacity, size_t steps,
+        FILE *out, int32_t *stack, size_t stack_cells, struct fuzz_constexpr_state *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FUZZ_CONSTEXPR_H
@@ -0,0 +1,511 @@
+// Random guest program generator.
+//
+// Build: gcc -O2 -o proggen tools/proggen.c
+//
+// ./proggen [-s SEED] [-n LENGTH] [-d DEPTH] [-k ITERATIONS] [-p STACK_PRESSURE]
+//           [-i IO_PERCENT] [-m MIX] PREFIX
+//
+// Writes PREFIX.bin and PREFIX.in and prints the exact cpu_run result and the
+// stack capacity the program needs. Programs are built from counted loops
+// only, so control flow never depends on data: every program halts, its step
+// count is computed while generating it, and the input holds exactly the
+// numbers and characters that its `in` and `get` instructions consume.
+//
+// Register conventions of generated code: c is only touched by the loop
+// scaffolding (`push c; movr c N; ...; dec c; loop; pop c`), d is set right
+// before every load/store, and divisors and `put` operands are set right
+// before use, so no program faults. Arithmetic may wrap around.
+
+#include "proggen.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum opcode
+{
+    OP_NOP,
+    OP_HALT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_INC,
+    OP_DEC,
+    OP_LOOP,
+    OP_MOVR,
+    OP_LOAD,
+    OP_STORE,
+    OP_IN,
+    OP_GET,
+    OP_OUT,
+    OP_PUT,
+    OP_SWAP,
+    OP_PUSH,
+    OP_POP
+};
+
+enum reg
+{
+    REG_A,
+    REG_B,
+    REG_C,
+    REG_D
+};
+
+static const char *const mnemonics[PROGGEN_MNEMONICS] = {
+    "nop", "halt", "add", "sub", "mul", "div", "inc", "dec", "loop", "movr",
+    "load", "store", "in", "get", "out", "put", "swap", "push", "pop"
+};
+
+// upper bound on the number of items in a nested loop body
+#define BODY_ITEMS 8
+
+struct words
+{
+    int32_t *data;
+    size_t cells;
+    size_t capacity;
+};
+
+struct text
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+struct generator
+{
+    const struct proggen_options *options;
+    uint64_t state;
+    struct words code;
+    size_t max_stack;
+};
+
+static uint64_t next_random(struct generator *gen)
+{
+    gen->state ^= gen->state >> 12;
+    gen->state ^= gen->state << 25;
+    gen->state ^= gen->state >> 27;
+    return gen->state * 0x2545f4914f6cdd1dULL;
+}
+
+static int32_t random_between(struct generator *gen, int32_t low, int32_t high)
+{
+    return low + (int32_t) (next_random(gen) % (uint64_t) (high - low + 1));
+}
+
+static void emit(struct generator *gen, int32_t word)
+{
+    struct words *code = &gen->code;
+    if (code->cells == code->capacity) {
+        code->capacity = (code->capacity > 0) ? code->capacity * 2 : 256;
+        int32_t *data = realloc(code->data, code->capacity * sizeof(*data));
+        assert(data != NULL);
+        code->data = data;
+    }
+
+    code->data[code->cells++] = word;
+}
+
+static void append(struct text *text, const char *data, size_t length)
+{
+    if (text->length + length + 1 > text->capacity) {
+        while (text->length + length + 1 > text->capacity) {
+            text->capacity = (text->capacity > 0) ? text->capacity * 2 : 256;
+        }
+        char *grown = realloc(text->data, text->capacity);
+        assert(grown != NULL);
+        text->data = grown;
+    }
+
+    memcpy(text->data + text->length, data, length);
+    text->length += length;
+    text->data[text->length] = '\0';
+}
+
+/**
+ * Any register, for instructions that only read their operand.
+ */
+static int32_t source_register(struct generator *gen)
+{
+    return random_between(gen, REG_A, REG_D);
+}
+
+/**
+ * a, b or d, for instructions that write their operand; c is the loop counter.
+ */
+static int32_t target_register(struct generator *gen)
+{
+    static const int32_t targets[] = { REG_A, REG_B, REG_D };
+    return targets[next_random(gen) % 3];
+}
+
+static enum opcode pick(struct generator *gen)
+{
+    const struct proggen_options *options = gen->options;
+    bool io = (unsigned) random_between(gen, 0, 99) < options->io_percent;
+
+    unsigned total = 0;
+    for (int op = 0; op < PROGGEN_MNEMONICS; ++op) {
+        bool is_io = op >= OP_IN && op <= OP_PUT;
+        if (is_io == io && op != OP_HALT) {
+            total += options->weights[op];
+        }
+    }
+    if (total == 0) {
+        return OP_NOP;
+    }
+
+    unsigned choice = (unsigned) (next_random(gen) % total);
+    for (int op = 0; op < PROGGEN_MNEMONICS; ++op) {
+        bool is_io = op >= OP_IN && op <= OP_PUT;
+        if (is_io != io || op == OP_HALT) {
+            continue;
+        }
+        if (choice < options->weights[op]) {
+            return op;
+        }
+        choice -= options->weights[op];
+    }
+
+    return OP_NOP;
+}
+
+static long long generate_block(struct generator *gen, size_t items, unsigned depth, size_t stack,
+        struct text *io);
+
+static long long generate_loop(struct generator *gen, unsigned depth, size_t stack, struct text *io)
+{
+    int32_t iterations = random_between(gen, 1, (int32_t) gen->options->max_iterations);
+
+    emit(gen, OP_PUSH);
+    emit(gen, REG_C);
+    emit(gen, OP_MOVR);
+    emit(gen, REG_C);
+    emit(gen, iterations);
+
+    int32_t top = (int32_t) gen->code.cells;
+    struct text body_io = { 0 };
+    size_t items = (size_t) random_between(gen, 1, BODY_ITEMS);
+    long long body = generate_block(gen, items, depth + 1, stack + 1, &body_io);
+
+    emit(gen, OP_DEC);
+    emit(gen, REG_C);
+    emit(gen, OP_LOOP);
+    emit(gen, top);
+    emit(gen, OP_POP);
+    emit(gen, REG_C);
+
+    for (int32_t i = 0; i < iterations; ++i) {
+        append(io, body_io.data != NULL ? body_io.data : "", body_io.length);
+    }
+    free(body_io.data);
+
+    return 3 + (long long) iterations * (body + 2);
+}
+
+/**
+ * Emits one instruction, or a short fixed sequence around it.
+ * @return number of steps it takes
+ */
+static long long generate_unit(struct generator *gen, enum opcode op, unsigned depth, size_t stack,
+        size_t *local, struct text *io)
+{
+    char buffer[16];
+
+    switch (op) {
+    case OP_LOOP:
+        if (depth < gen->options->max_depth) {
+            return generate_loop(gen, depth, stack + *local, io);
+        }
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_OUT:
+        emit(gen, op);
+        emit(gen, source_register(gen));
+        return 1;
+    case OP_DIV:
+        emit(gen, OP_MOVR);
+        emit(gen, REG_B);
+        emit(gen, random_between(gen, 2, 9));
+        emit(gen, OP_DIV);
+        emit(gen, REG_B);
+        return 2;
+    case OP_INC:
+    case OP_DEC:
+    case OP_POP:
+        if (op == OP_POP && *local == 0) {
+            break;
+        }
+        emit(gen, op);
+        emit(gen, target_register(gen));
+        *local -= (op == OP_POP) ? 1 : 0;
+        return 1;
+    case OP_MOVR:
+        emit(gen, OP_MOVR);
+        emit(gen, target_register(gen));
+        emit(gen, random_between(gen, -1000, 1000));
+        return 1;
+    case OP_LOAD:
+    case OP_STORE: {
+        size_t reachable = (op == OP_LOAD) ? stack + *local : *local;
+        if (reachable == 0) {
+            break;
+        }
+        emit(gen, OP_MOVR);
+        emit(gen, REG_D);
+        emit(gen, 0);
+        emit(gen, op);
+        emit(gen, (op == OP_LOAD) ? target_register(gen) : source_register(gen));
+        emit(gen, random_between(gen, 0, (int32_t) reachable - 1));
+        return 2;
+    }
+    case OP_IN:
+        emit(gen, OP_IN);
+        emit(gen, target_register(gen));
+        snprintf(buffer, sizeof(buffer), " %d", random_between(gen, -1000, 1000));
+        append(io, buffer, strlen(buffer));
+        return 1;
+    case OP_GET:
+        emit(gen, OP_GET);
+        emit(gen, target_register(gen));
+        buffer[0] = (char) random_between(gen, 'a', 'z');
+        append(io, buffer, 1);
+        return 1;
+    case OP_PUT:
+        emit(gen, OP_MOVR);
+        emit(gen, REG_B);
+        emit(gen, (next_random(gen) % 8 == 0) ? '\n' : random_between(gen, ' ', '~'));
+        emit(gen, OP_PUT);
+        emit(gen, REG_B);
+        return 2;
+    case OP_SWAP:
+        emit(gen, OP_SWAP);
+        emit(gen, target_register(gen));
+        emit(gen, target_register(gen));
+        return 1;
+    case OP_PUSH:
+        if (*local >= gen->options->stack_pressure) {
+            break;
+        }
+        emit(gen, OP_PUSH);
+        emit(gen, source_register(gen));
+        (*local)++;
+        if (stack + *local > gen->max_stack) {
+            gen->max_stack = stack + *local;
+        }
+        return 1;
+    default:
+        break;
+    }
+
+    emit(gen, OP_NOP);
+    return 1;
+}
+
+static long long generate_block(struct generator *gen, size_t items, unsigned depth, size_t stack,
+        struct text *io)
+{
+    long long steps = 0;
+    size_t local = 0;
+
+    if (stack > gen->max_stack) {
+        gen->max_stack = stack;
+    }
+
+    for (size_t i = 0; i < items; ++i) {
+        steps += generate_unit(gen, pick(gen), depth, stack, &local, io);
+    }
+
+    // leave the stack as the block found it
+    for (; local > 0; --local) {
+        emit(gen, OP_POP);
+        emit(gen, target_register(gen));
+        steps++;
+    }
+
+    return steps;
+}
+
+void proggen_default_options(struct proggen_options *options)
+{
+    assert(options != NULL);
+
+    options->seed = 1;
+    options->length = 64;
+    options->max_depth = 3;
+    options->max_iterations = 16;
+    options->stack_pressure = 8;
+    options->io_percent = 5;
+    for (int op = 0; op < PROGGEN_MNEMONICS; ++op) {
+        options->weights[op] = 4;
+    }
+    options->weights[OP_HALT] = 0;
+    options->weights[OP_LOOP] = 2;
+}
+
+int proggen_parse_mix(struct proggen_options *options, const char *mix)
+{
+    assert(options != NULL);
+    assert(mix != NULL);
+
+    while (*mix != '\0') {
+        size_t length = strcspn(mix, "=");
+        if (mix[length] != '=') {
+            return -1;
+        }
+
+        int index = -1;
+        for (int op = 0; op < PROGGEN_MNEMONICS; ++op) {
+            if (strlen(mnemonics[op]) == length && strncmp(mnemonics[op], mix, length) == 0) {
+                index = op;
+            }
+        }
+        if (index < 0) {
+            return -1;
+        }
+
+        char *end;
+        unsigned long weight = strtoul(mix + length + 1, &end, 10);
+        if (end == mix + length + 1 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        options->weights[index] = (unsigned) weight;
+        mix = (*end == ',') ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+int proggen_generate(const struct proggen_options *options, struct proggen_program *program)
+{
+    assert(options != NULL);
+    assert(program != NULL);
+
+    if (options->max_iterations == 0 || options->io_percent > 100) {
+        return -1;
+    }
+
+    struct generator gen = {
+        .options = options,
+        .state = options->seed * 0x9e3779b97f4a7c15ULL + 1,
+    };
+    struct text io = { 0 };
+
+    long long steps = generate_block(&gen, options->length, 0, 0, &io);
+    emit(&gen, OP_HALT);
+
+    program->image = gen.code.data;
+    program->cells = gen.code.cells;
+    program->input = (io.data != NULL) ? io.data : calloc(1, 1);
+    assert(program->input != NULL);
+    program->input_length = io.length;
+    program->steps = steps + 1;
+    program->stack_capacity = gen.max_stack;
+    return 0;
+}
+
+void proggen_free(struct proggen_program *program)
+{
+    assert(program != NULL);
+
+    free(program->image);
+    free(program->input);
+    program->image = NULL;
+    program->input = NULL;
+}
+
+#ifndef NO_PROGGEN_MAIN
+static bool write_file(const char *prefix, const char *suffix, const void *data, size_t length)
+{
+    char *path = malloc(strlen(prefix) + strlen(suffix) + 1);
+    assert(path != NULL);
+    sprintf(path, "%s%s", prefix, suffix);
+
+    FILE *file = fopen(path, "wb");
+    bool ok = file != NULL && fwrite(data, 1, length, file) == length;
+    ok &= file != NULL && fclose(file) == 0;
+    if (!ok) {
+        fprintf(stderr, "Unable to write file %s\n", path);
+    }
+
+    free(path);
+    return ok;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "USAGE:\n");
+    fprintf(stderr, "%s [-s SEED] [-n LENGTH] [-d DEPTH] [-k ITERATIONS] [-p STACK_PRESSURE]\n", program);
+    fprintf(stderr, "\t[-i IO_PERCENT] [-m MIX] PREFIX\n");
+    fprintf(stderr, "\twrites PREFIX.bin and PREFIX.in, prints the step count and stack capacity\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct proggen_options options;
+    proggen_default_options(&options);
+
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        const char *value = argv[i + 1];
+        switch (argv[i][1]) {
+        case 's':
+            options.seed = strtoull(value, NULL, 10);
+            break;
+        case 'n':
+            options.length = strtoull(value, NULL, 10);
+            break;
+        case 'd':
+            options.max_depth = (unsigned) atoi(value);
+            break;
+        case 'k':
+            options.max_iterations = (unsigned) atoi(value);
+            break;
+        case 'p':
+            options.stack_pressure = (unsigned) atoi(value);
+            break;
+        case 'i':
+            options.io_percent = (unsigned) atoi(value);
+            break;
+        case 'm':
+            if (proggen_parse_mix(&options, value) != 0) {
+                fprintf(stderr, "Invalid instruction mix %s\n", value);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (i + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct proggen_program program;
+    if (proggen_generate(&options, &program) != 0) {
+        fprintf(stderr, "Invalid options\n");
+        return EXIT_FAILURE;
+    }
+
+    bool ok = write_file(argv[i], ".bin", program.image, program.cells * sizeof(int32_t))
+            && write_file(argv[i], ".in", program.input, program.input_length);
+    if (ok) {
+        printf("steps %lld\nstack_capacity %zu\ncells %zu\ninput_bytes %zu\n", program.steps,
+                program.stack_capacity, program.cells, program.input_length);
+    }
+
+    proggen_free(&program);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
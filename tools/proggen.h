@@ -0,0 +1,53 @@
+#ifndef PROGGEN_H
+#define PROGGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROGGEN_MNEMONICS 19
+
+struct proggen_options
+{
+    uint64_t seed;
+    size_t length;
+    unsigned max_depth;
+    unsigned max_iterations;
+    unsigned stack_pressure;
+    unsigned io_percent;
+    unsigned weights[PROGGEN_MNEMONICS];
+};
+
+struct proggen_program
+{
+    int32_t *image;
+    size_t cells;
+    char *input;
+    size_t input_length;
+    long long steps;
+    size_t stack_capacity;
+};
+
+/**
+ * Default options: 64 instructions per block, loops nested 3 deep with up to
+ * 16 iterations each, up to 8 values of stack pressure, 5 % I/O.
+ */
+void proggen_default_options(struct proggen_options *options);
+
+/**
+ * Parses an instruction mix such as "add=4,loop=1,out=0" into the weights.
+ * The weight of `loop` controls how often a loop is opened, `halt` is ignored.
+ * @return 0 on success, -1 on an unknown mnemonic or malformed weight
+ */
+int proggen_parse_mix(struct proggen_options *options, const char *mix);
+
+/**
+ * Generates a program that halts after exactly program->steps steps of
+ * cpu_run when fed program->input and given program->stack_capacity cells of
+ * stack. The caller releases it with proggen_free().
+ * @return 0 on success, -1 if the options are invalid
+ */
+int proggen_generate(const struct proggen_options *options, struct proggen_program *program);
+
+void proggen_free(struct proggen_program *program);
+
+#endif // PROGGEN_H